@@ -0,0 +1,441 @@
+// shellbench.c is the benchmark suite of the shell. It runs the
+// shell's own code without a terminal, the way a script is run,
+// and measures its execution paths:
+//		spawn		latency of a simple command (executeNormal()) per launcher
+//		pipeline	throughput of | chains of 2 to 16 stages
+//		redirect	throughput of >, >>, < and |>
+//		fanout		throughput of || and ||| with 2 and 4 consumers
+//		history		insert and lookup with 10^3 to 10^6 commands
+//		tokenizer	parsing speed of long lines
+//
+// Build and run from the top of the repository:
+//		make bench
+//		./shellbench [payload MB] [benchmark...] > results.json
+//
+// Without names, all the benchmarks are run. Every result is printed
+// as one JSON object per line, e.g.
+//		{"bench":"pipeline","stages":4,"bytes":67108864,"seconds":0.120,"mb_per_s":533.3}
+// so that the results of two versions can be compared with any JSON
+// tool. The data benchmarks are run 3 times and report the fastest
+// run. The output of the commands and the status lines of the shell
+// go to /dev/null. A command that fails makes its result an "error"
+// instead of a time, e.g.
+//		{"bench":"pipeline","stages":4,"error":"exit status 127"}
+// and shellbench then exits with status 1.
+
+#define SHELL_NO_MAIN
+#include "../shell.c"
+
+// Number of runs of every data benchmark
+#define BENCH_RUNS 3
+
+// Where the results go, the original standard output
+FILE *results;
+
+// Number of bytes pushed through the data benchmarks
+long long iPayload = 64LL << 20;
+
+// Number of results that are errors, and the exit
+// status of the last command that failed
+int iNumErrors = 0;
+int iFailedStatus = 0;
+
+// compareDoubles() is the qsort() comparison
+// function for an array of doubles.
+int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// runLine() function parses and executes one command line
+// the way a script does, and returns the seconds it took
+// to execute it, or -1 if it failed. The time of a line
+// that didn't do its work must not pass for a result.
+double runLine(const char *line)
+{
+	ArenaMark mark = arenaMark(&commandArena);
+	CommandLine *cmdLine = parseCommandLine(&commandArena, line);
+	double startTime = getMonotonicTime();
+	double seconds;
+
+	if ((cmdLine != NULL) && (cmdLine->iNumCommands > 0))
+		executeCommandLine(cmdLine);
+
+	seconds = getMonotonicTime() - startTime;
+	fflush(stdout);
+	arenaRelease(&commandArena, mark);
+
+	if ((cmdLine == NULL) || (iLastStatus != 0))
+	{
+		iFailedStatus = (cmdLine == NULL) ? 2 : iLastStatus;
+		fprintf(stderr, "shellbench: \"%s\" exited with status %d\n", line, iFailedStatus);
+		return -1;
+	}
+
+	return seconds;
+}
+
+// bestOfRuns() function runs "line" BENCH_RUNS times and
+// returns the fastest time, or -1 as soon as a run fails.
+// If "removeFile" is given, it is removed before every run.
+double bestOfRuns(const char *line, const char *removeFile)
+{
+	double best = 0;
+	int i;
+
+	for (i = 0; i < BENCH_RUNS; ++i)
+	{
+		double seconds;
+
+		if (removeFile != NULL)
+			unlink(removeFile);
+
+		seconds = runLine(line);
+
+		if (seconds < 0)
+			return -1;
+
+		if ((i == 0) || (seconds < best))
+			best = seconds;
+	}
+
+	return best;
+}
+
+// printError() function prints the result of a benchmark
+// whose command failed. "fields" are the other members of
+// the result, e.g. "stages":4.
+void printError(const char *bench, const char *fields)
+{
+	fprintf(results, "{\"bench\":\"%s\",%s,\"error\":\"exit status %d\"}\n", bench, fields, iFailedStatus);
+	iNumErrors++;
+}
+
+// printThroughput() function prints the result of a data
+// benchmark: "iBytes" went through in "seconds", or the
+// error if it failed, see runLine(). "fields" are the other
+// members of the result, e.g. "stages":4.
+void printThroughput(const char *bench, const char *fields, long long iBytes, double seconds)
+{
+	if (seconds < 0)
+	{
+		printError(bench, fields);
+		return;
+	}
+
+	fprintf(results, "{\"bench\":\"%s\",%s,\"bytes\":%lld,\"seconds\":%.6f,\"mb_per_s\":%.1f}\n",
+			bench, fields, iBytes, seconds, iBytes / (1024.0 * 1024.0) / seconds);
+}
+
+// benchSpawn() function measures the latency of running
+// a trivial program with every launch strategy.
+void benchSpawn()
+{
+	static const char *names[] = { "spawn", "vfork", "fork" };
+	int iIterations = 2000;
+	double *samples = malloc(iIterations * sizeof(double));
+	char *path = resolveCommandPath("true");
+	int iStrategy, i;
+
+	for (iStrategy = Launch_Spawn; iStrategy <= Launch_Fork; ++iStrategy)
+	{
+		char fields[64];
+		double total = 0;
+
+		launchStrategy = iStrategy;
+		sprintf(fields, "\"launcher\":\"%s\"", names[iStrategy]);
+
+		if (path == NULL)
+		{
+			fprintf(stderr, "shellbench: true: command not found\n");
+			iFailedStatus = 127;
+			printError("spawn", fields);
+			continue;
+		}
+
+		// The full path, so that the builtin isn't used
+		for (i = 0; i < iIterations; ++i)
+		{
+			samples[i] = runLine(path) * 1e6;
+
+			if (samples[i] < 0)
+				break;
+
+			total += samples[i];
+		}
+
+		if (i < iIterations)
+		{
+			printError("spawn", fields);
+			continue;
+		}
+
+		qsort(samples, iIterations, sizeof(double), compareDoubles);
+
+		fprintf(results, "{\"bench\":\"spawn\",\"launcher\":\"%s\",\"iterations\":%d,"
+				"\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+				names[iStrategy], iIterations, total / iIterations,
+				samples[iIterations / 2], samples[(iIterations * 99) / 100]);
+	}
+
+	launchStrategy = Launch_Spawn;
+	free(samples);
+}
+
+// benchPipeline() function measures the throughput of pipe
+// chains of 2 to 16 stages, made of "head" and some "cat".
+void benchPipeline()
+{
+	static const int stages[] = { 2, 4, 8, 16 };
+	char line[512];
+	char fields[64];
+	int i, j;
+
+	for (i = 0; i < (int) (sizeof(stages) / sizeof(stages[0])); ++i)
+	{
+		int iLength = sprintf(line, "head -c %lld /dev/zero", iPayload);
+
+		for (j = 1; j < stages[i]; ++j)
+			iLength += sprintf(line + iLength, " | cat");
+
+		sprintf(fields, "\"stages\":%d", stages[i]);
+		printThroughput("pipeline", fields, iPayload, bestOfRuns(line, NULL));
+	}
+}
+
+// benchRedirect() function measures the throughput of
+// the >, >>, < and |> operators with a temporary file.
+void benchRedirect()
+{
+	char file[64];
+	char line[256];
+
+	sprintf(file, "/tmp/shellbench.%d", getpid());
+
+	sprintf(line, "head -c %lld /dev/zero > %s", iPayload, file);
+	printThroughput("redirect", "\"operator\":\">\"", iPayload, bestOfRuns(line, file));
+
+	sprintf(line, "head -c %lld /dev/zero >> %s", iPayload, file);
+	printThroughput("redirect", "\"operator\":\">>\"", iPayload, bestOfRuns(line, file));
+
+	// The file of the last run is the input
+	sprintf(line, "cat < %s", file);
+	printThroughput("redirect", "\"operator\":\"<\"", iPayload, bestOfRuns(line, NULL));
+
+	sprintf(line, "head -c %lld /dev/zero |> %s", iPayload, file);
+	printThroughput("redirect", "\"operator\":\"|>\"", iPayload, bestOfRuns(line, file));
+
+	unlink(file);
+}
+
+// benchFanOut() function measures the throughput of the
+// || and ||| operators with 2 and 4 "cat" consumers.
+void benchFanOut()
+{
+	static const char *operators[] = { "||", "|||" };
+	static const int consumers[] = { 2, 4 };
+	char line[256];
+	char fields[64];
+	int i, j, k;
+
+	for (i = 0; i < 2; ++i)
+	{
+		for (j = 0; j < 2; ++j)
+		{
+			int iLength = sprintf(line, "head -c %lld /dev/zero %s cat", iPayload, operators[i]);
+
+			for (k = 1; k < consumers[j]; ++k)
+				iLength += sprintf(line + iLength, ", cat");
+
+			sprintf(fields, "\"operator\":\"%s\",\"consumers\":%d", operators[i], consumers[j]);
+			printThroughput("fanout", fields, iPayload, bestOfRuns(line, NULL));
+		}
+	}
+}
+
+// benchHistory() function fills the command history up to
+// 10^3, 10^4, 10^5 and 10^6 commands, and at every size
+// measures the inserts, the lookups by sequence number
+// (cmdhist) and the substring searches (Ctrl-R).
+void benchHistory()
+{
+	int iNumLookups = 100000;
+	int iNumSearches = 1000;
+	int iSize, iSequenceNo = 0;
+	char command[128];
+	int i;
+
+	// No history file, only the session history. The
+	// shell reads HISTSIZE from its variables.
+	setVariable("HISTSIZE", strlen("HISTSIZE"), "1000000", 0);
+	initCommandHistory();
+
+	for (iSize = 1000; iSize <= 1000000; iSize *= 10)
+	{
+		int iNumInserts = iSize - iSequenceNo;
+		double startTime = getMonotonicTime();
+		double insertSeconds, lookupSeconds, searchSeconds;
+		long long iFound = 0;
+
+		while (iSequenceNo < iSize)
+		{
+			iSequenceNo++;
+			sprintf(command, "grep -n pattern%d /var/log/file%d.log | sort | uniq -c", iSequenceNo, iSequenceNo % 97);
+			insertIntoCommandHistory(iSequenceNo, command);
+		}
+
+		insertSeconds = getMonotonicTime() - startTime;
+
+		startTime = getMonotonicTime();
+		srand(1);
+
+		for (i = 0; i < iNumLookups; ++i)
+			if (findHistoryEntry(1 + rand() % iSize) != NULL)
+				iFound++;
+
+		lookupSeconds = getMonotonicTime() - startTime;
+
+		startTime = getMonotonicTime();
+
+		for (i = 0; i < iNumSearches; ++i)
+		{
+			HistoryMatch match = { 0, 0 };
+
+			sprintf(command, "pattern%d ", 1 + rand() % iSize);
+			iFound += searchHistory(command, &match, NULL, 0);
+		}
+
+		searchSeconds = getMonotonicTime() - startTime;
+
+		fprintf(results, "{\"bench\":\"history\",\"entries\":%d,\"inserts\":%d,\"insert_ns\":%.1f,"
+				"\"lookups\":%d,\"lookup_ns\":%.1f,\"searches\":%d,\"search_us\":%.1f,\"found\":%lld}\n",
+				iSize, iNumInserts, insertSeconds * 1e9 / iNumInserts,
+				iNumLookups, lookupSeconds * 1e9 / iNumLookups,
+				iNumSearches, searchSeconds * 1e6 / iNumSearches, iFound);
+	}
+}
+
+// benchTokenizer() function measures how fast lines of
+// 1 KB, 64 KB and 1 MB are parsed. The lines are long
+// pipe chains of commands with a few arguments each.
+void benchTokenizer()
+{
+	static const size_t sizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+	char fields[64];
+	int i;
+
+	for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); ++i)
+	{
+		char *line = malloc(sizes[i] + 128);
+		size_t iLength = sprintf(line, "cat input.txt");
+		long long iTotal = 0;
+		double startTime;
+		double seconds = 0;
+		int iNumLines = 0;
+
+		while (iLength < sizes[i])
+			iLength += sprintf(line + iLength, " | grep -v 'skip %zu' --color=never -e word%zu", iLength, iLength);
+
+		// Parse the line again and again for at least
+		// as many bytes as the payload, or 0.2 seconds
+		startTime = getMonotonicTime();
+
+		while ((iTotal < iPayload) || (seconds < 0.2))
+		{
+			ArenaMark mark = arenaMark(&commandArena);
+
+			if (parseCommandLine(&commandArena, line) == NULL)
+			{
+				fprintf(stderr, "shellbench: syntax error in the tokenizer line\n");
+				break;
+			}
+
+			arenaRelease(&commandArena, mark);
+			iTotal += iLength;
+			iNumLines++;
+			seconds = getMonotonicTime() - startTime;
+		}
+
+		sprintf(fields, "\"line_bytes\":%zu,\"lines\":%d", iLength, iNumLines);
+		printThroughput("tokenizer", fields, iTotal, seconds);
+		free(line);
+	}
+}
+
+// Benchmark structure type is used to contain
+// one benchmark that can be picked by name.
+typedef struct
+{
+	const char *name;				// name given on the command line
+	void (*function)();				// function running it
+} Benchmark;
+
+// Table of the benchmarks, in the order they are run
+const Benchmark benchmarks[] =
+{
+	{ "spawn",		benchSpawn },
+	{ "pipeline",	benchPipeline },
+	{ "redirect",	benchRedirect },
+	{ "fanout",		benchFanOut },
+	{ "history",	benchHistory },
+	{ "tokenizer",	benchTokenizer }
+};
+
+int main(int argc, char *argv[])
+{
+	int iNumBenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	int iFirstName = 1;
+	int i, j;
+
+	if ((argc > 1) && (atoi(argv[1]) > 0))
+	{
+		iPayload = (long long) atoi(argv[1]) << 20;
+		iFirstName = 2;
+	}
+
+	for (i = iFirstName; i < argc; ++i)
+	{
+		for (j = 0; j < iNumBenchmarks; ++j)
+			if (strcmp(argv[i], benchmarks[j].name) == 0)
+				break;
+
+		if (j == iNumBenchmarks)
+		{
+			fprintf(stderr, "usage: %s [payload MB] [spawn|pipeline|redirect|fanout|history|tokenizer]...\n", argv[0]);
+			return 2;
+		}
+	}
+
+	// The environment becomes the variables of the
+	// shell, PATH among them, as in the shell's main()
+	initVariables();
+	shellPid = getpid();
+	shellName = argv[0];
+
+	// The results go to the standard output, everything
+	// the commands and the shell print goes to /dev/null.
+	results = fdopen(fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3), "w");
+	setvbuf(results, NULL, _IOLBF, 0);
+	dup2(open("/dev/null", O_WRONLY | O_CLOEXEC), STDOUT_FILENO);
+
+	// The jobs are reaped by the SIGCHLD handler
+	initJobs(0);
+
+	for (j = 0; j < iNumBenchmarks; ++j)
+	{
+		int iSelected = (iFirstName == argc);
+
+		for (i = iFirstName; i < argc; ++i)
+			if (strcmp(argv[i], benchmarks[j].name) == 0)
+				iSelected = 1;
+
+		if (iSelected)
+			benchmarks[j].function();
+	}
+
+	fclose(results);
+	return (iNumErrors > 0) ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+// spawn_bench.c is a microbenchmark for the process launcher of the
+// shell. It starts a trivial command many times with each launch
+// strategy (posix_spawn, vfork and fork) and prints the latency of
+// launch + waitpid() for each of them. The shell's memory can be
+// inflated first to show how fork() slows down as the shell grows,
+// e.g. with a large history and path cache.
+//
+// Build and run from the top of the repository:
+//		make bench
+//		./spawn_bench [iterations] [heap MB] [command]
+//
+// Each result is printed as one line of key=value pairs.
+
+#define SHELL_NO_MAIN
+#include "../shell.c"
+
+#include<time.h>
+
+// nowMicroseconds() function returns a monotonic
+// timestamp in microseconds.
+double nowMicroseconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// compareDoubles() is the qsort() comparison
+// function for an array of doubles.
+int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// benchmarkStrategy() function launches "args" "iIterations"
+// times with the given strategy and prints the statistics.
+void benchmarkStrategy(enum LaunchStrategy strategy, const char *name,
+					   char *path, char **args, int iIterations, int iHeapMB)
+{
+	double *samples = malloc(iIterations * sizeof(double));
+	double total = 0;
+	int i;
+
+	launchStrategy = strategy;
+
+	for (i = 0; i < iIterations; ++i)
+	{
+		LaunchSpec spec;
+		int status;
+		double start = nowMicroseconds();
+
+		initLaunchSpec(&spec, path, args);
+		pid_t pid = launchProcess(&spec);
+
+		if (pid > 0)
+			waitpid(pid, &status, 0);
+
+		samples[i] = nowMicroseconds() - start;
+		total += samples[i];
+	}
+
+	qsort(samples, iIterations, sizeof(double), compareDoubles);
+
+	printf("strategy=%s heap_mb=%d iterations=%d mean_us=%.1f p50_us=%.1f p99_us=%.1f\n",
+		   name, iHeapMB, iIterations, total / iIterations,
+		   samples[iIterations / 2], samples[(iIterations * 99) / 100]);
+
+	free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+	int iIterations = (argc > 1) ? atoi(argv[1]) : 1000;
+	int iHeapMB = (argc > 2) ? atoi(argv[2]) : 256;
+	char *defaultArgs[] = { "true", NULL };
+	char *commandArgs[] = { (argc > 3) ? argv[3] : "true", NULL };
+	char **args = (argc > 3) ? commandArgs : defaultArgs;
+	char *path;
+	int iPass;
+
+	// The environment becomes the variables of the
+	// shell, PATH among them, as in the shell's main()
+	initVariables();
+	shellPid = getpid();
+	shellName = argv[0];
+
+	path = resolveCommandPath(args[0]);
+
+	if (path == NULL)
+	{
+		fprintf(stderr, "%s: command not found\n", args[0]);
+		return 1;
+	}
+
+	if (iIterations <= 0)
+		iIterations = 1;
+
+	// First with a small shell, then with "iHeapMB" of
+	// touched memory that fork() has to copy page tables for.
+	for (iPass = 0; iPass < 2; ++iPass)
+	{
+		int iMB = (iPass == 0) ? 0 : iHeapMB;
+
+		if (iMB > 0)
+		{
+			size_t size = (size_t) iMB << 20;
+			char *heap = malloc(size);
+
+			if (heap == NULL)
+			{
+				perror("malloc() error: ");
+				return 1;
+			}
+
+			memset(heap, 1, size);
+		}
+
+		benchmarkStrategy(Launch_Spawn, "spawn", path, args, iIterations, iMB);
+		benchmarkStrategy(Launch_VFork, "vfork", path, args, iIterations, iMB);
+		benchmarkStrategy(Launch_Fork, "fork", path, args, iIterations, iMB);
+
+		if (iHeapMB <= 0)
+			break;
+	}
+
+	return 0;
+}
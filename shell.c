@@ -1,3 +1,5 @@
+#define _GNU_SOURCE		// needed for splice() and tee()
+
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
@@ -6,987 +8,10285 @@
 #include<sys/types.h>
 #include<sys/stat.h>
 #include<fcntl.h>
+#include<errno.h>
+#include<poll.h>
+#include<signal.h>
+#include<spawn.h>
+#include<sys/mman.h>
+#include<sys/file.h>
+#include<termios.h>
+#include<sys/ioctl.h>
+#include<sys/uio.h>
+#include<time.h>
+#include<sys/time.h>
+#include<sys/resource.h>
+#include<pthread.h>
+#include<dirent.h>
+#include<pwd.h>
 
 // CommandType enum type is used to indicate
 // the type of shell operator used in the
 // user command.
 enum CommandType
 {
-	Simple,				// there is no pipe or redirection in user command
-	Output_Redirect,	// user is using > operator in the command
-	Output_Append,		// user is using >> operator in the command
-	Input_Redirect,		// user is using < operator in the command
+	Simple,				// a single command, with any redirections but |> and |>>
+	Output_Tee,			// user is using |> operator, output goes to a file and to the terminal
+	Output_Tee_Append,	// user is using |>> operator, output is appended to a file and shown on the terminal
 	Piped_Chain,		// user is using one or more | operators in the command
-	Double_Pipe,		// user is using || operator whose output should go to two other comma separated commands
-	Triple_Pipe,		// user is using ||| operator whose output should go to three other comma separated commands
-	Command_History		// user is trying to execute "cmdhist" command which mimics "history" command of some shells
+	Fan_Out				// user is using || or ||| operator whose output should go to any number of comma separated commands
+};
+
+// RedirectionType enum type is used to indicate
+// the kind of a redirection operator.
+enum RedirectionType
+{
+	Redirect_Output,		// > or n> operator
+	Redirect_Append,		// >> or n>> operator
+	Redirect_Tee,			// |> operator
+	Redirect_Tee_Append,	// |>> operator
+	Redirect_Input,			// < or n< operator
+	Redirect_Here_Doc,		// << or <<- operator, the target is the text of the here-document
+	Redirect_Here_String,	// <<< operator, the target is the string, without the newline added to it
+	Redirect_Duplicate,		// n>&m or n<&m operator, the target is the descriptor m that n becomes a copy of
+	Redirect_Close			// n>&- or n<&- operator, descriptor n is closed
 };
 
-// CommandInfo structure type is used to
-// contain command related info associated
-// with the user command.
+// Redirection structure type is used as one node
+// of the list of redirections of a command.
+typedef struct Redirection
+{
+	enum RedirectionType type;		// which operator was used
+	int fd;							// descriptor that is redirected, e.g. 2 for 2>errors.txt
+	char *target;					// file name after the operator
+	struct Redirection *next;		// pointer to the next redirection of the same command
+} Redirection;
+
+// SimpleCommand structure type is used to contain
+// one command of the user input, i.e. a program and
+// its arguments along with its redirections.
+typedef struct
+{
+	int iNumArgs;					// number of arguments, including the command name, 0 for assignments alone
+	char **args;					// NULL terminated array of arguments
+	int iNumAssignments;			// number of variable assignments before the command name
+	char **assignments;				// NULL terminated array of the NAME=value words
+	Redirection *redirections;		// redirections in the order they were given, or NULL
+} SimpleCommand;
+
+// CommandLine structure type is used to contain the
+// whole user input after it has been parsed. It is
+// what every execute*() function works from.
 typedef struct
 {
 	enum CommandType type;			// type of shell operator used in the user command
-	char filename[256];				// file name in case of redirection operators (to/from which redirection needs to be done)
-} CommandInfo;
-
-// CommandHistNode structure type is used as one
-// node of the command history linked list.
-typedef struct CommandHistNode
+	int iNumCommands;				// number of commands, 0 for an empty line
+	SimpleCommand *commands;		// the stages of a pipe chain, or the producer followed by the consumers of a fan-out
+	int iBackground;				// 1 if the line ends with &, the shell doesn't wait for it
+	int iTimed;						// 1 if the line starts with "time", its resource usage is reported
+	int iIncomplete;				// 1 if a here-document has not ended yet, more lines are needed
+	int iExpand;					// 1 if there is a $ or a pattern to expand, see expandCommandLine()
+} CommandLine;
+
+// ArenaBlock structure type is one chunk
+// of memory of an Arena.
+typedef struct ArenaBlock
+{
+	struct ArenaBlock *next;		// next block of the arena, or NULL
+	size_t iSize;					// usable size of data
+	size_t iUsed;					// bytes of data handed out so far
+	char data[];					// the memory itself
+} ArenaBlock;
+
+// Arena structure type is a bump allocator. Memory is
+// handed out from the current block by moving a pointer,
+// and everything allocated after a mark is given back at
+// once by arenaRelease(). The blocks are kept for reuse,
+// so once the arena has grown to the size a command needs,
+// parsing that command doesn't call malloc() at all.
+typedef struct
+{
+	ArenaBlock *first;				// first block, NULL until the first allocation
+	ArenaBlock *current;			// block allocations are made from
+	size_t iBaseBytes;				// size of the blocks before the current one
+	size_t iPeak;					// highest number of bytes in use so far
+} Arena;
+
+// ArenaMark structure type records the state of an Arena,
+// so that everything allocated after it can be released.
+typedef struct
+{
+	ArenaBlock *block;				// current block at the time of the mark
+	size_t iUsed;					// bytes used in that block at the time of the mark
+	size_t iBaseBytes;				// size of the blocks before it
+} ArenaMark;
+
+// Size of a normal arena block
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+// Arena that everything needed for one command is
+// allocated from: the input line, its parsed form and
+// the bookkeeping of its processes. It is released back
+// to where it was when the command finishes.
+Arena commandArena;
+
+// Set from CSHELL_ARENA_DEBUG to report the peak
+// arena usage of every command on stderr
+int iArenaDebug = 0;
+
+// HistoryEntry structure type is used as one
+// slot of the command history ring buffer.
+typedef struct
 {
 	int iSequenceNo;				// sequence number starting from 1
-	char command[256];				// actual command is stored here
-	struct CommandHistNode *next;	// pointer to the next node
-} CommandHistNode;
-
-// Linked-list to store all the command history
-CommandHistNode* cmdHistList = NULL;
-
-// getUserInput() will take the command with
-// arguments as entered by the user and return
-// the same.
-char* getUserInput()
+	size_t iOffset;					// where the command starts in the history arena
+	size_t iLength;					// length of the command, without the terminating NUL
+} HistoryEntry;
+
+// CommandHistory structure type holds the command history.
+// The most recent "iCapacity" commands are kept in a ring
+// buffer of fixed size slots, and the text of the commands
+// is stored back to back in one growable arena, so commands
+// of any length can be kept. Sequence numbers are consecutive,
+// so the slot of any sequence number can be computed directly.
+typedef struct
 {
-	char *input = NULL;
-	size_t BUFFSIZE = 0;
-
-	// Read the line from the user
-	if (getline(&input, &BUFFSIZE, stdin) == -1)
-	{
-		// Error in getline()
-		perror("getline() error: ");
-	}
-
-	return input;
-}
-
-// getArguments() function will take the whole
-// command ("input" parameter) and split it into
-// tokens (arguments) and return the same.
-// Additionally, an output parameter "pCommand"
-// is returned to indicate if any redirection
-// is part of the command & any related info.
-char** getArguments(char *input, CommandInfo *pCommand)
-{
-	const int BUFF_SIZE = 128;
-	char **arguments = malloc(BUFF_SIZE * sizeof(char *));
-	char *delimiters = " \t\n";		// use these as delimiters for strtok()
-	
-	// Assume simple command to begin with
-	// i.e. no pipe or redirection operator
-	pCommand->type = Simple;
-	strcpy(pCommand->filename, "");
-	
-	// Use strtok() to split the "input" parameter into
-	// tokens (arguments)
-	char *token = strtok(input, delimiters);
-	int iPos = 0;
-
-	// iRedirection is a flag variable to indicate that
-	// a redirection operator viz. >, >> or < has been
-	// found and file name is also processed, so we don't
-	// expect any more arguments in the input.
-	int iRedirection = 0;
+	HistoryEntry *entries;			// ring buffer of iCapacity slots
+	int iCapacity;					// maximum number of commands kept (HISTSIZE)
+	int iFirst;						// slot of the oldest command
+	int iCount;						// number of commands currently kept
+	char *arena;					// text of the commands, in the order they were entered
+	size_t iArenaSize;				// allocated size of the arena
+	size_t iArenaUsed;				// bytes of the arena handed out so far
+	size_t iArenaLive;				// bytes used by the commands still in the ring
+} CommandHistory;
+
+// Number of commands kept when HISTSIZE isn't set
+#define DEFAULT_HISTSIZE 1000
+
+// The command history of this shell session
+CommandHistory cmdHistory;
+
+// HistoryFile structure type describes the history file
+// shared by all the shell sessions of a user. It holds one
+// command per line and is only ever appended to, except by
+// the background compaction. At startup it is mapped into
+// memory as it is, without reading it. The commands of
+// earlier sessions are numbered 1..iNumLines by their line
+// in the mapping, and the commands of this session follow.
+// Going through the history with Up and Down only needs the
+// last lines, which are found from the end of the mapping
+// as they are asked for, see getHistoryFileLineFromEnd().
+typedef struct
+{
+	char *path;						// path of the history file, NULL if there is none
+	int fd;							// the file opened with O_APPEND, for adding commands
+	char *map;						// read-only mapping of the file as it was at startup
+	size_t iMapSize;				// size of that mapping
+	int iIndexed;					// 1 once lineOffsets has been built
+	size_t *lineOffsets;			// offset in map of the start of every line
+	int iNumLines;					// number of complete lines in map
+	size_t *tailOffsets;			// offset in map of the start of the last lines, the last one first
+	int iNumTail;					// number of entries in tailOffsets
+	int iTailAllocated;				// allocated size of tailOffsets
+	int iTailStarted;				// 1 once the end of the last complete line has been found
+} HistoryFile;
+
+// Number of commands the compaction keeps when
+// HISTFILESIZE isn't set
+#define DEFAULT_HISTFILESIZE 10000
+
+// Smaller history files are never compacted
+#define HISTORY_COMPACT_MIN_BYTES (64 * 1024)
+
+// The history file of this shell session. There is none
+// until initHistoryFile() has opened it, descriptor 0 is
+// the standard input.
+HistoryFile histFile = { NULL, -1 };
+
+char* readLineInteractive(const char *prompt);	// forward declaration
+char* arenaStrndup(Arena *arena, const char *str, size_t iLength);	// forward declaration
+
+// getUserInput() will show the given prompt, take
+// the command with arguments as entered by the user
+// and return the same. When the user is at a terminal,
+// the line is read by readLineInteractive(), which
+// lets the user edit it and go through the history. It
+// returns NULL at the end of the input. The line is
+// copied into the command arena, so it goes away with
+// the rest of the command and the caller never frees it.
+char* getUserInput(const char *prompt)
+{
+	// The getline() buffer is kept from one line to
+	// the next instead of being allocated every time.
+	static char *buffer = NULL;
+	static size_t BUFFSIZE = 0;
+	ssize_t iLength;
 
-	// Get all the tokens (arguments) from "input"
-	// by using strtok() in a loop
-	while (token && (!iRedirection))
+	if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO))
 	{
-		// Handle special cases first
-		if (strcmp(token, ">") == 0)
-		{
-			// Set the command type. No need
-			// to save it in arguments.
-			pCommand->type = Output_Redirect;
-		}
-		else if (strcmp(token, ">>") == 0)
-		{
-			// Set the command type. No need
-			// to save it in arguments.
-			pCommand->type = Output_Append;
-		}
-		else if (strcmp(token, "<") == 0)
-		{
-			// Set the command type. No need
-			// to save it in arguments.
-			pCommand->type = Input_Redirect;
-		}
-		else if (strcmp(token, "|") == 0)
-		{
-			// Set the command type.
-			pCommand->type = Piped_Chain;
+		char *line = readLineInteractive(prompt);
 
-			// Store | symbol as a normal token, we will
-			// segregate the chained commands later.
-			arguments[iPos++] = token;
-		}
-		else if (strcmp(token, "||") == 0)
-		{
-			// Set the command type.
-			pCommand->type = Double_Pipe;
-
-			// Store || symbol as a normal token, we will
-			// segregate the chained commands later.
-			arguments[iPos++] = token;
-		}
-		else if (strcmp(token, "|||") == 0)
-		{
-			// Set the command type.
-			pCommand->type = Triple_Pipe;
-
-			// Store ||| symbol as a normal token, we will
-			// segregate the chained commands later.
-			arguments[iPos++] = token;
-		}
-		else if (strcmp(token, "cmdhist") == 0)
-		{
-			// Set the command type.
-			pCommand->type = Command_History;
-
-			// Store "cmdhist" symbol as a normal token, we
-			// will segregate the chained commands later.
-			arguments[iPos++] = token;
-		}
-		else
-		{
-			if ( (pCommand->type == Output_Redirect) ||
-				 (pCommand->type == Output_Append) ||
-				 (pCommand->type == Input_Redirect) )
-			{
-				// We are here because previous token
-				// was a redirection operator. So this
-				// must be the last token now which is
-				// the file name. After that, we do not
-				// expect any more tokens, so it will be
-				// safer to exit this loop by setting
-				// the iRedirection flag to 1. No need
-				// to save the file name in arguments,
-				// we just need to save it in pCommand.
-				strcpy(pCommand->filename, token);
-				iRedirection = 1;
-			}
-			else
-			{
-				// This is a normal token or argument.
-				// E.g. in a command like "ls -l",
-				// "ls" is one token, "-l" is another
-				// token etc. Store this token (argument)
-				// in the arguments array.
-				arguments[iPos++] = token;
-			}
-		}
-
-		// Get the next token (argument)
-		// by using strtok().
-		token = strtok(NULL, delimiters);
+		return line ? arenaStrndup(&commandArena, line, strlen(line)) : NULL;
 	}
 
-	// arguments should be a NULL terminated array
-	arguments[iPos] = NULL;
-
-	return arguments;
-}
-
-// printArguments() function is just used for
-// debugging purposes. It simply prints all the
-// arguments present in "args" parameter (including
-// the last NULL argument).
-void printArguments(char **args)
-{
-	int iPos = 0;
-	int iNullFound = 0;
+	printf("%s", prompt);
+	fflush(stdout);
 
-	printf("Naveen: Printing all arguments.\n");
+	// Read the line from the user
+	iLength = getline(&buffer, &BUFFSIZE, stdin);
 
-	while (!iNullFound)
+	if (iLength == -1)
 	{
-		// Print the argument
-		printf("args[%d] = %s\n", iPos, args[iPos]);
-
-		// Check if we have just printed the last
-		// i.e. the NULL argument. If so, we should
-		// exit this loop by setting the flag.
-		if (args[iPos] == NULL)
-			iNullFound = 1;
+		// End of input or error in getline()
+		if (ferror(stdin))
+			perror("getline() error: ");
 
-		// Go to the next argument.
-		iPos++;
+		return NULL;
 	}
-}
 
-// printExecutionStatus() function will print the
-// pid and status as per parameters passed to it.
-void printExecutionStatus(pid_t pid, int status)
-{
-	printf("\nPID of completed command = %d and ", pid);
-	printf("Status of completed command = %d.\n", status);
+	return arenaStrndup(&commandArena, buffer, iLength);
 }
 
-// executeNormal() function is used for execution of a
-// normal command without any redirection etc. The output
-// is simply printed on the shell prompt. E.g. ls -l
-void executeNormal(char **args)
+// arenaAlloc() function returns "iSize" bytes of memory
+// from the arena, aligned for any type.
+void* arenaAlloc(Arena *arena, size_t iSize)
 {
-	// Create a child process
-	pid_t pid = fork();
+	ArenaBlock *block = arena->current;
 
-	if (pid < 0)
-	{
-		perror("Error creating child process: ");
-	}
-	else if (pid == 0)
-	{
-		// In the child procss, simply run the command
-		// by calling execvp() system call.
-		execvp(args[0], args);
-	}
-	else
+	iSize = (iSize + 15) & ~(size_t) 15;
+
+	if ((block != NULL) && (block->iUsed + iSize <= block->iSize))
 	{
-		// In the parent process, wait for the child
-		// process to complete
-		int status;
-		wait(&status);
+		void *p = block->data + block->iUsed;
+		block->iUsed += iSize;
 
-		// Print the PID and the status of the command
-		// (child process) just completed.
-		printExecutionStatus(pid, status);
-	}
-}
+		if (arena->iBaseBytes + block->iUsed > arena->iPeak)
+			arena->iPeak = arena->iBaseBytes + block->iUsed;
 
-// executeOutputRedirect() function is used for execution of
-// a command which uses > or >> operators to redirect/append
-// output to a file.
-//
-// E.g. ls -l > abc.txt
-// or
-// ls -l >> abc.txt
-//
-// The filename is passed as a parameter to this function.
-// The iAppend parameter is a flag which should be passed
-// as 0 in case of > operator and as 1 in case of >> operator.
-void executeOutputRedirect(char **args, char *filename, int iAppend)
-{
-	// Create pipe for communication
-	int p[2];
-	pipe(p);
+		return p;
+	}
 
-	// Create a child process
-	pid_t pid = fork();
+	// Move on to the next block if there is one that is
+	// big enough, otherwise put a new block after the
+	// current one.
+	if (block != NULL)
+		arena->iBaseBytes += block->iSize;
 
-	if (pid < 0)
-	{
-		perror("Error creating child process: ");
-	}
-	else if (pid == 0)
+	if ((block != NULL) && (block->next != NULL) && (block->next->iSize >= iSize))
 	{
-		close(p[0]);  // we don't need read end of pipe in child process, we only want to write in pipe in child process
-		dup2(p[1], STDOUT_FILENO);  // close standard output and write to write end of pipe instead
-		execvp(args[0], args);		// run the command, it will write to write end of pipe now
+		block = block->next;
 	}
 	else
 	{
-		// Use the read end of pipe in the parent process
-		// here and pass the data read from pipe into a new
-		// file.
-		close(p[1]);	// we don't need write end of pipe in parent process, we only want to read from pipe in parent process
-		
-		int status;
-		wait(&status);	// wait for the child process to finish i.e. wait for command to execute and write to the pipe, so that you can read it
+		size_t iBlockSize = (iSize > ARENA_BLOCK_SIZE) ? iSize : ARENA_BLOCK_SIZE;
+		ArenaBlock *newBlock = malloc(sizeof(ArenaBlock) + iBlockSize);
 
-		// Now child has executed and written to the pipe.
-		// Simply read from the pipe now and store it in
-		// "buff" character buffer.
-		char buff[4096];
-		int iNumRead = read(p[0], buff, sizeof(buff));
+		newBlock->iSize = iBlockSize;
 
-		int iFlags;
-
-		if (iAppend)
+		if (block == NULL)
 		{
-			// File is already existing, we need to
-			// append to existing file.
-			iFlags = O_WRONLY | O_APPEND;
+			newBlock->next = NULL;
+			arena->first = newBlock;
 		}
 		else
 		{
-			// File may or may not exist, we will create
-			// new file or overwrite existing one if it
-			// already exists.
-			iFlags = O_CREAT | O_WRONLY | O_TRUNC;
+			newBlock->next = block->next;
+			block->next = newBlock;
 		}
 
-		// Open the file to which we should redirect output
-		int fd = open(filename, iFlags, 0644);
+		block = newBlock;
+	}
+
+	block->iUsed = iSize;
+	arena->current = block;
 
-		// Write the contents of "buff" to the output file
-		write(fd, buff, iNumRead);
+	if (arena->iBaseBytes + iSize > arena->iPeak)
+		arena->iPeak = arena->iBaseBytes + iSize;
 
-		// Print the PID and the status of the command
-		// (child process) just completed.
-		printExecutionStatus(pid, status);
-	}
+	return block->data;
 }
 
-// executeInputRedirect() function is used for execution of
-// a command which uses < operator to read input from an
-// existing file. E.g. wc -l < abc.txt
-// The filename is passed as a parameter to this function.
-void executeInputRedirect(char **args, char *filename)
+// arenaStrndup() function copies "iLength" bytes of
+// "str" into the arena and terminates them with a NUL.
+char* arenaStrndup(Arena *arena, const char *str, size_t iLength)
 {
-	// Create a child process
-	pid_t pid = fork();
+	char *copy = arenaAlloc(arena, iLength + 1);
 
-	if (pid < 0)
-	{
-		perror("Error creating child process: ");
-	}
-	else if (pid == 0)
-	{
-		// In child process, let's read the contents
-		// of input file and use the same to run the
-		// command. Don't use standard input for running
-		// the command.
-		int fd = open(filename, O_RDONLY);  // open the input file in read-only mode
-		dup2(fd, STDIN_FILENO);	// close standard input and read from input file instead
-		execvp(args[0], args);		// run the command, it will read from the file now
-	}
-	else
-	{
-		// In the parent process, wait for the child
-		// process to complete
-		int status;
-		wait(&status);
-
-		// Print the PID and the status of the command
-		// (child process) just completed.
-		printExecutionStatus(pid, status);
-	}
-}
-
-// splitChainedCommands() is a helper function to split
-// the input array of strings into multiple arrays of strings.
-// E.g. a command like "ls -l | wc -w | wc" will be present
-// in input parameter "args" as { "ls, "-l", "|", "wc", "-w", "|", "wc", NULL }.
-// However, this can't be processed as a single command,
-// we need to split "args" into multiple arrays of strings
-// E.g.  arguments[0] = { "ls", "-l", NULL }
-//       arguments[1] = { "wc", "-w", NULL }
-//       arguments[2] = { "wc", NULL }
-char*** splitChainedCommands(char **args, int *pNumCommands)
-{
-	const int BUFF_SIZE = 128;
-	char ***arguments = malloc(BUFF_SIZE * sizeof(char **));
-	int i = 0;
-	int j = 0;
-	int iArgsPos = 0;
-	int iNullFound = 0;
-	*pNumCommands = 1;  // this will be the number of pipes plus one
+	memcpy(copy, str, iLength);
+	copy[iLength] = '\0';
 
-	while (!iNullFound)
-	{
-		if (j == 0)
-			arguments[i] = malloc(BUFF_SIZE * sizeof(char *));
+	return copy;
+}
 
-		if (args[iArgsPos] == NULL)
-		{
-			// This is end of the last command,
-			// so no more arguments after this.
-			arguments[i][j] = NULL;
-			iNullFound = 1;  // flag is set to exit the while loop
-		}
-		else if (strcmp(args[iArgsPos],"|") == 0)
-		{
-			// This is end of one command
-			arguments[i][j] = NULL;
+// arenaMark() function returns the current state of
+// the arena, to be passed to arenaRelease() later.
+ArenaMark arenaMark(Arena *arena)
+{
+	ArenaMark mark;
 
-			// Reset i and j for next command
-			i++;
-			j = 0;
+	mark.block = arena->current;
+	mark.iUsed = arena->current ? arena->current->iUsed : 0;
+	mark.iBaseBytes = arena->iBaseBytes;
 
-			// Increment the number of piped commands
-			(*pNumCommands)++;
-		}
-		else
-		{
-			// Store the command argument and
-			// increment j for next argument.
-			arguments[i][j++] = args[iArgsPos];
-		}
+	return mark;
+}
 
-		// Go to the next argument.
-		iArgsPos++;
+// arenaRelease() function gives back everything that
+// has been allocated from the arena since "mark" was
+// taken. The memory is kept for the next allocations.
+void arenaRelease(Arena *arena, ArenaMark mark)
+{
+	if (mark.block == NULL)
+	{
+		// Nothing was allocated when the mark was taken
+		arena->current = arena->first;
+		arena->iBaseBytes = 0;
+		if (arena->current)
+			arena->current->iUsed = 0;
+		return;
 	}
 
-	return arguments;
+	arena->current = mark.block;
+	arena->current->iUsed = mark.iUsed;
+	arena->iBaseBytes = mark.iBaseBytes;
 }
 
-// executeSingleCommand() is used to run a given command as a child process.
-// The given command is passed as "args" parameter to this function.
-// This function returns the PID and the status of the executed child
-// process. It can do input/output from any file descriptors given to it.
-int executeSingleCommand(char **args, int fdin, int fdout, pid_t *pidCommand)
+// arenaBytesUsed() function returns the number of
+// bytes of the arena that are in use at the moment.
+size_t arenaBytesUsed(Arena *arena)
 {
-	pid_t pid;
-	int status;
-
-	// Create a child process to run the given command.
-	pid = fork();
-
-	if (pid == 0)
-    {
-		// Redirect standard input to fdin
-		// if it is required.
-		if (fdin != STDIN_FILENO)
-			dup2(fdin, STDIN_FILENO);
-
-		// Redirect standard output to fdin
-		// if it is required.
-		if (fdout != STDOUT_FILENO)
-			dup2(fdout, STDOUT_FILENO);
-
-		// Now run the given command as a child process
-		execvp(args[0], args);
-    }
-
-	// Parent process waits for child to complete.
-	wait(&status);
-	*pidCommand = pid;
-	return status;
+	return arena->current ? (arena->iBaseBytes + arena->current->iUsed) : 0;
 }
 
-// executePipedChain() function is used to execute a command
-// with one or more | operators in it. Internally, it will
-// run each command as child process and pass it's output
-// to the next command through a pipe.
-void executePipedChain(char **args)
+// reportArenaUsage() function prints how much of the
+// command arena the command "input" needed at its peak,
+// and how much memory the arena is holding in total.
+void reportArenaUsage(const char *input, size_t iPeak)
 {
-	pid_t pid;
-	int fdin, fdout;
-	int p[2];
-	int status;
-	int iNumCommands;	// this will contain the total number of commands
-	int i;
+	ArenaBlock *block;
+	size_t iReserved = 0;
+	int iNumBlocks = 0;
 
-	// Note that a command like "ls -l | wc -w | wc" will be present
-	// in input parameter "args" as { "ls, "-l", "|", "wc", "-w", "|", "wc", NULL }.
-	// However, this can't be processed as a single command,
-	// we need to split "args" into multiple arrays of strings
-	//
-	// E.g.  arguments[0] = { "ls", "-l", NULL }
-	//       arguments[1] = { "wc", "-w", NULL }
-	//       arguments[2] = { "wc", NULL }
-	//
-	// We will call splitChainedCommands() function to do this
-	// splitting of commands.
-	char ***arguments = splitChainedCommands(args, &iNumCommands);
-	
-	// Run all the commands in the piped chain
-	// sequentially in this for loop.
-	for (i = 0; i < iNumCommands; ++i)
+	for (block = commandArena.first; block; block = block->next)
 	{
-		pipe(p);
+		iReserved += block->iSize;
+		iNumBlocks++;
+	}
 
-		// For first process in the chain, read
-		// from standard input (keyboard) only.
-		if (i == 0)
-			fdin = STDIN_FILENO;
+	fprintf(stderr, "arena: peak %zu bytes, %zu bytes in %d blocks: %.*s\n",
+			iPeak, iReserved, iNumBlocks, (int) strcspn(input, "\n"), input);
+}
 
-		// For the last command/process in the chain,
-		// write to standard output (terminal). For all
-		// the preceding commands/processes in the chain,
-		// write to write end of pipe.
-		if (i == (iNumCommands-1))
-			fdout = STDOUT_FILENO;
-		else
-			fdout = p[1];
+// TokenType enum type is used to indicate
+// the kind of a token found by the lexer.
+enum TokenType
+{
+	Token_Word,				// a command name, an argument or a file name
+	Token_Pipe,				// | operator
+	Token_Fan_Out,			// || or ||| operator
+	Token_Comma,			// , between the consumers of a fan-out
+	Token_Redirect,			// >, >>, <, <<, <<-, <<<, >&, <&, &>, &>>, |> or |>> operator
+	Token_Background,		// & at the end of a line
+	Token_Newline,			// end of a line of a script
+	Token_End,				// end of the input
+	Token_Error				// a quote was not closed
+};
 
-		// Now run this command/process as a child process. This
-		// will be done by executeSingleCommand() function.
-		status = executeSingleCommand(arguments[i], fdin, fdout, &pid);
+// Token structure type is used to contain
+// one token of the user input.
+typedef struct
+{
+	enum TokenType type;			// kind of token
+	char *text;						// the word without quotes and escapes, or the operator
+	enum RedirectionType redirect;	// the operator, if type is Token_Redirect
+	int fd;							// number written right before the operator, e.g. 2 in 2>, or -1
+	int iQuoted;					// 1 if any part of the word was quoted or escaped
+	int iAssignment;				// 1 if the word starts with NAME= and the name wasn't quoted
+} Token;
+
+// Bytes the lexer puts in the text of a word in place of
+// a $ that starts an expansion, see readDollar(). A $ that
+// is quoted or can't start an expansion stays a $.
+#define EXPAND_UNQUOTED '\001'		// the value is split into words
+#define EXPAND_QUOTED '\002'		// inside "...", the value stays one word
+
+// Byte the lexer puts in the text of a word before an
+// unquoted *, ? or [, which is then a pattern character
+// for expandGlob(). A quoted one is just a character.
+#define GLOB_ACTIVE '\003'
+
+// Most here-documents a single line can start
+#define MAX_HERE_DOCUMENTS 16
+
+// HereDocument structure type is used to remember a
+// here-document whose text starts after the current line.
+typedef struct
+{
+	Redirection *redirection;		// the << redirection, which gets the text as target
+	const char *delimiter;			// the word that ends the text
+	int iStripTabs;					// 1 for <<-, tabs at the start of the lines are removed
+	int iExpand;					// 1 if the delimiter isn't quoted, $ is then expanded in the text
+} HereDocument;
+
+// Lexer structure type holds the state of the lexer
+// while it goes over the user input. The text of all
+// the words goes into a single buffer allocated once
+// for the whole input, since the words together are
+// never more than twice as long as the input itself,
+// see readDollar(). So do the texts of the
+// here-documents, which are part of the input.
+typedef struct
+{
+	const char *input;				// next character to look at
+	char *out;						// where the text of the next word goes
+	int iInFanOut;					// 1 once a fan-out operator has been seen, commas are then separators
+	int iNewlines;					// 1 if a newline ends a command, as in a script
+	HereDocument hereDocs[MAX_HERE_DOCUMENTS];	// here-documents whose text comes after the next newline
+	int iNumHereDocs;				// number of entries in hereDocs
+	int iHereIncomplete;			// 1 if the input ended inside a here-document
+	int iExpand;					// 1 once a $ or a pattern to expand has been read on the current line
+} Lexer;
+
+// Room the lexer needs for the text of the words of an
+// input of "iLength" characters, which grows with the
+// markers of readDollar() and GLOB_ACTIVE
+#define LEXER_BUFFER_SIZE(iLength) (2 * (iLength) + 1)
+
+// isValidName() function returns 1 if "name" (up to
+// "iLength" characters) can be the name of a variable.
+int isValidName(const char *name, size_t iLength)
+{
+	size_t i;
 
-		// Parent process doesn't need write end of pipe,
-		// it will be used by child to write.
-		close(p[1]);
+	if ((iLength == 0) || ((name[0] >= '0') && (name[0] <= '9')))
+		return 0;
 
-		// The next command will read from the read end
-		// of the pipe, so let's save it.
-		fdin = p[0];
+	for (i = 0; i < iLength; ++i)
+	{
+		char c = name[i];
+
+		if (!(((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+			  ((c >= '0') && (c <= '9')) || (c == '_')))
+			return 0;
 	}
 
-	// Print the PID and the status of the command
-	// (child process) just completed.
-	printExecutionStatus(pid, status);
+	return 1;
 }
 
-// executeDoublePipeHelper() function takes three command arguments as input.
-// It will execute the first command and it's output is used as input to run
-// the second and third commands. The outputs of second and third commands are
-// displayed on the standard output.
-void executeDoublePipeHelper(char **firstCommand, char **secondCommand, char **thirdCommand)
+// isOperatorChar() function returns 1 if the character
+// "c" ends a word when it is not quoted.
+int isOperatorChar(Lexer *lexer, char c)
 {
-	pid_t pid;
-	int status;
-	int p1[2];
-	pipe(p1);
+	return (c == '|') || (c == '>') || (c == '<') || (c == '&') || ((c == ',') && lexer->iInFanOut);
+}
 
-	// Run the first command as a child process.
-	pid = fork();
+// readDollar() function is called by the lexer at a $ in
+// "p". If it starts an expansion, i.e. it is followed by a
+// name, a digit, ?, $ or {, the $ is replaced with "marker"
+// in the text of the word at "*pOut", which is how the
+// expansion is found again by expandCommandLine(). A name is
+// put in braces, so that it still ends in the right place
+// when the quotes around what follows are gone, as in $a"b".
+// The braces of ${...} are copied whole, spaces and all, with
+// the $ inside them marked the same way. It returns where
+// the input goes on.
+const char* readDollar(Lexer *lexer, const char *p, char **pOut, char marker)
+{
+	char *out = *pOut;
+	char c = p[1];
 
-	if (pid == 0)
+	if (!(((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+		  (c == '_') || (c == '?') || (c == '$') || (c == '{')))
 	{
-		close(p1[0]);  // we don't need read end of p1 pipe in first command
-		dup2(p1[1], STDOUT_FILENO);  // close standard output and write to write end of p1 pipe instead
-		execvp(firstCommand[0], firstCommand);		// run the first command, it will write to write end of p1 pipe now
+		*out++ = *p++;
+		*pOut = out;
+		return p;
 	}
 
-	// Use the read end of pipe p1 in the parent process
-	// here and pass the data read from pipe into a new
-	// file.
-	close(p1[1]);	// we don't need write end of p1 pipe in parent process, we only want to read from p1 pipe in parent process
-	wait(&status);
-	
-	// Read from read end of p1 pipe and
-	// store it in "buff" variable
-	char buff[4096];
-	int iNumRead = read(p1[0], buff, sizeof(buff));
+	*out++ = marker;
+	lexer->iExpand = 1;
+	p++;
 
-	// Now "buff" variable has the output of the
-	// first command before || operator.
-
-	// Write the contents of "buff" variable into
-	// the write end of a new pipe p2. The read
-	// end of pipe p2 will be used later as input
-	// for the second command.
-	int p2[2];
-	pipe(p2);
-	write(p2[1], buff, iNumRead);
+	if (*p == '{')
+	{
+		int iDepth = 0;
 
-	// Run the second command as a child process.	
-	pid = fork();
+		do
+		{
+			if (*p == '$')
+			{
+				*pOut = out;
+				p = readDollar(lexer, p, pOut, marker);
+				out = *pOut;
+				continue;
+			}
 
-	if (pid == 0)
+			iDepth += (*p == '{') - (*p == '}');
+			*out++ = *p++;
+		} while ((iDepth > 0) && (*p != '\0') && (*p != '\n'));
+	}
+	else if ((*p == '?') || (*p == '$') || ((*p >= '0') && (*p <= '9')))
 	{
-		// Use read end of p2 pipe as input to run the second command
-		close(p2[1]);				// we don't need the write end of p2 pipe
-		dup2(p2[0], STDIN_FILENO);	// don't read from standard input, read from read end of p2 pipe instead
-		execvp(secondCommand[0], secondCommand);
+		// A special parameter is a single character
+		*out++ = *p++;
 	}
 	else
 	{
-		close(p2[0]);
-		close(p2[1]);
-		wait(&status);
-	}
+		*out++ = '{';
 
-	// Write the contents of "buff" variable into
-	// the write end of a new pipe p3. The read
-	// end of pipe p3 will be used later as input
-	// for the third command.
-	int p3[2];
-	pipe(p3);
-	write(p3[1], buff, iNumRead);
+		while (((*p >= 'a') && (*p <= 'z')) || ((*p >= 'A') && (*p <= 'Z')) ||
+			   ((*p >= '0') && (*p <= '9')) || (*p == '_'))
+			*out++ = *p++;
 
-	// Run the third command as a child process.	
-	pid = fork();
-
-	if (pid == 0)
-	{
-		// Use read end of p3 pipe as input to run the third command
-		close(p3[1]);				// we don't need the write end of p3 pipe
-		dup2(p3[0], STDIN_FILENO);	// don't read from standard input, read from read end of p3 pipe instead
-		execvp(thirdCommand[0], thirdCommand);
-	}
-	else
-	{
-		close(p3[0]);
-		close(p3[1]);
-		wait(&status);
+		*out++ = '}';
 	}
 
-	printExecutionStatus(pid, status);
+	*pOut = out;
+	return p;
 }
 
-// executeDoublePipe() function is used to execute a command
-// with || double-pipe operator in it. This command looks like:
-// 			ls -l || wc -w, wc -l
-// i.e. the output of first command before || operator should
-// be passed as input to the next two comma-separated commands.
-// In the above example, output of ls -l should be passed as
-// input to both wc -w and wc -l commands.
-void executeDoublePipe(char **args)
+// readHereDocuments() function is called by the lexer at the
+// end of a line that started here-documents. Their texts are
+// the lines that follow, "p" being the first one, each up to
+// a line made of its delimiter alone. Unless the delimiter was
+// quoted, a $ in the text is expanded and a backslash escapes
+// $, ` and itself. It returns where the input goes on after
+// the last delimiter.
+const char* readHereDocuments(Lexer *lexer, const char *p)
 {
-	const int BUFF_SIZE = 32;
-	int iCurrentCommand = 1;
-	int i = 0, j = 0, k = 0, iPos = 0;
-	int iNullFound = 0;
-
-	// The given "args" parameter actually contains arguments
-	// for 3 commands. The first command is the one before the
-	// || operator whose output is to be passed to the second
-	// and third commands which are the two comma separated
-	// commands. The below while loop will split "args" into
-	// 3 separate commands.
-	char **firstCommand   = malloc(BUFF_SIZE * sizeof(char *));
-	char **secondCommand  = malloc(BUFF_SIZE * sizeof(char *));
-	char **thirdCommand   = malloc(BUFF_SIZE * sizeof(char *));
+	int i;
 
-	while (!iNullFound)
+	for (i = 0; i < lexer->iNumHereDocs; ++i)
 	{
-		switch (iCurrentCommand)
+		HereDocument *hereDoc = &lexer->hereDocs[i];
+		size_t iDelimiterLength = strlen(hereDoc->delimiter);
+		char *out = lexer->out;
+
+		hereDoc->redirection->target = out;
+
+		while (1)
 		{
-		case 1:
-			if (strcmp(args[iPos], "||") == 0)
-				iCurrentCommand++;	// now first command ends, second starts
-			else
-				firstCommand[i++] = args[iPos];
-			break;
-		case 2:
-			int iLen = strlen(args[iPos]);
+			const char *line = p;
+			const char *end;
+			size_t iLength;
 
-			if (strcmp(args[iPos],",") == 0)
+			if (*p == '\0')
 			{
-				iCurrentCommand++;	// now second command ends, third starts
+				lexer->iHereIncomplete = 1;
+				break;
 			}
-			else if (args[iPos][iLen-1] == ',')
+
+			if (hereDoc->iStripTabs)
+				while (*line == '\t')
+					line++;
+
+			end = strchr(line, '\n');
+			iLength = end ? (size_t) (end - line) : strlen(line);
+			p = end ? end + 1 : line + iLength;
+
+			if ((iLength == iDelimiterLength) && (memcmp(line, hereDoc->delimiter, iLength) == 0))
+				break;
+
+			if (hereDoc->iExpand)
 			{
-				args[iPos][iLen-1] = '\0';
-				secondCommand[j++] = args[iPos];
-				iCurrentCommand++;	// now second command ends, third starts
+				// As inside "...", but a " is just a "
+				const char *q = line;
+
+				while (q < line + iLength)
+				{
+					if ((*q == '\\') && (q + 1 < line + iLength) &&
+						((q[1] == '$') || (q[1] == '\\') || (q[1] == '`')))
+					{
+						*out++ = q[1];
+						q += 2;
+					}
+					else if (*q == '$')
+					{
+						q = readDollar(lexer, q, &out, EXPAND_QUOTED);
+					}
+					else
+					{
+						*out++ = *q++;
+					}
+				}
 			}
 			else
 			{
-				secondCommand[j++] = args[iPos];
+				memcpy(out, line, iLength);
+				out += iLength;
 			}
 
-			break;
-		case 3:
-			thirdCommand[k++] = args[iPos];
-			break;
-		default:
-			// We shouldn't reach here!
-			break;
+			if (end != NULL)
+				*out++ = '\n';
 		}
 
-		// Check if we have just printed the last
-		// i.e. the NULL argument. If so, we should
-		// exit this loop by setting the flag.
-		if (args[iPos] == NULL)
-			iNullFound = 1;
-
-		// Go to the next argument.
-		iPos++;
+		*out++ = '\0';
+		lexer->out = out;
 	}
 
-	// Now we have split args into 3 separate command arguments,
-	// simply pass them to a helper function to run.
-	executeDoublePipeHelper(firstCommand, secondCommand, thirdCommand);
+	lexer->iNumHereDocs = 0;
+	return p;
 }
 
-// executeTriplePipeHelper() function takes four command arguments as input.
-// It will execute the first command and it's output is used as input to run
-// the second, third and fourth commands. The outputs of second, third and
-// fourth commands are displayed on the standard output.
-void executeTriplePipeHelper(char **firstCommand, char **secondCommand,
-							 char **thirdCommand, char **fourthCommand)
+// nextToken() function reads the next token of the input
+// into "token". Operators are recognized with or without
+// spaces around them, so "ls>out" and "a|b" work. Words
+// can be quoted with '...', in which everything is taken
+// literally, or with "...", in which a backslash only
+// escapes " \ $ ` and a newline. Outside quotes a
+// backslash escapes any character. A $ outside '...'
+// is marked for expansion, see readDollar(). A newline is just a
+// space, unless the lexer is reading a script. After a
+// newline come the texts of the here-documents started
+// on the line before it, if any.
+void nextToken(Lexer *lexer, Token *token)
 {
-	pid_t pid;
-	int status;
-	int p1[2];
-	pipe(p1);
-
-	// Run the first command as a child process.
-	pid = fork();
+	const char *p = lexer->input;
 
-	if (pid == 0)
+	while ((*p == ' ') || (*p == '\t') || ((*p == '\n') && !lexer->iNewlines) ||
+		   ((*p == '\\') && (p[1] == '\n')))
 	{
-		close(p1[0]);  // we don't need read end of p1 pipe in first command
-		dup2(p1[1], STDOUT_FILENO);  // close standard output and write to write end of p1 pipe instead
-		execvp(firstCommand[0], firstCommand);		// run the first command, it will write to write end of p1 pipe now
+		if ((*p == '\n') && (lexer->iNumHereDocs > 0))
+			p = readHereDocuments(lexer, p + 1);
+		else
+			p += (*p == '\\') ? 2 : 1;
 	}
 
-	// Use the read end of pipe p1 in the parent process
-	// here and pass the data read from pipe into a new
-	// file.
-	close(p1[1]);	// we don't need write end of p1 pipe in parent process, we only want to read from p1 pipe in parent process
-	wait(&status);
-	
-	// Read from read end of p1 pipe and
-	// store it in "buff" variable
-	char buff[4096];
-	int iNumRead = read(p1[0], buff, sizeof(buff));
+	token->text = NULL;
+	token->fd = -1;
+	token->iQuoted = 0;
+	token->iAssignment = 0;
 
-	// Now "buff" variable has the output of the
-	// first command before ||| operator.
+	// Digits right before < or > are the descriptor
+	// to redirect, as in 2>errors.txt or 3<input.txt
+	if ((*p >= '0') && (*p <= '9'))
+	{
+		const char *q = p;
+		int fd = 0;
 
-	// Write the contents of "buff" variable into
-	// the write end of a new pipe p2. The read
-	// end of pipe p2 will be used later as input
-	// for the second command.
-	int p2[2];
-	pipe(p2);
-	write(p2[1], buff, iNumRead);
+		while ((*q >= '0') && (*q <= '9') && (fd < 100000))
+			fd = fd * 10 + (*q++ - '0');
 
-	// Run the second command as a child process.
-	pid = fork();
+		if ((*q == '<') || (*q == '>'))
+		{
+			token->fd = fd;
+			p = q;
+		}
+	}
 
-	if (pid == 0)
+	if (*p == '\0')
 	{
-		// Use read end of p2 pipe as input to run the second command
-		close(p2[1]);				// we don't need the write end of p2 pipe
-		dup2(p2[0], STDIN_FILENO);	// don't read from standard input, read from read end of p2 pipe instead
-		execvp(secondCommand[0], secondCommand);
+		token->type = Token_End;
+		lexer->input = p;
+		return;
 	}
-	else
+
+	if (*p == '\n')
 	{
-		close(p2[0]);
-		close(p2[1]);
-		wait(&status);
+		token->type = Token_Newline;
+		token->text = "newline";
+		lexer->input = (lexer->iNumHereDocs > 0) ? readHereDocuments(lexer, p + 1) : p + 1;
+		return;
 	}
 
-	// Write the contents of "buff" variable into
-	// the write end of a new pipe p3. The read
-	// end of pipe p3 will be used later as input
-	// for the third command.
-	int p3[2];
-	pipe(p3);
-	write(p3[1], buff, iNumRead);
+	if (*p == '|')
+	{
+		if ((p[1] == '|') && (p[2] == '|'))
+		{
+			token->type = Token_Fan_Out;
+			token->text = "|||";
+			p += 3;
+		}
+		else if (p[1] == '|')
+		{
+			token->type = Token_Fan_Out;
+			token->text = "||";
+			p += 2;
+		}
+		else if ((p[1] == '>') && (p[2] == '>'))
+		{
+			token->type = Token_Redirect;
+			token->redirect = Redirect_Tee_Append;
+			token->text = "|>>";
+			p += 3;
+		}
+		else if (p[1] == '>')
+		{
+			token->type = Token_Redirect;
+			token->redirect = Redirect_Tee;
+			token->text = "|>";
+			p += 2;
+		}
+		else
+		{
+			token->type = Token_Pipe;
+			token->text = "|";
+			p += 1;
+		}
 
-	// Run the third command as a child process.
-	pid = fork();
+		if (token->type == Token_Fan_Out)
+			lexer->iInFanOut = 1;
 
-	if (pid == 0)
-	{
-		// Use read end of p3 pipe as input to run the third command
-		close(p3[1]);				// we don't need the write end of p3 pipe
-		dup2(p3[0], STDIN_FILENO);	// don't read from standard input, read from read end of p3 pipe instead
-		execvp(thirdCommand[0], thirdCommand);
+		lexer->input = p;
+		return;
 	}
-	else
+
+	if (*p == '>')
 	{
-		close(p3[0]);
-		close(p3[1]);
-		wait(&status);
+		token->type = Token_Redirect;
+
+		if (p[1] == '>')
+		{
+			token->redirect = Redirect_Append;
+			token->text = ">>";
+			p += 2;
+		}
+		else if (p[1] == '&')
+		{
+			token->redirect = Redirect_Duplicate;
+			token->text = ">&";
+			p += 2;
+		}
+		else
+		{
+			token->redirect = Redirect_Output;
+			token->text = ">";
+			p += 1;
+		}
+
+		lexer->input = p;
+		return;
+	}
+
+	if (*p == '<')
+	{
+		token->type = Token_Redirect;
+
+		if ((p[1] == '<') && (p[2] == '<'))
+		{
+			token->redirect = Redirect_Here_String;
+			token->text = "<<<";
+			p += 3;
+		}
+		else if ((p[1] == '<') && (p[2] == '-'))
+		{
+			token->redirect = Redirect_Here_Doc;
+			token->text = "<<-";
+			p += 3;
+		}
+		else if (p[1] == '<')
+		{
+			token->redirect = Redirect_Here_Doc;
+			token->text = "<<";
+			p += 2;
+		}
+		else if (p[1] == '&')
+		{
+			token->redirect = Redirect_Duplicate;
+			token->text = "<&";
+			p += 2;
+		}
+		else
+		{
+			token->redirect = Redirect_Input;
+			token->text = "<";
+			p += 1;
+		}
+
+		lexer->input = p;
+		return;
+	}
+
+	// &> and &>> send both the standard output
+	// and the standard error to the file
+	if ((*p == '&') && (p[1] == '>'))
+	{
+		token->type = Token_Redirect;
+		token->redirect = (p[2] == '>') ? Redirect_Append : Redirect_Output;
+		token->text = (p[2] == '>') ? "&>>" : "&>";
+		lexer->input = p + ((p[2] == '>') ? 3 : 2);
+		return;
+	}
+
+	if (*p == '&')
+	{
+		token->type = Token_Background;
+		token->text = "&";
+		lexer->input = p + 1;
+		return;
+	}
+
+	if ((*p == ',') && lexer->iInFanOut)
+	{
+		token->type = Token_Comma;
+		token->text = ",";
+		lexer->input = p + 1;
+		return;
+	}
+
+	// Anything else is a word, which goes on until an
+	// unquoted space or operator character.
+	char *out = lexer->out;
+
+	token->type = Token_Word;
+	token->text = out;
+
+	while ((*p != '\0') && (*p != ' ') && (*p != '\t') && (*p != '\n') && !isOperatorChar(lexer, *p))
+	{
+		if ((*p == '\\') || (*p == '\'') || (*p == '"'))
+			token->iQuoted = 1;
+
+		if (*p == '\\')
+		{
+			p++;
+
+			if (*p == '\n')
+				p++;		// line continuation
+			else if (*p != '\0')
+				*out++ = *p++;
+		}
+		else if (*p == '\'')
+		{
+			p++;
+
+			while ((*p != '\0') && (*p != '\''))
+				*out++ = *p++;
+
+			if (*p == '\0')
+			{
+				token->type = Token_Error;
+				break;
+			}
+
+			p++;
+		}
+		else if (*p == '"')
+		{
+			p++;
+
+			while ((*p != '\0') && (*p != '"'))
+			{
+				if ((*p == '\\') && ((p[1] == '"') || (p[1] == '\\') || (p[1] == '$') || (p[1] == '`')))
+				{
+					*out++ = p[1];
+					p += 2;
+				}
+				else if ((*p == '\\') && (p[1] == '\n'))
+				{
+					p += 2;
+				}
+				else if (*p == '$')
+				{
+					p = readDollar(lexer, p, &out, EXPAND_QUOTED);
+				}
+				else
+				{
+					*out++ = *p++;
+				}
+			}
+
+			if (*p == '\0')
+			{
+				token->type = Token_Error;
+				break;
+			}
+
+			p++;
+		}
+		else if (*p == '$')
+		{
+			p = readDollar(lexer, p, &out, EXPAND_UNQUOTED);
+		}
+		else
+		{
+			// NAME=value assigns a variable, if it comes first
+			if ((*p == '=') && !token->iQuoted && !token->iAssignment &&
+				isValidName(token->text, out - token->text))
+				token->iAssignment = 1;
+
+			if ((*p == '*') || (*p == '?') || (*p == '['))
+			{
+				*out++ = GLOB_ACTIVE;
+				lexer->iExpand = 1;
+			}
+
+			*out++ = *p++;
+		}
+	}
+
+	*out++ = '\0';
+	lexer->out = out;
+	lexer->input = p;
+}
+
+// ParseScratch structure type is used to collect the
+// arguments of a command before their number is known.
+// It is reused for every command, and the finished array
+// is copied into the arena with exactly the right size.
+typedef struct
+{
+	void **items;					// collected pointers or structures
+	int iCount;						// number of items collected
+	int iAllocated;					// allocated number of items
+} ParseScratch;
+
+// Parser structure type holds the state of the
+// recursive descent parser.
+typedef struct
+{
+	Lexer lexer;					// lexer reading the input
+	Token token;					// current token
+	Arena *arena;					// where the result is allocated
+	const char *source;				// name of the script being parsed, or NULL
+	const char *start;				// start of the input, to find line numbers
+} Parser;
+
+// addToScratch() function appends one pointer
+// to a scratch list.
+void addToScratch(ParseScratch *scratch, void *item)
+{
+	if (scratch->iCount == scratch->iAllocated)
+	{
+		scratch->iAllocated = scratch->iAllocated ? scratch->iAllocated * 2 : 32;
+		scratch->items = realloc(scratch->items, scratch->iAllocated * sizeof(void *));
+	}
+
+	scratch->items[scratch->iCount++] = item;
+}
+
+// reportSyntaxError() function prints an error
+// message about the current token.
+void reportSyntaxError(Parser *parser)
+{
+	// In a script, say where the error is
+	if (parser->source != NULL)
+	{
+		const char *p;
+		int iLineNo = 1;
+
+		for (p = parser->start; p < parser->lexer.input; ++p)
+			if (*p == '\n')
+				iLineNo++;
+
+		// A newline token has already been passed
+		if (parser->token.type == Token_Newline)
+			iLineNo--;
+
+		fprintf(stderr, "%s: line %d: ", parser->source, iLineNo);
+	}
+
+	if (parser->token.type == Token_Error)
+		fprintf(stderr, "syntax error: unterminated quote\n");
+	else if ((parser->token.type == Token_End) || (parser->token.type == Token_Newline))
+		fprintf(stderr, "syntax error: unexpected end of line\n");
+	else
+		fprintf(stderr, "syntax error near unexpected token `%s'\n", parser->token.text);
+}
+
+// parseSimpleCommand() function parses one command, i.e. a
+// sequence of words and redirections, into "command". It
+// returns 0 on success and -1 on a syntax error. A command
+// without any word is a syntax error. The NAME=value words
+// before the command name are variable assignments, which
+// may also make up a whole line on their own. The text of
+// a << is filled in by the lexer once it gets to the next
+// line.
+int parseSimpleCommand(Parser *parser, SimpleCommand *command)
+{
+	static ParseScratch args;
+	static ParseScratch assignments;
+	Redirection **lastRedirection = &command->redirections;
+
+	args.iCount = 0;
+	assignments.iCount = 0;
+	command->redirections = NULL;
+
+	while (1)
+	{
+		if ((parser->token.type == Token_Word) && parser->token.iAssignment && (args.iCount == 0))
+		{
+			addToScratch(&assignments, parser->token.text);
+		}
+		else if (parser->token.type == Token_Word)
+		{
+			addToScratch(&args, parser->token.text);
+		}
+		else if (parser->token.type == Token_Redirect)
+		{
+			Redirection *redirection = arenaAlloc(parser->arena, sizeof(Redirection));
+			const char *operator = parser->token.text;
+			int iStripTabs = (strcmp(operator, "<<-") == 0);
+
+			// Without a number < and << redirect the standard
+			// input, the other operators the standard output
+			redirection->type = parser->token.redirect;
+			redirection->fd = parser->token.fd;
+
+			if (redirection->fd < 0)
+				redirection->fd = (operator[0] == '<') ? STDIN_FILENO : STDOUT_FILENO;
+
+			nextToken(&parser->lexer, &parser->token);
+
+			if ((parser->token.type != Token_Word) ||
+				((redirection->type == Redirect_Here_Doc) && (parser->lexer.iNumHereDocs == MAX_HERE_DOCUMENTS)))
+			{
+				reportSyntaxError(parser);
+				return -1;
+			}
+
+			redirection->target = parser->token.text;
+			redirection->next = NULL;
+
+			// n>&- closes n, otherwise n>&m needs a descriptor number
+			if (redirection->type == Redirect_Duplicate)
+			{
+				if (strcmp(redirection->target, "-") == 0)
+				{
+					redirection->type = Redirect_Close;
+				}
+				else if (strspn(redirection->target, "0123456789") != strlen(redirection->target))
+				{
+					reportSyntaxError(parser);
+					return -1;
+				}
+			}
+
+			if (redirection->type == Redirect_Here_Doc)
+			{
+				HereDocument *hereDoc = &parser->lexer.hereDocs[parser->lexer.iNumHereDocs++];
+
+				hereDoc->redirection = redirection;
+				hereDoc->delimiter = parser->token.text;
+				hereDoc->iStripTabs = iStripTabs;
+				hereDoc->iExpand = !parser->token.iQuoted;
+				redirection->target = "";
+			}
+			*lastRedirection = redirection;
+			lastRedirection = &redirection->next;
+
+			// &>file is the same as >file 2>&1
+			if (operator[0] == '&')
+			{
+				Redirection *duplicate = arenaAlloc(parser->arena, sizeof(Redirection));
+
+				duplicate->type = Redirect_Duplicate;
+				duplicate->fd = STDERR_FILENO;
+				duplicate->target = "1";
+				duplicate->next = NULL;
+				*lastRedirection = duplicate;
+				lastRedirection = &duplicate->next;
+			}
+		}
+		else
+		{
+			break;
+		}
+
+		nextToken(&parser->lexer, &parser->token);
+	}
+
+	// Assignments alone can't be part of a pipe chain
+	if ((args.iCount == 0) &&
+		((assignments.iCount == 0) || ((parser->token.type != Token_End) && (parser->token.type != Token_Newline))))
+	{
+		reportSyntaxError(parser);
+		return -1;
+	}
+
+	command->iNumArgs = args.iCount;
+	command->args = arenaAlloc(parser->arena, (args.iCount + 1) * sizeof(char *));
+	if (args.iCount > 0)
+		memcpy(command->args, args.items, args.iCount * sizeof(char *));
+	command->args[args.iCount] = NULL;
+
+	command->iNumAssignments = assignments.iCount;
+	command->assignments = arenaAlloc(parser->arena, (assignments.iCount + 1) * sizeof(char *));
+	if (assignments.iCount > 0)
+		memcpy(command->assignments, assignments.items, assignments.iCount * sizeof(char *));
+	command->assignments[assignments.iCount] = NULL;
+
+	return 0;
+}
+
+// parseLine() function parses one line of input, starting
+// at the current token of "parser", into a CommandLine
+// allocated from the parser's arena. The line ends at the
+// end of the input or, in a script, at a newline, which is
+// left as the current token. The grammar is:
+//		line		:= [ pipeline [ fan-out command { , command } ] [ & ] ]
+//					 | { assignment | redirection }+
+//		pipeline	:= command { | command }
+//		command		:= { assignment } { word | redirection }+
+//		redirection	:= [ n ] ( > | >> | < | << | <<- | <<< | >& | <& ) word
+//					 | ( &> | &>> | |> | |>> ) word
+// where the producer of a fan-out must be a single command.
+// It returns NULL after printing a message if the line
+// has a syntax error.
+CommandLine* parseLine(Parser *parser)
+{
+	static SimpleCommand *commands = NULL;
+	static int iAllocatedCommands = 0;
+	int iNumCommands = 0;
+	CommandLine *line = arenaAlloc(parser->arena, sizeof(CommandLine));
+	int iNumPipes = 0;
+
+	line->type = Simple;
+	line->iNumCommands = 0;
+	line->commands = NULL;
+	line->iBackground = 0;
+	line->iTimed = 0;
+	line->iIncomplete = 0;
+	line->iExpand = 0;
+
+	if ((parser->token.type == Token_End) || (parser->token.type == Token_Newline))
+		return line;
+
+	while (1)
+	{
+		if (iNumCommands == iAllocatedCommands)
+		{
+			iAllocatedCommands = iAllocatedCommands ? iAllocatedCommands * 2 : 16;
+			commands = realloc(commands, iAllocatedCommands * sizeof(SimpleCommand));
+		}
+
+		if (parseSimpleCommand(parser, &commands[iNumCommands]) < 0)
+			return NULL;
+
+		// "time" in front of a line times all of it, like
+		// in other shells. "time -a ..." is the builtin.
+		if ((iNumCommands == 0) && (commands[0].iNumArgs > 1) &&
+			(strcmp(commands[0].args[0], "time") == 0) && (commands[0].args[1][0] != '-'))
+		{
+			commands[0].args++;
+			commands[0].iNumArgs--;
+			line->iTimed = 1;
+		}
+
+		iNumCommands++;
+
+		if ((parser->token.type == Token_Pipe) && (line->type != Fan_Out))
+		{
+			iNumPipes++;
+			line->type = Piped_Chain;
+		}
+		else if ((parser->token.type == Token_Fan_Out) && (iNumPipes == 0) && (iNumCommands == 1))
+		{
+			line->type = Fan_Out;
+		}
+		else if ((parser->token.type == Token_Comma) && (line->type == Fan_Out))
+		{
+			// The next consumer follows
+		}
+		else if ((parser->token.type == Token_End) || (parser->token.type == Token_Newline))
+		{
+			break;
+		}
+		else if (parser->token.type == Token_Background)
+		{
+			// Nothing but the end of the line may follow &
+			nextToken(&parser->lexer, &parser->token);
+
+			if ((parser->token.type != Token_End) && (parser->token.type != Token_Newline))
+			{
+				reportSyntaxError(parser);
+				return NULL;
+			}
+
+			line->iBackground = 1;
+			break;
+		}
+		else
+		{
+			reportSyntaxError(parser);
+			return NULL;
+		}
+
+		nextToken(&parser->lexer, &parser->token);
+	}
+
+	// The lines of a here-document are still to come
+	line->iIncomplete = (parser->lexer.iNumHereDocs > 0) || parser->lexer.iHereIncomplete;
+	parser->lexer.iHereIncomplete = 0;
+
+	// The next line starts with the token after
+	// the newline, which hasn't been read yet
+	line->iExpand = parser->lexer.iExpand;
+	parser->lexer.iExpand = 0;
+
+	line->iNumCommands = iNumCommands;
+	line->commands = arenaAlloc(parser->arena, iNumCommands * sizeof(SimpleCommand));
+	memcpy(line->commands, commands, iNumCommands * sizeof(SimpleCommand));
+
+	// The shell itself copies the output of a single command
+	// with |> or |>>. Other redirections are applied by the
+	// child process, and builtins are found when the line is
+	// executed.
+	if (line->type == Simple)
+	{
+		Redirection *redirection;
+
+		for (redirection = line->commands[0].redirections; redirection; redirection = redirection->next)
+		{
+			if (redirection->type == Redirect_Tee)
+				line->type = Output_Tee;
+			else if (redirection->type == Redirect_Tee_Append)
+				line->type = Output_Tee_Append;
+		}
+	}
+
+	return line;
+}
+
+// parseCommandLine() function parses the user input into
+// a CommandLine allocated from "arena", going over the
+// input only once. It returns NULL after printing a
+// message if the input has a syntax error.
+CommandLine* parseCommandLine(Arena *arena, const char *input)
+{
+	Parser parser;
+
+	parser.arena = arena;
+	parser.source = NULL;
+	parser.start = input;
+	parser.lexer.input = input;
+	parser.lexer.out = arenaAlloc(arena, LEXER_BUFFER_SIZE(strlen(input)));
+	parser.lexer.iInFanOut = 0;
+	parser.lexer.iNewlines = 0;
+	parser.lexer.iNumHereDocs = 0;
+	parser.lexer.iHereIncomplete = 0;
+	parser.lexer.iExpand = 0;
+	nextToken(&parser.lexer, &parser.token);
+
+	return parseLine(&parser);
+}
+
+// printArguments() function is just used for
+// debugging purposes. It simply prints all the
+// arguments present in "args" parameter (including
+// the last NULL argument).
+void printArguments(char **args)
+{
+	int iPos = 0;
+	int iNullFound = 0;
+
+	printf("Naveen: Printing all arguments.\n");
+
+	while (!iNullFound)
+	{
+		// Print the argument
+		printf("args[%d] = %s\n", iPos, args[iPos]);
+
+		// Check if we have just printed the last
+		// i.e. the NULL argument. If so, we should
+		// exit this loop by setting the flag.
+		if (args[iPos] == NULL)
+			iNullFound = 1;
+
+		// Go to the next argument.
+		iPos++;
+	}
+}
+
+// Exit status of the last command, 0 to 255
+int iLastStatus = 0;
+
+// getExitStatus() function converts a status from
+// waitpid() to an exit status the way other shells
+// do, with 128 + n for a child killed by signal n.
+int getExitStatus(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+
+	return status;
+}
+
+// printExecutionStatus() function will print the
+// pid and status as per parameters passed to it.
+void printExecutionStatus(pid_t pid, int status)
+{
+	printf("\nPID of completed command = %d and ", pid);
+	printf("Status of completed command = %d.\n", status);
+}
+
+// getMonotonicTime() function returns the time
+// in seconds from a clock that never jumps.
+double getMonotonicTime()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Descriptor of the trace file named by CSHELL_TRACE,
+// or -1 if the shell is not tracing
+int fdTrace = -1;
+
+// PID of the shell that opened the trace file. All the
+// events belong to it, with one track for every process
+// that the shell has started (see traceEvent()).
+pid_t tracePid;
+
+// TraceArgs structure type is used to build the "args"
+// object of a trace event, i.e. the details of the event
+// shown by the trace viewer.
+typedef struct
+{
+	char text[2048];				// the members of the object, without the braces
+	size_t iLength;					// length of text
+} TraceArgs;
+
+// initTraceArgs() function empties "args".
+void initTraceArgs(TraceArgs *args)
+{
+	args->text[0] = '\0';
+	args->iLength = 0;
+}
+
+// addTraceString() function adds the member "key" with
+// the string "value" to "args", escaped for JSON. What
+// doesn't fit into "args" is left out.
+void addTraceString(TraceArgs *args, const char *key, const char *value)
+{
+	char escaped[1024];
+	size_t iLength = 0;
+	const char *p;
+
+	for (p = value; *p && (iLength + 7 < sizeof(escaped)); ++p)
+	{
+		if ((*p == '"') || (*p == '\\'))
+		{
+			escaped[iLength++] = '\\';
+			escaped[iLength++] = *p;
+		}
+		else if ((unsigned char) *p < 0x20)
+		{
+			iLength += sprintf(escaped + iLength, "\\u%04x", *p);
+		}
+		else
+		{
+			escaped[iLength++] = *p;
+		}
+	}
+
+	escaped[iLength] = '\0';
+
+	iLength = snprintf(args->text + args->iLength, sizeof(args->text) - args->iLength,
+					   "%s\"%s\":\"%s\"", args->iLength ? "," : "", key, escaped);
+
+	if (args->iLength + iLength < sizeof(args->text))
+		args->iLength += iLength;
+	else
+		args->text[args->iLength] = '\0';
+}
+
+// addTraceNumber() function adds the member
+// "key" with the number "value" to "args".
+void addTraceNumber(TraceArgs *args, const char *key, double value)
+{
+	size_t iLength = snprintf(args->text + args->iLength, sizeof(args->text) - args->iLength,
+							  "%s\"%s\":%.15g", args->iLength ? "," : "", key, value);
+
+	if (args->iLength + iLength < sizeof(args->text))
+		args->iLength += iLength;
+	else
+		args->text[args->iLength] = '\0';
+}
+
+// writeTraceEvent() function appends one event to the
+// trace file in the Chrome trace event format: "name"
+// lasted from "startTime" to "endTime" (as returned by
+// getMonotonicTime()) on the track of the process "tid".
+// Every event goes out with a single write() to a file
+// opened with O_APPEND, so the events of the shell and
+// of its children never mix, and nothing is buffered in
+// the shell when it forks. "separator" follows the event.
+void writeTraceEvent(const char *name, double startTime, double endTime, pid_t tid,
+					 TraceArgs *args, const char *separator)
+{
+	char event[4096];
+	int iLength;
+
+	iLength = snprintf(event, sizeof(event),
+					   "{\"name\":\"%s\",\"cat\":\"cshell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+					   "\"pid\":%d,\"tid\":%d,\"args\":{%s}}%s",
+					   name, startTime * 1e6, (endTime - startTime) * 1e6, tracePid, tid,
+					   args ? args->text : "", separator);
+
+	if (iLength >= (int) sizeof(event))
+		iLength = sizeof(event) - 1;
+
+	write(fdTrace, event, iLength);
+}
+
+// traceEvent() function records the event "name" in the
+// trace file, see writeTraceEvent(). It does nothing if
+// the shell is not tracing.
+void traceEvent(const char *name, double startTime, double endTime, pid_t tid, TraceArgs *args)
+{
+	if (fdTrace >= 0)
+		writeTraceEvent(name, startTime, endTime, tid, args, ",\n");
+}
+
+// closeTrace() function is called when the shell exits.
+// It ends the trace with an event that isn't followed
+// by a comma and closes the JSON array, so the file is
+// valid JSON. A trace cut short is still readable by
+// the trace viewers, which don't need the end.
+void closeTrace()
+{
+	TraceArgs args;
+	double now = getMonotonicTime();
+
+	if ((fdTrace < 0) || (getpid() != tracePid))
+		return;
+
+	initTraceArgs(&args);
+	addTraceNumber(&args, "status", iLastStatus);
+	writeTraceEvent("exit", now, now, tracePid, &args, "\n]\n");
+
+	close(fdTrace);
+	fdTrace = -1;
+}
+
+// initTrace() function opens the trace file if the
+// CSHELL_TRACE environment variable names one. The
+// trace can be loaded into chrome://tracing or the
+// Perfetto UI to see where the time of every command
+// goes: parsing, PATH lookups, starting the processes,
+// how long each of them runs and the data the shell
+// copies for |> and fan-outs.
+void initTrace()
+{
+	const char *path = getenv("CSHELL_TRACE");
+
+	if ((path == NULL) || (path[0] == '\0'))
+		return;
+
+	fdTrace = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+	if (fdTrace < 0)
+	{
+		perror(path);
+		return;
+	}
+
+	tracePid = getpid();
+	write(fdTrace, "[\n", 2);
+	atexit(closeTrace);
+}
+
+// hashString() function returns the 32-bit FNV-1a
+// hash of a NUL-terminated string.
+unsigned int hashString(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	while (*str)
+	{
+		h ^= (unsigned char) *str++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+// Variable structure type is used to contain one
+// slot of the table of shell variables.
+typedef struct
+{
+	char *text;						// "NAME=value", "NAME" if it has no value yet, NULL for an empty slot
+	size_t iNameLength;				// length of the name at the start of text
+	int iExported;					// 1 if it goes into the environment of the commands
+	int iRemoved;					// 1 if the variable was unset, the slot still belongs to a chain
+} Variable;
+
+// VariableTable structure type holds the variables of the
+// shell in a hash table with open addressing: a name is
+// looked for from the slot of its hash onwards, until an
+// empty slot. The text of a variable is the "NAME=value"
+// string itself, so the environment of the commands is an
+// array of pointers to the texts of the exported variables.
+// That array is only rebuilt when an exported variable has
+// changed, and the texts it points to are kept until then,
+// so starting a command normally costs nothing extra.
+typedef struct
+{
+	Variable *slots;				// the hash table
+	int iCapacity;					// number of slots, a power of 2
+	int iUsed;						// slots that aren't empty, unset variables included
+	char **envp;					// NULL terminated environment built from the exported variables
+	int iEnvChanged;				// 1 if an exported variable has changed since envp was built
+	char **retired;					// texts replaced since envp was built, which it may point to
+	int iNumRetired;				// number of entries in retired
+	int iRetiredAllocated;			// allocated number of entries
+} VariableTable;
+
+// Number of slots the table of variables starts with
+#define VARIABLE_TABLE_MIN_SIZE 64
+
+// The variables of the shell
+VariableTable variables;
+
+// findVariable() function returns the slot of the variable
+// "name", which is "iLength" characters long, or the empty
+// slot where it would go if there is no such variable.
+Variable* findVariable(const char *name, size_t iLength)
+{
+	unsigned int h = 2166136261u;
+	Variable *removed = NULL;
+	size_t i;
+
+	for (i = 0; i < iLength; ++i)
+	{
+		h ^= (unsigned char) name[i];
+		h *= 16777619u;
+	}
+
+	for (i = h & (variables.iCapacity - 1); ; i = (i + 1) & (variables.iCapacity - 1))
+	{
+		Variable *slot = &variables.slots[i];
+
+		if (slot->text == NULL)
+			return removed ? removed : slot;
+
+		if (slot->iRemoved)
+		{
+			if (removed == NULL)
+				removed = slot;
+		}
+		else if ((slot->iNameLength == iLength) && (memcmp(slot->text, name, iLength) == 0))
+		{
+			return slot;
+		}
+	}
+}
+
+// growVariableTable() function makes room for one more
+// variable, rehashing the table into twice as many slots
+// when it is three quarters full. Unset variables are
+// dropped on the way.
+void growVariableTable()
+{
+	Variable *oldSlots = variables.slots;
+	int iOldCapacity = variables.iCapacity;
+	int i;
+
+	if ((variables.slots != NULL) && (4 * (variables.iUsed + 1) < 3 * variables.iCapacity))
+		return;
+
+	variables.iCapacity = (iOldCapacity > 0) ? 2 * iOldCapacity : VARIABLE_TABLE_MIN_SIZE;
+	variables.slots = calloc(variables.iCapacity, sizeof(Variable));
+	variables.iUsed = 0;
+
+	for (i = 0; i < iOldCapacity; ++i)
+	{
+		if ((oldSlots[i].text != NULL) && !oldSlots[i].iRemoved)
+		{
+			*findVariable(oldSlots[i].text, oldSlots[i].iNameLength) = oldSlots[i];
+			variables.iUsed++;
+		}
+		else
+		{
+			free(oldSlots[i].text);
+		}
+	}
+
+	free(oldSlots);
+}
+
+// retireVariableText() function gives back the text of a
+// variable that has been replaced. While the environment
+// may still point to it, it is only put aside.
+void retireVariableText(Variable *slot)
+{
+	if (!slot->iExported)
+	{
+		free(slot->text);
+		return;
+	}
+
+	if (variables.iNumRetired == variables.iRetiredAllocated)
+	{
+		variables.iRetiredAllocated = variables.iRetiredAllocated ? variables.iRetiredAllocated * 2 : 16;
+		variables.retired = realloc(variables.retired, variables.iRetiredAllocated * sizeof(char *));
+	}
+
+	variables.retired[variables.iNumRetired++] = slot->text;
+	variables.iEnvChanged = 1;
+}
+
+// getVariable() function returns the value of the
+// variable "name", or NULL if it isn't set.
+const char* getVariable(const char *name)
+{
+	Variable *slot;
+
+	if (variables.slots == NULL)
+		return NULL;
+
+	slot = findVariable(name, strlen(name));
+
+	if ((slot->text == NULL) || slot->iRemoved || (slot->text[slot->iNameLength] != '='))
+		return NULL;
+
+	return slot->text + slot->iNameLength + 1;
+}
+
+// setVariable() function sets the variable whose name is the
+// first "iNameLength" characters of "name" to "value". If
+// "iExport" is 1 it is exported as well, otherwise it stays
+// exported if it was. A NULL value marks the variable for
+// export without giving it a value, as "export NAME" does.
+void setVariable(const char *name, size_t iNameLength, const char *value, int iExport)
+{
+	Variable *slot;
+	char *text;
+
+	growVariableTable();
+	slot = findVariable(name, iNameLength);
+
+	if ((value == NULL) && (slot->text != NULL) && !slot->iRemoved)
+	{
+		// Only the export flag changes
+		variables.iEnvChanged |= (iExport && !slot->iExported);
+		slot->iExported |= iExport;
+		return;
+	}
+
+	text = malloc(iNameLength + (value ? strlen(value) + 2 : 1));
+	memcpy(text, name, iNameLength);
+	text[iNameLength] = '\0';
+
+	if (value != NULL)
+	{
+		text[iNameLength] = '=';
+		strcpy(text + iNameLength + 1, value);
+	}
+
+	if ((slot->text != NULL) && !slot->iRemoved)
+	{
+		retireVariableText(slot);
+	}
+	else
+	{
+		if (slot->text == NULL)
+			variables.iUsed++;
+		else
+			free(slot->text);
+
+		slot->iExported = 0;
+		slot->iRemoved = 0;
+	}
+
+	slot->text = text;
+	slot->iNameLength = iNameLength;
+	slot->iExported |= iExport;
+	variables.iEnvChanged |= slot->iExported;
+}
+
+// assignVariable() function runs the assignment "NAME=value",
+// as found by the parser. The variable is exported as well if
+// "iExport" is 1.
+void assignVariable(const char *assignment, int iExport)
+{
+	const char *equals = strchr(assignment, '=');
+
+	setVariable(assignment, equals - assignment, equals + 1, iExport);
+}
+
+// unsetVariable() function removes the variable "name".
+void unsetVariable(const char *name)
+{
+	Variable *slot;
+
+	if (variables.slots == NULL)
+		return;
+
+	slot = findVariable(name, strlen(name));
+
+	if ((slot->text == NULL) || slot->iRemoved)
+		return;
+
+	// The slot stays taken, so that the variables
+	// after it in the same chain are still found
+	retireVariableText(slot);
+	slot->text = strndup(name, slot->iNameLength);
+	slot->iExported = 0;
+	slot->iRemoved = 1;
+}
+
+// getEnvironment() function returns the environment for
+// the commands the shell starts, made of its exported
+// variables. It is only rebuilt when one of them has
+// changed. The C library sees the same environment, e.g.
+// for TZ, so environ is pointed at it too.
+char** getEnvironment()
+{
+	extern char **environ;
+	int iCount = 0;
+	int i;
+
+	if ((variables.envp != NULL) && !variables.iEnvChanged)
+		return variables.envp;
+
+	for (i = 0; i < variables.iCapacity; ++i)
+		iCount += (variables.slots[i].text != NULL) && variables.slots[i].iExported;
+
+	free(variables.envp);
+	variables.envp = malloc((iCount + 1) * sizeof(char *));
+	iCount = 0;
+
+	for (i = 0; i < variables.iCapacity; ++i)
+	{
+		Variable *slot = &variables.slots[i];
+
+		if ((slot->text != NULL) && slot->iExported && (slot->text[slot->iNameLength] == '='))
+			variables.envp[iCount++] = slot->text;
+	}
+
+	variables.envp[iCount] = NULL;
+	environ = variables.envp;
+
+	// Nothing points to the old texts any more
+	for (i = 0; i < variables.iNumRetired; ++i)
+		free(variables.retired[i]);
+
+	variables.iNumRetired = 0;
+	variables.iEnvChanged = 0;
+
+	return variables.envp;
+}
+
+// initVariables() function fills the table of variables
+// with the environment the shell was started with, all
+// of it exported.
+void initVariables()
+{
+	extern char **environ;
+	int i;
+
+	growVariableTable();
+
+	for (i = 0; environ[i] != NULL; ++i)
+	{
+		char *equals = strchr(environ[i], '=');
+
+		if ((equals != NULL) && (equals > environ[i]))
+			setVariable(environ[i], equals - environ[i], equals + 1, 1);
+	}
+
+	getEnvironment();
+}
+
+// getCommandEnvironment() function returns the environment
+// for running "command", made in the command arena, when its
+// variable assignments have to be added to the one of the
+// shell, as in "LANG=C sort". It returns NULL if there are
+// none, the environment of the shell is then used as it is.
+char** getCommandEnvironment(SimpleCommand *command)
+{
+	char **shared;
+	char **envp;
+	int iCount = 0;
+	int i, j;
+
+	if (command->iNumAssignments == 0)
+		return NULL;
+
+	shared = getEnvironment();
+
+	while (shared[iCount] != NULL)
+		iCount++;
+
+	envp = arenaAlloc(&commandArena, (iCount + command->iNumAssignments + 1) * sizeof(char *));
+	iCount = 0;
+
+	for (i = 0; shared[i] != NULL; ++i)
+	{
+		size_t iNameLength = strcspn(shared[i], "=");
+
+		// Leave out the variables the command sets
+		for (j = 0; j < command->iNumAssignments; ++j)
+			if ((strncmp(command->assignments[j], shared[i], iNameLength) == 0) &&
+				(command->assignments[j][iNameLength] == '='))
+				break;
+
+		if (j == command->iNumAssignments)
+			envp[iCount++] = shared[i];
+	}
+
+	for (j = 0; j < command->iNumAssignments; ++j)
+		envp[iCount++] = command->assignments[j];
+
+	envp[iCount] = NULL;
+
+	return envp;
+}
+
+// CommandPathEntry structure type is used as one
+// node of a bucket chain in the command path cache.
+typedef struct CommandPathEntry
+{
+	char *name;							// command name as typed, e.g. "ls"
+	char *path;							// absolute path it resolved to, e.g. "/usr/bin/ls"
+	int iHits;							// number of times this entry has been used
+	struct CommandPathEntry *next;		// pointer to the next node in the same bucket
+} CommandPathEntry;
+
+#define PATH_CACHE_BUCKETS 256
+
+// Hash table from command name to the absolute path
+// found by searching $PATH, like the one in bash.
+CommandPathEntry* pathCache[PATH_CACHE_BUCKETS];
+
+// Value of PATH the entries in pathCache were found
+// with. The cache is emptied when PATH changes.
+char* pathCacheSource = NULL;
+
+// Lookup counters reported by the "hash" command.
+long iPathCacheHits = 0;
+long iPathCacheMisses = 0;
+
+// clearPathCache() function removes all the
+// entries from the command path cache.
+void clearPathCache()
+{
+	int i;
+
+	for (i = 0; i < PATH_CACHE_BUCKETS; ++i)
+	{
+		CommandPathEntry *p = pathCache[i];
+
+		while (p)
+		{
+			CommandPathEntry *next = p->next;
+			free(p->name);
+			free(p->path);
+			free(p);
+			p = next;
+		}
+
+		pathCache[i] = NULL;
+	}
+}
+
+// checkPathCacheSource() function empties the command
+// path cache if PATH has changed since it was filled.
+void checkPathCacheSource()
+{
+	const char *path = getVariable("PATH");
+
+	if (path == NULL)
+		path = "";
+
+	if ((pathCacheSource != NULL) && (strcmp(pathCacheSource, path) == 0))
+		return;
+
+	clearPathCache();
+	free(pathCacheSource);
+	pathCacheSource = strdup(path);
+}
+
+// isExecutableFile() function returns 1 if "path" is
+// a regular file which we are allowed to execute.
+int isExecutableFile(const char *path)
+{
+	struct stat st;
+
+	return (stat(path, &st) == 0) && S_ISREG(st.st_mode) && (access(path, X_OK) == 0);
+}
+
+// searchPath() function walks every directory in PATH
+// looking for an executable called "name", the same
+// way execvp() does. It returns the full path in newly
+// allocated memory, or NULL if there is no such command.
+char* searchPath(const char *name)
+{
+	const char *dir = pathCacheSource;
+	size_t iNameLen = strlen(name);
+
+	while (dir != NULL)
+	{
+		const char *end = strchr(dir, ':');
+		size_t iDirLen = end ? (size_t) (end - dir) : strlen(dir);
+		char *candidate = malloc(iDirLen + iNameLen + 3);
+
+		// An empty PATH element means the current directory.
+		if (iDirLen == 0)
+			strcpy(candidate, ".");
+		else
+		{
+			memcpy(candidate, dir, iDirLen);
+			candidate[iDirLen] = '\0';
+		}
+
+		strcat(candidate, "/");
+		strcat(candidate, name);
+
+		if (isExecutableFile(candidate))
+			return candidate;
+
+		free(candidate);
+		dir = end ? end + 1 : NULL;
+	}
+
+	return NULL;
+}
+
+// removeFromPathCache() function removes "name" from
+// the command path cache if it is present.
+void removeFromPathCache(const char *name)
+{
+	CommandPathEntry **pp = &pathCache[hashString(name) % PATH_CACHE_BUCKETS];
+
+	while (*pp)
+	{
+		if (strcmp((*pp)->name, name) == 0)
+		{
+			CommandPathEntry *p = *pp;
+			*pp = p->next;
+			free(p->name);
+			free(p->path);
+			free(p);
+			return;
+		}
+
+		pp = &(*pp)->next;
+	}
+}
+
+// resolveCommandPath() function returns the path that
+// should be passed to execv() to run the command "name".
+// Names containing a / are used as they are. Other names
+// are looked up in the command path cache first, and
+// $PATH is only searched on a miss. A cached path that no
+// longer points at an executable is dropped and searched
+// for again. It returns NULL if the command can't be found.
+// The returned string belongs to the cache, don't free it.
+char* resolveCommandPath(char *name)
+{
+	if ((name == NULL) || (name[0] == '\0'))
+		return NULL;
+
+	if (strchr(name, '/') != NULL)
+		return name;
+
+	checkPathCacheSource();
+
+	unsigned int iBucket = hashString(name) % PATH_CACHE_BUCKETS;
+	CommandPathEntry *p = pathCache[iBucket];
+
+	while (p && (strcmp(p->name, name) != 0))
+		p = p->next;
+
+	if (p != NULL)
+	{
+		// A single access() on the cached file is enough to
+		// notice it has been removed, without walking PATH.
+		if (access(p->path, X_OK) == 0)
+		{
+			p->iHits++;
+			iPathCacheHits++;
+			return p->path;
+		}
+
+		removeFromPathCache(name);
+	}
+
+	iPathCacheMisses++;
+
+	char *path = searchPath(name);
+
+	if (path == NULL)
+		return NULL;
+
+	p = malloc(sizeof(CommandPathEntry));
+	p->name = strdup(name);
+	p->path = path;
+	p->iHits = 1;
+	p->next = pathCache[iBucket];
+	pathCache[iBucket] = p;
+
+	return p->path;
+}
+
+// resolveOrReport() function calls resolveCommandPath()
+// and prints an error message if the command could not
+// be found.
+char* resolveOrReport(char *name)
+{
+	double startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+	long iMisses = iPathCacheMisses;
+	char *path = resolveCommandPath(name);
+
+	if ((path == NULL) && (name != NULL))
+		fprintf(stderr, "%s: command not found\n", name);
+
+	if ((fdTrace >= 0) && (name != NULL))
+	{
+		TraceArgs args;
+
+		initTraceArgs(&args);
+		addTraceString(&args, "command", name);
+		addTraceString(&args, "path", path ? path : "");
+		addTraceNumber(&args, "cached", iMisses == iPathCacheMisses);
+		traceEvent("lookup", startTime, getMonotonicTime(), getpid(), &args);
+	}
+
+	return path;
+}
+
+// executeHash() function is used to execute the "hash"
+// command entered by user. It mimics the "hash" command
+// of bash:
+//		hash			list the cached commands and the hit/miss counters
+//		hash -r			forget all the cached commands
+//		hash -d name...	forget the given commands
+//		hash name...	look the given commands up in PATH and cache them
+int executeHash(char **args)
+{
+	int iStatus = 0;
+	int i;
+
+	checkPathCacheSource();
+
+	if (args[1] == NULL)
+	{
+		printf("hits\tcommand\n");
+
+		for (i = 0; i < PATH_CACHE_BUCKETS; ++i)
+		{
+			CommandPathEntry *p;
+
+			for (p = pathCache[i]; p; p = p->next)
+				printf("%4d\t%s\n", p->iHits, p->path);
+		}
+
+		printf("%ld hits, %ld misses\n", iPathCacheHits, iPathCacheMisses);
+	}
+	else if (strcmp(args[1], "-r") == 0)
+	{
+		clearPathCache();
+		iPathCacheHits = 0;
+		iPathCacheMisses = 0;
+	}
+	else if (strcmp(args[1], "-d") == 0)
+	{
+		for (i = 2; args[i] != NULL; ++i)
+			removeFromPathCache(args[i]);
+	}
+	else
+	{
+		for (i = 1; args[i] != NULL; ++i)
+		{
+			// Force a fresh search of PATH.
+			removeFromPathCache(args[i]);
+
+			if (resolveCommandPath(args[i]) == NULL)
+			{
+				fprintf(stderr, "hash: %s: not found\n", args[i]);
+				iStatus = 1;
+			}
+		}
+	}
+
+	return iStatus;
+}
+
+// IndexedDirectory structure type is used to remember
+// the executables found in one directory of PATH.
+typedef struct
+{
+	char *path;						// the directory
+	struct timespec mtime;			// its modification time when it was read
+	int iRead;						// 1 once it has been read
+	char **names;					// names of the executables in it, sorted
+	int iNumNames;					// number of names
+} IndexedDirectory;
+
+// CommandIndex structure type holds the names of all the
+// executables in PATH, for completing command names. It is
+// built by a background thread, so that the directories of
+// PATH, which may be on a slow network file system, are
+// never read while the user waits. A directory is read
+// again only when its modification time has changed, which
+// is when a file has been added to it or removed from it.
+// While the thread runs it owns "dirs". The shell only
+// looks at "names", with "lock" held.
+typedef struct
+{
+	pthread_mutex_t lock;			// protects iRunning, iReady, names and iNumNames
+	pthread_t thread;				// the thread refreshing the index
+	int iThreadStarted;				// 1 if "thread" still has to be joined
+	int iRunning;					// 1 while the thread runs
+	int iReady;						// 1 once "names" has been filled the first time
+	char *source;					// value of PATH the directories were taken from
+	IndexedDirectory *dirs;			// the directories of PATH, in order
+	int iNumDirs;					// number of directories
+	char **names;					// all the names, sorted and without duplicates, in one block
+	int iNumNames;					// number of names
+	double checkTime;				// when the directories were last checked, see getMonotonicTime()
+} CommandIndex;
+
+// Seconds between two checks of the directories of PATH
+#define COMMAND_INDEX_CHECK_INTERVAL 2.0
+
+// Index of the commands in PATH, for tab completion
+CommandIndex commandIndex = { PTHREAD_MUTEX_INITIALIZER };
+
+// compareStrings() is the qsort() comparison
+// function for an array of strings.
+int compareStrings(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// freeIndexedDirectory() function frees the names
+// read from one directory.
+void freeIndexedDirectory(IndexedDirectory *dir)
+{
+	int i;
+
+	for (i = 0; i < dir->iNumNames; ++i)
+		free(dir->names[i]);
+
+	free(dir->names);
+	dir->names = NULL;
+	dir->iNumNames = 0;
+	dir->iRead = 0;
+}
+
+// readIndexedDirectory() function reads the names of the
+// executables in "dir". It makes one fstatat() call per
+// entry, and none at all for the entries that are
+// subdirectories according to readdir().
+void readIndexedDirectory(IndexedDirectory *dir)
+{
+	DIR *d = opendir(dir->path);
+	struct dirent *entry;
+	int iAllocated = 0;
+
+	freeIndexedDirectory(dir);
+
+	if (d == NULL)
+		return;
+
+	while ((entry = readdir(d)) != NULL)
+	{
+		struct stat st;
+
+		if ((entry->d_name[0] == '.') || (entry->d_type == DT_DIR))
+			continue;
+
+		if ((fstatat(dirfd(d), entry->d_name, &st, 0) < 0) || !S_ISREG(st.st_mode) ||
+			!(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+			continue;
+
+		if (dir->iNumNames == iAllocated)
+		{
+			iAllocated = iAllocated ? iAllocated * 2 : 64;
+			dir->names = realloc(dir->names, iAllocated * sizeof(char *));
+		}
+
+		dir->names[dir->iNumNames++] = strdup(entry->d_name);
+	}
+
+	closedir(d);
+	qsort(dir->names, dir->iNumNames, sizeof(char *), compareStrings);
+	dir->iRead = 1;
+}
+
+// mergeIndexNames() function returns the names of all the
+// directories of the index, sorted and without duplicates,
+// copied into one block that a single free() gives back.
+// The number of names is stored in "pNumNames".
+char** mergeIndexNames(int *pNumNames)
+{
+	char **all;
+	char **block;
+	char *text;
+	size_t iTextSize = 0;
+	int iTotal = 0;
+	int iCount = 0;
+	int i, j;
+
+	for (i = 0; i < commandIndex.iNumDirs; ++i)
+		iTotal += commandIndex.dirs[i].iNumNames;
+
+	all = malloc((iTotal + 1) * sizeof(char *));
+
+	for (i = 0; i < commandIndex.iNumDirs; ++i)
+		for (j = 0; j < commandIndex.dirs[i].iNumNames; ++j)
+			all[iCount++] = commandIndex.dirs[i].names[j];
+
+	qsort(all, iCount, sizeof(char *), compareStrings);
+
+	// Drop the names found in more than one directory
+	for (i = 0, j = 0; i < iCount; ++i)
+		if ((j == 0) || (strcmp(all[j - 1], all[i]) != 0))
+			all[j++] = all[i];
+
+	iCount = j;
+
+	for (i = 0; i < iCount; ++i)
+		iTextSize += strlen(all[i]) + 1;
+
+	block = malloc(iCount * sizeof(char *) + iTextSize + 1);
+	text = (char *) (block + iCount);
+
+	for (i = 0; i < iCount; ++i)
+	{
+		block[i] = text;
+		text = stpcpy(text, all[i]) + 1;
+	}
+
+	free(all);
+	*pNumNames = iCount;
+
+	return block;
+}
+
+// indexCommandsThread() function is the background thread
+// that brings the command index up to date. It checks the
+// modification time of every directory of PATH, reads the
+// ones that have changed, and then swaps the new list of
+// names in for the old one.
+void* indexCommandsThread(void *unused)
+{
+	char **names;
+	char **oldNames;
+	int iNumNames;
+	int i;
+
+	for (i = 0; i < commandIndex.iNumDirs; ++i)
+	{
+		IndexedDirectory *dir = &commandIndex.dirs[i];
+		struct stat st;
+
+		if (stat(dir->path, &st) < 0)
+		{
+			freeIndexedDirectory(dir);
+			continue;
+		}
+
+		if (dir->iRead && (st.st_mtim.tv_sec == dir->mtime.tv_sec) && (st.st_mtim.tv_nsec == dir->mtime.tv_nsec))
+			continue;
+
+		// The time is taken before reading, so a change
+		// made meanwhile is seen by the next check.
+		dir->mtime = st.st_mtim;
+		readIndexedDirectory(dir);
+	}
+
+	names = mergeIndexNames(&iNumNames);
+
+	pthread_mutex_lock(&commandIndex.lock);
+	oldNames = commandIndex.names;
+	commandIndex.names = names;
+	commandIndex.iNumNames = iNumNames;
+	commandIndex.iReady = 1;
+	commandIndex.iRunning = 0;
+	pthread_mutex_unlock(&commandIndex.lock);
+
+	free(oldNames);
+
+	return NULL;
+}
+
+// setIndexDirectories() function makes the index use the
+// directories of "path". Directories that were in the old
+// PATH keep what has been read from them.
+void setIndexDirectories(const char *path)
+{
+	IndexedDirectory *dirs = NULL;
+	int iNumDirs = 0;
+	const char *p = path;
+	int i;
+
+	while (1)
+	{
+		const char *end = strchr(p, ':');
+		size_t iLength = end ? (size_t) (end - p) : strlen(p);
+		IndexedDirectory *dir;
+
+		dirs = realloc(dirs, (iNumDirs + 1) * sizeof(IndexedDirectory));
+		dir = &dirs[iNumDirs++];
+		memset(dir, 0, sizeof(IndexedDirectory));
+
+		// An empty entry is the current directory
+		dir->path = (iLength > 0) ? strndup(p, iLength) : strdup(".");
+
+		for (i = 0; i < commandIndex.iNumDirs; ++i)
+		{
+			if ((commandIndex.dirs[i].path != NULL) && (strcmp(commandIndex.dirs[i].path, dir->path) == 0))
+			{
+				free(dir->path);
+				*dir = commandIndex.dirs[i];
+				commandIndex.dirs[i].path = NULL;
+				break;
+			}
+		}
+
+		if (end == NULL)
+			break;
+
+		p = end + 1;
+	}
+
+	for (i = 0; i < commandIndex.iNumDirs; ++i)
+	{
+		if (commandIndex.dirs[i].path != NULL)
+		{
+			freeIndexedDirectory(&commandIndex.dirs[i]);
+			free(commandIndex.dirs[i].path);
+		}
+	}
+
+	free(commandIndex.dirs);
+	commandIndex.dirs = dirs;
+	commandIndex.iNumDirs = iNumDirs;
+
+	free(commandIndex.source);
+	commandIndex.source = strdup(path);
+}
+
+// refreshCommandIndex() function is called before each
+// prompt. It starts the thread that builds the command
+// index the first time, and then again when PATH has
+// changed or the directories haven't been checked for
+// a while. It never waits for the thread.
+void refreshCommandIndex()
+{
+	const char *path = getVariable("PATH");
+	double now = getMonotonicTime();
+	sigset_t all, saved;
+	int iRunning;
+
+	if (path == NULL)
+		path = "";
+
+	pthread_mutex_lock(&commandIndex.lock);
+	iRunning = commandIndex.iRunning;
+	pthread_mutex_unlock(&commandIndex.lock);
+
+	if (iRunning)
+		return;
+
+	if (commandIndex.iThreadStarted)
+	{
+		pthread_join(commandIndex.thread, NULL);
+		commandIndex.iThreadStarted = 0;
+	}
+
+	if ((commandIndex.source != NULL) && (strcmp(commandIndex.source, path) == 0) &&
+		(now - commandIndex.checkTime < COMMAND_INDEX_CHECK_INTERVAL))
+		return;
+
+	if ((commandIndex.source == NULL) || (strcmp(commandIndex.source, path) != 0))
+		setIndexDirectories(path);
+
+	commandIndex.checkTime = now;
+	commandIndex.iRunning = 1;
+
+	// The thread must not take any signal, SIGCHLD
+	// in particular has to wake up the shell itself.
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+	if (pthread_create(&commandIndex.thread, NULL, indexCommandsThread, NULL) == 0)
+		commandIndex.iThreadStarted = 1;
+	else
+		commandIndex.iRunning = 0;
+
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+// waitForCommandIndex() function waits for the thread
+// building the command index if it hasn't finished the
+// first time yet, e.g. when Tab is pressed right after
+// the shell started.
+void waitForCommandIndex()
+{
+	int iReady;
+
+	pthread_mutex_lock(&commandIndex.lock);
+	iReady = commandIndex.iReady;
+	pthread_mutex_unlock(&commandIndex.lock);
+
+	if (!iReady && commandIndex.iThreadStarted)
+	{
+		pthread_join(commandIndex.thread, NULL);
+		commandIndex.iThreadStarted = 0;
+	}
+}
+
+// LaunchStrategy enum type is used to select
+// how the shell creates its child processes.
+enum LaunchStrategy
+{
+	Launch_Spawn,		// posix_spawn(), the child shares our memory until it calls exec (default)
+	Launch_VFork,		// vfork(), the same idea done by hand
+	Launch_Fork			// plain fork(), the page tables of the shell are copied for every child
+};
+
+// Strategy used by launchProcess(). It can be changed
+// with the CSHELL_LAUNCHER environment variable, see
+// initLauncher().
+enum LaunchStrategy launchStrategy = Launch_Spawn;
+
+// LaunchSpec structure type describes one child process
+// for launchProcess(): what to run and how its standard
+// input and output should be wired. The redirections of
+// the command are applied after fdin and fdout, so that
+// e.g. the stage of a pipe chain can still redirect its
+// standard error or replace its input with a file.
+typedef struct
+{
+	char *path;						// program to execute, as returned by resolveCommandPath()
+	char **args;					// NULL terminated argument list, args[0] is the command name
+	int fdin;						// descriptor to use as standard input
+	int fdout;						// descriptor to use as standard output
+	int fdclose;					// descriptor the child must not keep open, or -1
+	char *inputFile;				// file to open as standard input instead of fdin, or NULL
+	Redirection *redirections;		// redirections of the command, applied in order, or NULL
+	int *hereFds;					// descriptor with the text of each here-document of "redirections"
+	char **envp;					// environment of the program, NULL for the one of the shell
+	int (*builtin)(char **);		// if set, run this function in a forked child instead of "path"
+	CommandLine *subshell;			// if set, run this whole line in a forked child instead of "path"
+	pid_t pgid;						// process group to put the child in, 0 for a new one, -1 to leave it
+	int iTakeTerminal;				// 1 if the child's process group becomes the foreground one
+} LaunchSpec;
+
+// initLaunchSpec() function fills "spec" so that
+// the command inherits the standard input and
+// output of the shell.
+void initLaunchSpec(LaunchSpec *spec, char *path, char **args)
+{
+	memset(spec, 0, sizeof(LaunchSpec));
+	spec->path = path;
+	spec->args = args;
+	spec->fdin = STDIN_FILENO;
+	spec->fdout = STDOUT_FILENO;
+	spec->fdclose = -1;
+	spec->pgid = -1;
+}
+
+// closeHereDocuments() function closes the descriptors
+// the shell opened for the here-documents of "spec",
+// once the child has its own copies of them.
+void closeHereDocuments(LaunchSpec *spec)
+{
+	Redirection *redirection;
+	int i;
+
+	if (spec->hereFds == NULL)
+		return;
+
+	for (redirection = spec->redirections, i = 0; redirection; redirection = redirection->next, ++i)
+		if (spec->hereFds[i] >= 0)
+			close(spec->hereFds[i]);
+
+	spec->hereFds = NULL;
+}
+
+// initLauncher() function reads the CSHELL_LAUNCHER
+// environment variable ("spawn", "vfork" or "fork")
+// to pick the launch strategy.
+void initLauncher()
+{
+	const char *strategy = getenv("CSHELL_LAUNCHER");
+
+	if (strategy == NULL)
+		return;
+
+	if (strcmp(strategy, "spawn") == 0)
+		launchStrategy = Launch_Spawn;
+	else if (strcmp(strategy, "vfork") == 0)
+		launchStrategy = Launch_VFork;
+	else if (strcmp(strategy, "fork") == 0)
+		launchStrategy = Launch_Fork;
+	else
+		fprintf(stderr, "CSHELL_LAUNCHER: unknown strategy %s, using spawn\n", strategy);
+}
+
+// getShellSignals() function fills "set" with the signals
+// whose handling the shell changes for itself. A command
+// must get the default behaviour for all of them.
+void getShellSignals(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGPIPE);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGQUIT);
+	sigaddset(set, SIGTSTP);
+	sigaddset(set, SIGTTIN);
+	sigaddset(set, SIGTTOU);
+	sigaddset(set, SIGCHLD);
+}
+
+// getOutputFileFlags() returns the open() flags for
+// an output redirection. The iAppend parameter is a
+// flag which should be passed as 0 in case of > or |>
+// operators and as 1 in case of >> or |>> operators.
+int getOutputFileFlags(int iAppend)
+{
+	if (iAppend)
+	{
+		// Append to the file, creating it
+		// first if it doesn't exist yet.
+		return O_CREAT | O_WRONLY | O_APPEND;
+	}
+
+	// File may or may not exist, we will create
+	// new file or overwrite existing one if it
+	// already exists.
+	return O_CREAT | O_WRONLY | O_TRUNC;
+}
+
+// parseDescriptor() function returns the descriptor
+// number written in "text", which the parser has
+// checked to contain only digits. It makes no library
+// calls, so it can be used after vfork().
+int parseDescriptor(const char *text)
+{
+	int fd = 0;
+
+	while (*text != '\0')
+		fd = fd * 10 + (*text++ - '0');
+
+	return fd;
+}
+
+// applyRedirections() function is run in a new child
+// process to apply the redirections of "spec" in the
+// order they were given, so that 2>&1 >file and
+// >file 2>&1 differ like in other shells. A file opened
+// on the wanted descriptor is kept as it is, otherwise
+// it is moved there with one dup2(). It returns NULL on
+// success, or the redirection that failed with errno set.
+Redirection* applyRedirections(LaunchSpec *spec)
+{
+	Redirection *redirection;
+	int i;
+
+	for (redirection = spec->redirections, i = 0; redirection; redirection = redirection->next, ++i)
+	{
+		int fd;
+
+		switch (redirection->type)
+		{
+		case Redirect_Output:
+		case Redirect_Append:
+			fd = open(redirection->target, getOutputFileFlags(redirection->type == Redirect_Append), 0644);
+			break;
+
+		case Redirect_Input:
+			fd = open(redirection->target, O_RDONLY);
+			break;
+
+		case Redirect_Here_Doc:
+		case Redirect_Here_String:
+			if (dup2(spec->hereFds[i], redirection->fd) < 0)
+				return redirection;
+			continue;
+
+		case Redirect_Duplicate:
+			if (dup2(parseDescriptor(redirection->target), redirection->fd) < 0)
+				return redirection;
+			continue;
+
+		case Redirect_Close:
+			close(redirection->fd);
+			continue;
+
+		default:
+			// |> and |>> are done by the shell
+			continue;
+		}
+
+		if (fd < 0)
+			return redirection;
+
+		if (fd != redirection->fd)
+		{
+			dup2(fd, redirection->fd);
+			close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+// setupChildDescriptors() function is run in a new child
+// process (after fork() or vfork()) to put it in its
+// process group and wire its standard input and output
+// as described by "spec". It only makes system calls,
+// which is all that is allowed after vfork(). It returns
+// 0 on success, or -1 with errno set and "pName" set to
+// the file or descriptor that could not be used.
+int setupChildDescriptors(LaunchSpec *spec, const char **pName)
+{
+	Redirection *failed;
+	sigset_t signals;
+	int iSignal;
+
+	*pName = spec->args[0];
+
+	if (spec->pgid >= 0)
+	{
+		setpgid(0, spec->pgid);
+
+		// The shell ignores SIGTTOU, so this works
+		// before the signals are reset below.
+		if (spec->iTakeTerminal)
+			tcsetpgrp(STDIN_FILENO, getpgrp());
+	}
+
+	// The command starts with the default handling
+	// of every signal and with none of them blocked.
+	getShellSignals(&signals);
+
+	for (iSignal = 1; iSignal < NSIG; ++iSignal)
+		if (sigismember(&signals, iSignal) == 1)
+			signal(iSignal, SIG_DFL);
+
+	sigemptyset(&signals);
+	sigprocmask(SIG_SETMASK, &signals, NULL);
+
+	if (spec->fdclose >= 0)
+		close(spec->fdclose);
+
+	if (spec->inputFile != NULL)
+	{
+		int fd = open(spec->inputFile, O_RDONLY);
+
+		if (fd < 0)
+		{
+			*pName = spec->inputFile;
+			return -1;
+		}
+
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+	}
+	else if (spec->fdin != STDIN_FILENO)
+	{
+		dup2(spec->fdin, STDIN_FILENO);
+		close(spec->fdin);
+	}
+
+	if (spec->fdout != STDOUT_FILENO)
+	{
+		dup2(spec->fdout, STDOUT_FILENO);
+		close(spec->fdout);
+	}
+
+	failed = applyRedirections(spec);
+
+	if (failed != NULL)
+	{
+		*pName = failed->target;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Program that runs an executable file without a #! line,
+// which the kernel can't run itself, as execvp() does
+#define SCRIPT_SHELL "/bin/sh"
+
+// countArgs() function returns the number of
+// entries of the NULL terminated array "args".
+int countArgs(char **args)
+{
+	int iCount = 0;
+
+	while (args[iCount] != NULL)
+		iCount++;
+
+	return iCount;
+}
+
+// getScriptArgs() function fills "shellArgs", which has room
+// for two more entries than "args", with the arguments that
+// run the script "path" with SCRIPT_SHELL: the shell, the
+// script and the arguments after the command name. It only
+// writes to memory, so it may run in the child of vfork().
+void getScriptArgs(char **shellArgs, const char *path, char **args)
+{
+	int i;
+
+	shellArgs[0] = SCRIPT_SHELL;
+	shellArgs[1] = (char *) path;
+
+	for (i = 1; args[i] != NULL; ++i)
+		shellArgs[i + 1] = args[i];
+
+	shellArgs[i + 1] = NULL;
+}
+
+// launchWithSpawn() function starts the process described
+// by "spec" with posix_spawn(). All the descriptor wiring
+// is expressed as spawn file actions, so the C library can
+// create the child without copying the page tables of the
+// shell. A file the kernel can't run is spawned again with
+// SCRIPT_SHELL. It returns the PID, or -1 on error.
+pid_t launchWithSpawn(LaunchSpec *spec)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	Redirection *redirection;
+	sigset_t sigDefault;
+	sigset_t sigMask;
+	pid_t pid;
+	int iError;
+	int i;
+
+	posix_spawn_file_actions_init(&actions);
+
+	if (spec->fdclose >= 0)
+		posix_spawn_file_actions_addclose(&actions, spec->fdclose);
+
+	if (spec->inputFile != NULL)
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, spec->inputFile, O_RDONLY, 0);
+	else if (spec->fdin != STDIN_FILENO)
+	{
+		posix_spawn_file_actions_adddup2(&actions, spec->fdin, STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&actions, spec->fdin);
+	}
+
+	if (spec->fdout != STDOUT_FILENO)
+	{
+		posix_spawn_file_actions_adddup2(&actions, spec->fdout, STDOUT_FILENO);
+		posix_spawn_file_actions_addclose(&actions, spec->fdout);
+	}
+
+	// The same steps as applyRedirections(), as file actions
+	for (redirection = spec->redirections, i = 0; redirection; redirection = redirection->next, ++i)
+	{
+		switch (redirection->type)
+		{
+		case Redirect_Output:
+		case Redirect_Append:
+			posix_spawn_file_actions_addopen(&actions, redirection->fd, redirection->target,
+											 getOutputFileFlags(redirection->type == Redirect_Append), 0644);
+			break;
+
+		case Redirect_Input:
+			posix_spawn_file_actions_addopen(&actions, redirection->fd, redirection->target, O_RDONLY, 0);
+			break;
+
+		case Redirect_Here_Doc:
+		case Redirect_Here_String:
+			posix_spawn_file_actions_adddup2(&actions, spec->hereFds[i], redirection->fd);
+			break;
+
+		case Redirect_Duplicate:
+			posix_spawn_file_actions_adddup2(&actions, parseDescriptor(redirection->target), redirection->fd);
+			break;
+
+		case Redirect_Close:
+			posix_spawn_file_actions_addclose(&actions, redirection->fd);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	// The command starts with the default handling of
+	// every signal, with none of them blocked and in the
+	// process group of its job. The terminal is handed to
+	// the group by the shell, see launchInJob().
+	posix_spawnattr_init(&attr);
+	getShellSignals(&sigDefault);
+	posix_spawnattr_setsigdefault(&attr, &sigDefault);
+	sigemptyset(&sigMask);
+	posix_spawnattr_setsigmask(&attr, &sigMask);
+
+	if (spec->pgid >= 0)
+	{
+		posix_spawnattr_setpgroup(&attr, spec->pgid);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+	}
+	else
+	{
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+	}
+
+	iError = posix_spawn(&pid, spec->path, &actions, &attr, spec->args,
+						 spec->envp ? spec->envp : getEnvironment());
+
+	if (iError == ENOEXEC)
+	{
+		char **shellArgs = arenaAlloc(&commandArena, (countArgs(spec->args) + 2) * sizeof(char *));
+
+		getScriptArgs(shellArgs, spec->path, spec->args);
+		iError = posix_spawn(&pid, SCRIPT_SHELL, &actions, &attr, shellArgs,
+							 spec->envp ? spec->envp : getEnvironment());
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (iError != 0)
+	{
+		// The program itself was found before, so an error
+		// here most likely comes from a redirection. The file
+		// actions don't tell which one, unless there is one.
+		const char *name = spec->inputFile;
+		int iCandidates = (name != NULL);
+
+		for (redirection = spec->redirections; redirection; redirection = redirection->next)
+		{
+			if ((redirection->type == Redirect_Output) || (redirection->type == Redirect_Append) ||
+				(redirection->type == Redirect_Input) || (redirection->type == Redirect_Duplicate))
+			{
+				name = redirection->target;
+				iCandidates++;
+			}
+		}
+
+		if (iCandidates == 1)
+			fprintf(stderr, "%s: %s: %s\n", spec->args[0], name, strerror(iError));
+		else
+			fprintf(stderr, "%s: %s\n", spec->args[0], strerror(iError));
+		return -1;
+	}
+
+	return pid;
+}
+
+void runSubshell(CommandLine *cmdLine);	// forward declaration
+void initChildJobs();						// forward declaration
+
+// launchProcess() function starts the child process described
+// by "spec" and returns its PID without waiting for it, or -1
+// if it could not be started. This is the only place where the
+// shell creates child processes, all the execute*() functions
+// go through it. The process is created with the strategy in
+// "launchStrategy". A builtin that has to run in a subshell
+// (e.g. as one stage of a pipeline) always uses fork(), since
+// it keeps running the shell's own code in the child.
+pid_t launchProcess(LaunchSpec *spec)
+{
+	char **envp;
+	pid_t pid;
+
+	// What the shell has printed so far must come out
+	// before the output of the child. When the output is
+	// not a terminal, e.g. in a script, stdout is fully
+	// buffered and would otherwise be written much later.
+	fflush(stdout);
+
+	if ((spec->builtin == NULL) && (spec->subshell == NULL) && (launchStrategy == Launch_Spawn))
+		return launchWithSpawn(spec);
+
+	// The child of vfork() must not allocate memory
+	envp = spec->envp ? spec->envp : getEnvironment();
+
+	if ((spec->builtin == NULL) && (spec->subshell == NULL) && (launchStrategy == Launch_VFork))
+		pid = vfork();
+	else
+		pid = fork();
+
+	if (pid < 0)
+	{
+		perror("Error creating child process: ");
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		const char *name;
+
+		if (setupChildDescriptors(spec, &name) < 0)
+		{
+			perror(name);
+			_exit(1);
+		}
+
+		if (spec->builtin != NULL)
+		{
+			int iStatus;
+
+			// A builtin like "pexec" or "wait" needs to
+			// reap the children it starts by itself.
+			initChildJobs();
+			iStatus = spec->builtin(spec->args);
+			fflush(stdout);
+			_exit(iStatus);
+		}
+
+		if (spec->subshell != NULL)
+			runSubshell(spec->subshell);
+
+		// Only a child made by fork() may do more than
+		// system calls. After vfork() the shell records
+		// the exec itself, see traceLaunch().
+		if ((fdTrace >= 0) && (launchStrategy == Launch_Fork))
+		{
+			TraceArgs args;
+			double now = getMonotonicTime();
+
+			initTraceArgs(&args);
+			addTraceString(&args, "path", spec->path);
+			traceEvent("exec", now, now, getpid(), &args);
+		}
+
+		execve(spec->path, spec->args, envp);
+
+		if (errno == ENOEXEC)
+		{
+			// Not on the heap, the child of vfork() must
+			// not allocate memory
+			char *shellArgs[countArgs(spec->args) + 2];
+
+			getScriptArgs(shellArgs, spec->path, spec->args);
+			execve(SCRIPT_SHELL, shellArgs, envp);
+			errno = ENOEXEC;
+		}
+
+		// We only get here if execve() failed. Don't fall
+		// back into the shell loop inside the child.
+		perror(spec->args[0]);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+// ProcessState enum type is used to indicate
+// what is known about one process of a job.
+enum ProcessState
+{
+	Process_Running,		// started, or continued after a stop
+	Process_Stopped,		// stopped, e.g. with Ctrl-Z
+	Process_Done			// exited or killed, "status" tells how
+};
+
+// JobProcess structure type is used to contain
+// one process of a job and what happened to it.
+typedef struct
+{
+	pid_t pid;						// PID, or -1 if the command could not be started
+	int status;						// status from waitpid() once it has stopped or exited
+	volatile sig_atomic_t iState;	// enum ProcessState, updated by handleChildSignal()
+	double startTime;				// when it was started, see getMonotonicTime()
+	double endTime;					// when it was reaped
+	struct rusage usage;			// resources it used, from wait4() once it is done
+} JobProcess;
+
+// Job structure type is used to contain one command line
+// that is running, i.e. all the processes started for it,
+// which make up one process group.
+typedef struct
+{
+	int iId;						// job number shown to the user, [1], [2], ...
+	pid_t pgid;						// process group of the job, 0 until its first process is started
+	int iNumProcs;					// number of entries used in procs
+	int iMaxProcs;					// size of procs, one per command of the line
+	JobProcess *procs;				// the processes in the order of the commands
+	char *command;					// text of the command line, for "jobs"
+	int iBackground;				// 1 if the shell is not waiting for the job
+	int iTimed;						// 1 if its resource usage is reported when it is done
+} Job;
+
+// JobTable structure type holds all the jobs of the shell.
+// It is only changed while SIGCHLD is blocked, so that the
+// signal handler always sees it in a consistent state.
+typedef struct
+{
+	Job **jobs;						// the jobs, in the order they were started
+	int iCount;						// number of jobs
+	int iAllocated;					// allocated size of jobs
+} JobTable;
+
+// The jobs of this shell session
+JobTable jobTable;
+
+// 1 if the resource usage of every command is reported,
+// not only of those run with "time" (see executeTime())
+int iTimeAll = 0;
+
+// When the shell was started, see getMonotonicTime()
+double shellStartTime;
+
+// 1 if the shell is interactive and puts every job in
+// a process group of its own, handing the terminal to
+// the job in the foreground
+int iJobControl = 0;
+
+// Process group of the shell itself
+pid_t shellPgid;
+
+// Signal mask of the shell with SIGCHLD not blocked,
+// used while waiting for a job
+sigset_t waitMask;
+
+void executeCommandLine(CommandLine *cmdLine);	// forward declaration
+void printPipelineStatus(SimpleCommand *commands, JobProcess *procs, int iNumCommands);	// forward declaration
+
+// handleChildSignal() function is the SIGCHLD handler.
+// It reaps every child that has exited, stopped or been
+// continued without blocking, and records the new state
+// in the job table, with the resources a finished child
+// used. It does nothing else, the rest of the shell
+// looks at the job table when it suits it.
+void handleChildSignal(int iSignal)
+{
+	int iSavedErrno = errno;
+	struct rusage usage;
+	int status;
+	pid_t pid;
+
+	while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+	{
+		int i, j;
+
+		for (i = 0; i < jobTable.iCount; ++i)
+		{
+			Job *job = jobTable.jobs[i];
+
+			for (j = 0; j < job->iNumProcs; ++j)
+			{
+				if (job->procs[j].pid != pid)
+					continue;
+
+				if (WIFSTOPPED(status))
+					job->procs[j].iState = Process_Stopped;
+				else if (WIFCONTINUED(status))
+					job->procs[j].iState = Process_Running;
+				else
+				{
+					job->procs[j].status = status;
+					job->procs[j].usage = usage;
+					job->procs[j].endTime = getMonotonicTime();
+					job->procs[j].iState = Process_Done;
+				}
+			}
+		}
+	}
+
+	errno = iSavedErrno;
+}
+
+// blockChildSignal() function keeps SIGCHLD from being
+// delivered, so that the job table can be changed.
+void blockChildSignal()
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+}
+
+// unblockChildSignal() function lets SIGCHLD be
+// delivered again, running the handler if needed.
+void unblockChildSignal()
+{
+	sigprocmask(SIG_SETMASK, &waitMask, NULL);
+}
+
+// initJobs() function installs the SIGCHLD handler, and
+// ignores SIGPIPE, so that the shell isn't killed when the
+// reader of its output goes away while it still prints the
+// status of a command. The commands get the default back,
+// see getShellSignals(). If "iInteractive" is set and the
+// shell is on a terminal, it also turns on job control:
+// the shell waits until it is in the foreground, puts
+// itself in a process group of its own and ignores the
+// job control signals, which only its jobs should get.
+void initJobs(int iInteractive)
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handleChildSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGCHLD, &action, NULL);
+
+	sigprocmask(SIG_SETMASK, NULL, &waitMask);
+	sigdelset(&waitMask, SIGCHLD);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!iInteractive || !isatty(STDIN_FILENO))
+		return;
+
+	while (tcgetpgrp(STDIN_FILENO) != (shellPgid = getpgrp()))
+		kill(-shellPgid, SIGTTIN);
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+
+	// This fails if the shell already leads its
+	// session, in which case its group is fine.
+	setpgid(0, 0);
+	shellPgid = getpgrp();
+	tcsetpgrp(STDIN_FILENO, shellPgid);
+
+	iJobControl = 1;
+}
+
+// initChildJobs() function is run in a forked child of
+// the shell that keeps running shell code. The jobs of
+// the parent are not its children, so it starts with an
+// empty job table, without job control, and with the
+// SIGCHLD handler that the launch reset to the default.
+void initChildJobs()
+{
+	jobTable.iCount = 0;
+	iJobControl = 0;
+	initJobs(0);
+}
+
+// runSubshell() function is run in a child of the shell
+// to execute the command line "cmdLine" in its foreground
+// and exit with its status. The child shell starts with
+// no jobs of its own and without job control.
+void runSubshell(CommandLine *cmdLine)
+{
+	CommandLine line = *cmdLine;
+
+	line.iBackground = 0;
+	line.iTimed = 0;
+	initChildJobs();
+
+	executeCommandLine(&line);
+	fflush(stdout);
+	_exit(iLastStatus);
+}
+
+// formatJobCommand() function returns the text of the
+// command line "cmdLine", rebuilt from its parsed form.
+char* formatJobCommand(CommandLine *cmdLine)
+{
+	static const char *operators[] = { ">", ">>", "|>", "|>>", "<", "<<", "<<<" };
+	size_t iLength = 1;
+	char *text;
+	int i, j;
+
+	for (i = 0; i < cmdLine->iNumCommands; ++i)
+	{
+		SimpleCommand *command = &cmdLine->commands[i];
+		Redirection *redirection;
+
+		for (j = 0; j < command->iNumArgs; ++j)
+			iLength += strlen(command->args[j]) + 1;
+
+		for (j = 0; j < command->iNumAssignments; ++j)
+			iLength += strlen(command->assignments[j]) + 1;
+
+		for (redirection = command->redirections; redirection; redirection = redirection->next)
+			iLength += strlen(redirection->target) + 16;
+
+		iLength += 4;
+	}
+
+	text = malloc(iLength);
+	text[0] = '\0';
+
+	for (i = 0; i < cmdLine->iNumCommands; ++i)
+	{
+		SimpleCommand *command = &cmdLine->commands[i];
+		Redirection *redirection;
+
+		if (i > 0)
+			strcat(text, (cmdLine->type != Fan_Out) ? " | " : (i == 1) ? " || " : ", ");
+
+		for (j = 0; j < command->iNumAssignments; ++j)
+		{
+			strcat(text, command->assignments[j]);
+			strcat(text, " ");
+		}
+
+		for (j = 0; j < command->iNumArgs; ++j)
+		{
+			if (j > 0)
+				strcat(text, " ");
+			strcat(text, command->args[j]);
+		}
+
+		for (redirection = command->redirections; redirection; redirection = redirection->next)
+		{
+			enum RedirectionType type = redirection->type;
+			int iInput = (type == Redirect_Input) || (type == Redirect_Here_Doc) || (type == Redirect_Here_String);
+
+			// The descriptor is only shown when it isn't
+			// the one the operator redirects anyway
+			if (redirection->fd != (iInput ? STDIN_FILENO : STDOUT_FILENO))
+				sprintf(text + strlen(text), " %d", redirection->fd);
+			else
+				strcat(text, " ");
+
+			if ((type == Redirect_Duplicate) || (type == Redirect_Close))
+			{
+				strcat(text, (redirection->fd == STDIN_FILENO) ? "<&" : ">&");
+				strcat(text, redirection->target);
+				continue;
+			}
+
+			strcat(text, operators[type]);
+			strcat(text, " ");
+
+			// A here-document is too long for one line
+			strcat(text, (type == Redirect_Here_Doc) ? "..." : redirection->target);
+		}
+	}
+
+	return text;
+}
+
+// addJob() function adds a new job with room for "iMaxProcs"
+// processes to the job table and returns it. "command" is
+// the text shown by "jobs" and now belongs to the job.
+// SIGCHLD stays blocked from here until the job has been
+// waited for, so that no process of the job can be reaped
+// before it has been recorded.
+Job* addJob(char *command, int iMaxProcs, int iBackground)
+{
+	Job *job = malloc(sizeof(Job));
+	int iId = 1;
+	int i;
+
+	blockChildSignal();
+
+	// The new job gets the next number after
+	// the highest one in use
+	for (i = 0; i < jobTable.iCount; ++i)
+		if (jobTable.jobs[i]->iId >= iId)
+			iId = jobTable.jobs[i]->iId + 1;
+
+	job->iId = iId;
+	job->pgid = 0;
+	job->iNumProcs = 0;
+	job->iMaxProcs = iMaxProcs;
+	job->procs = malloc(job->iMaxProcs * sizeof(JobProcess));
+	job->command = command;
+	job->iBackground = iBackground;
+	job->iTimed = 0;
+
+	if (jobTable.iCount == jobTable.iAllocated)
+	{
+		jobTable.iAllocated = jobTable.iAllocated ? jobTable.iAllocated * 2 : 16;
+		jobTable.jobs = realloc(jobTable.jobs, jobTable.iAllocated * sizeof(Job *));
+	}
+
+	jobTable.jobs[jobTable.iCount++] = job;
+
+	return job;
+}
+
+// createJob() function adds a new job for the command line
+// "cmdLine" to the job table and returns it. SIGCHLD stays
+// blocked until completeJob() is done with the job.
+Job* createJob(CommandLine *cmdLine)
+{
+	Job *job = addJob(formatJobCommand(cmdLine), cmdLine->iNumCommands, cmdLine->iBackground);
+
+	job->iTimed = cmdLine->iTimed || iTimeAll;
+	return job;
+}
+
+// traceJobProcesses() function records every finished
+// process of "job" on a track of its own, from its start
+// until it was reaped, with its exit status and the
+// resources it used.
+void traceJobProcesses(Job *job)
+{
+	int i;
+
+	for (i = 0; i < job->iNumProcs; ++i)
+	{
+		JobProcess *process = &job->procs[i];
+		TraceArgs args;
+
+		if ((process->pid < 0) || (process->iState != Process_Done))
+			continue;
+
+		initTraceArgs(&args);
+		addTraceNumber(&args, "job", job->iId);
+		addTraceNumber(&args, "stage", i);
+		addTraceString(&args, "line", job->command);
+		addTraceNumber(&args, "status", getExitStatus(process->status));
+		addTraceNumber(&args, "user_ms", process->usage.ru_utime.tv_sec * 1e3 + process->usage.ru_utime.tv_usec / 1e3);
+		addTraceNumber(&args, "sys_ms", process->usage.ru_stime.tv_sec * 1e3 + process->usage.ru_stime.tv_usec / 1e3);
+		addTraceNumber(&args, "max_rss_kb", process->usage.ru_maxrss);
+		traceEvent("process", process->startTime, process->endTime, process->pid, &args);
+	}
+}
+
+// removeJob() function takes a job out of the job
+// table and frees it. SIGCHLD must be blocked.
+void removeJob(Job *job)
+{
+	int i;
+
+	if (fdTrace >= 0)
+		traceJobProcesses(job);
+
+	for (i = 0; i < jobTable.iCount; ++i)
+	{
+		if (jobTable.jobs[i] == job)
+		{
+			memmove(&jobTable.jobs[i], &jobTable.jobs[i + 1], (jobTable.iCount - i - 1) * sizeof(Job *));
+			jobTable.iCount--;
+			break;
+		}
+	}
+
+	free(job->procs);
+	free(job->command);
+	free(job);
+}
+
+// addProcessToJob() function records a process started
+// for "job", or -1 for a command that could not be
+// started, so that the processes stay in command order.
+// A job that isn't a command line, like the one of "pexec",
+// can grow past the size it was created with.
+void addProcessToJob(Job *job, pid_t pid)
+{
+	JobProcess *process;
+
+	if (job->iNumProcs == job->iMaxProcs)
+	{
+		job->iMaxProcs *= 2;
+		job->procs = realloc(job->procs, job->iMaxProcs * sizeof(JobProcess));
+	}
+
+	process = &job->procs[job->iNumProcs++];
+
+	process->pid = pid;
+	process->status = (pid > 0) ? 0 : W_EXITCODE(127, 0);
+	process->startTime = getMonotonicTime();
+	process->endTime = process->startTime;
+	memset(&process->usage, 0, sizeof(struct rusage));
+	process->iState = (pid > 0) ? Process_Running : Process_Done;
+}
+
+// traceLaunch() function records the start of the process
+// "pid" for "job", from "startTime" until launchProcess()
+// returned, which is the cost of fork() or posix_spawn().
+// With posix_spawn() and vfork() the shell only resumes
+// once the child has called exec, so this is also when
+// the program was executed.
+void traceLaunch(Job *job, LaunchSpec *spec, pid_t pid, double startTime)
+{
+	static const char *strategies[] = { "spawn", "vfork", "fork" };
+	double endTime = getMonotonicTime();
+	TraceArgs args;
+
+	initTraceArgs(&args);
+	addTraceString(&args, "command", spec->args[0]);
+	addTraceNumber(&args, "pid", pid);
+	addTraceNumber(&args, "job", job->iId);
+	addTraceNumber(&args, "stage", job->iNumProcs);
+	addTraceString(&args, "line", job->command);
+	addTraceString(&args, "launcher", (spec->builtin || spec->subshell) ? "fork" : strategies[launchStrategy]);
+	traceEvent("launch", startTime, endTime, getpid(), &args);
+
+	if ((pid > 0) && !spec->builtin && !spec->subshell && (launchStrategy != Launch_Fork))
+	{
+		initTraceArgs(&args);
+		addTraceString(&args, "path", spec->path);
+		traceEvent("exec", endTime, endTime, pid, &args);
+	}
+}
+
+// launchInJob() function starts the process described by
+// "spec" as part of "job" and records it. With job control
+// the first process starts the process group of the job,
+// and a job in the foreground gets the terminal at once.
+// It returns the PID, or -1 if the process didn't start.
+pid_t launchInJob(Job *job, LaunchSpec *spec)
+{
+	double startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+	pid_t pid;
+
+	if (iJobControl)
+	{
+		spec->pgid = job->pgid;
+		spec->iTakeTerminal = !job->iBackground;
+	}
+
+	pid = launchProcess(spec);
+	closeHereDocuments(spec);
+
+	if ((pid > 0) && iJobControl)
+	{
+		// The child does the same. Whichever runs first,
+		// the group exists before it is used.
+		if (job->pgid == 0)
+			job->pgid = pid;
+
+		setpgid(pid, job->pgid);
+
+		if (!job->iBackground)
+			tcsetpgrp(STDIN_FILENO, job->pgid);
+	}
+	else if ((pid > 0) && (job->pgid == 0))
+	{
+		job->pgid = pid;
+	}
+
+	if (fdTrace >= 0)
+		traceLaunch(job, spec, pid, startTime);
+
+	addProcessToJob(job, pid);
+
+	return pid;
+}
+
+// abortJobLaunch() function is called when the shell can't
+// set up all the "iNumCommands" processes of "job", e.g. when
+// it runs out of descriptors for the pipes between them. The
+// processes already started are killed, the rest are recorded
+// as not started, and the line fails with status 1 once the
+// job has been reaped. SIGCHLD must be blocked.
+void abortJobLaunch(Job *job, int iNumCommands)
+{
+	int i;
+
+	for (i = 0; i < job->iNumProcs; ++i)
+		if ((job->procs[i].pid > 0) && (job->procs[i].iState != Process_Done))
+			kill(job->procs[i].pid, SIGKILL);
+
+	while (job->iNumProcs < iNumCommands)
+		addProcessToJob(job, -1);
+
+	job->procs[job->iNumProcs - 1].status = W_EXITCODE(1, 0);
+}
+
+// getJobState() function returns the state of a whole
+// job: done when all its processes are done, stopped
+// when the others are stopped, and running otherwise.
+enum ProcessState getJobState(Job *job)
+{
+	int iStopped = 0;
+	int i;
+
+	for (i = 0; i < job->iNumProcs; ++i)
+	{
+		if (job->procs[i].iState == Process_Running)
+			return Process_Running;
+
+		if (job->procs[i].iState == Process_Stopped)
+			iStopped = 1;
+	}
+
+	return iStopped ? Process_Stopped : Process_Done;
+}
+
+// getJobExitStatus() function returns the exit status of
+// a finished job, which is the one of its last command.
+int getJobExitStatus(Job *job)
+{
+	if (job->iNumProcs == 0)
+		return 127;
+
+	return getExitStatus(job->procs[job->iNumProcs - 1].status);
+}
+
+// describeJobState() function returns the word used by
+// "jobs" and the job notifications for the job's state.
+const char* describeJobState(Job *job, char *buffer)
+{
+	enum ProcessState state = getJobState(job);
+	int status = job->iNumProcs ? job->procs[job->iNumProcs - 1].status : 0;
+
+	if (state == Process_Running)
+		return "Running";
+
+	if (state == Process_Stopped)
+		return "Stopped";
+
+	if ((job->iNumProcs > 0) && WIFSIGNALED(status))
+		return strsignal(WTERMSIG(status));
+
+	if (getJobExitStatus(job) != 0)
+	{
+		sprintf(buffer, "Exit %d", getJobExitStatus(job));
+		return buffer;
+	}
+
+	return "Done";
+}
+
+// printJob() function prints one line about a job,
+// the way "jobs" shows it.
+void printJob(Job *job)
+{
+	char buffer[32];
+	int iCurrent = (jobTable.iCount > 0) && (jobTable.jobs[jobTable.iCount - 1] == job);
+
+	printf("[%d]%c  %-24s%s\n", job->iId, iCurrent ? '+' : ' ',
+		   describeJobState(job, buffer), job->command);
+}
+
+// waitForJob() function waits until every process of "job"
+// has exited, or until the job is stopped. SIGCHLD must be
+// blocked; it is only let through while sleeping, so no
+// state change can be missed. A job in the foreground has
+// the terminal while it runs, and the shell takes it back
+// after. It returns 1 if the job is done and 0 if it has
+// been stopped, in which case it stays in the job table
+// as a background job.
+int waitForJob(Job *job)
+{
+	double startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+
+	if (iJobControl && !job->iBackground && (job->pgid > 0))
+		tcsetpgrp(STDIN_FILENO, job->pgid);
+
+	while (getJobState(job) == Process_Running)
+		sigsuspend(&waitMask);
+
+	if (iJobControl && !job->iBackground)
+		tcsetpgrp(STDIN_FILENO, shellPgid);
+
+	if (fdTrace >= 0)
+	{
+		TraceArgs args;
+
+		initTraceArgs(&args);
+		addTraceNumber(&args, "job", job->iId);
+		addTraceString(&args, "line", job->command);
+		traceEvent("wait", startTime, getMonotonicTime(), getpid(), &args);
+	}
+
+	if (getJobState(job) == Process_Stopped)
+	{
+		job->iBackground = 1;
+		printf("\n");
+		printJob(job);
+		return 0;
+	}
+
+	return 1;
+}
+
+// printResourceUsage() function prints one line of the
+// report of "time" for the process or job "name": the
+// wall-clock time "real" and the resources in "usage".
+void printResourceUsage(const char *name, double real, struct rusage *usage)
+{
+	// The report goes after anything printed before
+	fflush(stdout);
+
+	fprintf(stderr, "time: %s: real %.3f s, user %.3f s, sys %.3f s, max RSS %ld KB, "
+			"context switches %ld voluntary / %ld involuntary\n", name, real,
+			usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+			usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+			usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+// reportJobUsage() function prints the resources used by
+// every process of the finished "job", as collected by
+// handleChildSignal(). A job of several processes gets a
+// total line too: the CPU times and context switches add
+// up, max RSS is the largest of them, and the wall-clock
+// time goes from the first start to the last exit. This
+// shows which stage of a pipe chain is the slow one. The
+// processes are named after "commands", if it is given.
+void reportJobUsage(Job *job, SimpleCommand *commands)
+{
+	struct rusage total;
+	double startTime = 0;
+	double endTime = 0;
+	char name[128];
+	int iNumReported = 0;
+	int i;
+
+	memset(&total, 0, sizeof(struct rusage));
+
+	for (i = 0; i < job->iNumProcs; ++i)
+	{
+		JobProcess *process = &job->procs[i];
+
+		if (process->pid < 0)
+			continue;
+
+		if (commands != NULL)
+			snprintf(name, sizeof(name), "%s (PID %d)", commands[i].args[0], process->pid);
+		else
+			snprintf(name, sizeof(name), "PID %d", process->pid);
+
+		printResourceUsage(name, process->endTime - process->startTime, &process->usage);
+
+		timeradd(&total.ru_utime, &process->usage.ru_utime, &total.ru_utime);
+		timeradd(&total.ru_stime, &process->usage.ru_stime, &total.ru_stime);
+		total.ru_nvcsw += process->usage.ru_nvcsw;
+		total.ru_nivcsw += process->usage.ru_nivcsw;
+
+		if (process->usage.ru_maxrss > total.ru_maxrss)
+			total.ru_maxrss = process->usage.ru_maxrss;
+
+		if ((iNumReported == 0) || (process->startTime < startTime))
+			startTime = process->startTime;
+
+		if ((iNumReported == 0) || (process->endTime > endTime))
+			endTime = process->endTime;
+
+		iNumReported++;
+	}
+
+	if (iNumReported > 1)
+		printResourceUsage("total", endTime - startTime, &total);
+}
+
+// completeJob() function is called once all the processes
+// of the command line "cmdLine" have been started as "job".
+// A background job is announced with its number and the
+// PID of its last process, and left running. Otherwise the
+// shell waits for the job and prints the PID and status of
+// every process, like it always did. The exit status of
+// the job becomes the status of the last command.
+void completeJob(Job *job, CommandLine *cmdLine)
+{
+	if (job->iBackground)
+	{
+		if (job->iNumProcs > 0)
+			printf("[%d] %d\n", job->iId, job->procs[job->iNumProcs - 1].pid);
+
+		fflush(stdout);
+
+		iLastStatus = 0;
+		unblockChildSignal();
+		return;
+	}
+
+	if (waitForJob(job))
+	{
+		if (job->iNumProcs > 0)
+		{
+			// Print the PID and the status of the command
+			// (child process) just completed, or of every
+			// stage of a chain.
+			if (cmdLine->iNumCommands == 1)
+			{
+				if (job->procs[0].pid > 0)
+					printExecutionStatus(job->procs[0].pid, job->procs[0].status);
+			}
+			else
+			{
+				printPipelineStatus(cmdLine->commands, job->procs, job->iNumProcs);
+			}
+
+			if (job->iTimed)
+				reportJobUsage(job, cmdLine->commands);
+
+			iLastStatus = getJobExitStatus(job);
+		}
+
+		removeJob(job);
+	}
+	else
+	{
+		iLastStatus = 128 + SIGTSTP;
+	}
+
+	unblockChildSignal();
+}
+
+// reportJobChanges() function prints a line for every
+// background job that has finished since the last time,
+// and removes it from the job table. It is called before
+// the prompt is shown.
+void reportJobChanges()
+{
+	int i;
+
+	blockChildSignal();
+
+	for (i = 0; i < jobTable.iCount; ++i)
+	{
+		Job *job = jobTable.jobs[i];
+
+		if (job->iBackground && (getJobState(job) == Process_Done))
+		{
+			printJob(job);
+
+			if (job->iTimed)
+				reportJobUsage(job, NULL);
+
+			removeJob(job);
+			i--;
+		}
+	}
+
+	unblockChildSignal();
+}
+
+// Builtin structure type is used as one entry of the
+// table of builtin commands. The function gets the
+// arguments of the command and returns its exit status.
+typedef struct
+{
+	const char *name;				// name of the command, e.g. "cd"
+	int (*function)(char **);		// function implementing it
+} Builtin;
+
+int executeCommandHistory(char **args);	// forward declaration
+int executeCmdCache(char **args);		// forward declaration
+char* readWholeFile(int fd);			// forward declaration
+
+// Current directory of the shell, as shown in the prompt
+// and by "pwd", or NULL until it is first needed.
+char *currentDirectory = NULL;
+
+// setCurrentDirectory() function makes "directory", which
+// was allocated with malloc(), the cached current directory
+// of the shell, and puts it into PWD as well.
+void setCurrentDirectory(char *directory)
+{
+	free(currentDirectory);
+	currentDirectory = directory;
+	setVariable("PWD", 3, directory, 1);
+}
+
+// getCurrentDirectory() function returns the current directory
+// of the shell. The cached one is used as long as PWD still
+// holds it, so showing a prompt normally costs no system call.
+// Only the shell itself changes its directory, with "cd", which
+// updates the cache. When PWD has been changed by hand, it is
+// used if it names the current directory, otherwise getcwd()
+// is asked, with a buffer of whatever size the path needs. It
+// returns "" if the directory can't be found, e.g. after it
+// has been removed.
+const char* getCurrentDirectory()
+{
+	const char *pwd = getVariable("PWD");
+	struct stat stPwd, stDot;
+	char *directory;
+
+	if ((currentDirectory != NULL) && (pwd != NULL) && (strcmp(pwd, currentDirectory) == 0))
+		return currentDirectory;
+
+	if ((pwd != NULL) && (pwd[0] == '/') && (stat(pwd, &stPwd) == 0) && (stat(".", &stDot) == 0) &&
+		(stPwd.st_dev == stDot.st_dev) && (stPwd.st_ino == stDot.st_ino))
+		directory = strdup(pwd);
+	else
+		directory = getcwd(NULL, 0);
+
+	if (directory == NULL)
+		return "";
+
+	setCurrentDirectory(directory);
+
+	return currentDirectory;
+}
+
+// executeCd() function implements the "cd" builtin. It
+// changes the directory of the shell itself, to HOME if
+// no directory is given, or back to OLDPWD with "cd -".
+int executeCd(char **args)
+{
+	char *oldDirectory;
+	char *directory;
+	const char *target = args[1];
+
+	if (target == NULL)
+	{
+		target = getVariable("HOME");
+
+		if (target == NULL)
+		{
+			fprintf(stderr, "cd: HOME not set\n");
+			return 1;
+		}
+	}
+	else if (strcmp(target, "-") == 0)
+	{
+		target = getVariable("OLDPWD");
+
+		if (target == NULL)
+		{
+			fprintf(stderr, "cd: OLDPWD not set\n");
+			return 1;
+		}
+
+		printf("%s\n", target);
+	}
+
+	// The cached directory is replaced below, keep a copy
+	oldDirectory = strdup(getCurrentDirectory());
+
+	if (chdir(target) < 0)
+	{
+		fprintf(stderr, "cd: %s: %s\n", target, strerror(errno));
+		free(oldDirectory);
+		return 1;
+	}
+
+	setVariable("OLDPWD", 6, oldDirectory, 1);
+	free(oldDirectory);
+
+	// This is the only time the shell asks the
+	// system for its directory, see getCurrentDirectory()
+	directory = getcwd(NULL, 0);
+
+	if (directory != NULL)
+		setCurrentDirectory(directory);
+
+	return 0;
+}
+
+// executePwd() function implements the "pwd" builtin.
+int executePwd(char **args)
+{
+	const char *directory = getCurrentDirectory();
+
+	if (directory[0] == '\0')
+	{
+		fprintf(stderr, "pwd: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("%s\n", directory);
+	return 0;
+}
+
+// executeEcho() function implements the "echo" builtin.
+// The arguments are printed separated by spaces and
+// followed by a newline, unless the first one is -n.
+int executeEcho(char **args)
+{
+	int iNewline = 1;
+	int i = 1;
+
+	if ((args[1] != NULL) && (strcmp(args[1], "-n") == 0))
+	{
+		iNewline = 0;
+		i++;
+	}
+
+	for (; args[i] != NULL; ++i)
+	{
+		fputs(args[i], stdout);
+
+		if (args[i + 1] != NULL)
+			putchar(' ');
+	}
+
+	if (iNewline)
+		putchar('\n');
+
+	return 0;
+}
+
+// printEscape() function prints the character for the
+// backslash escape sequence starting at "p", just after
+// the backslash, and returns where the sequence ends.
+const char* printEscape(const char *p)
+{
+	switch (*p)
+	{
+	case 'n':	putchar('\n');	break;
+	case 't':	putchar('\t');	break;
+	case 'r':	putchar('\r');	break;
+	case 'a':	putchar('\a');	break;
+	case 'b':	putchar('\b');	break;
+	case 'f':	putchar('\f');	break;
+	case 'v':	putchar('\v');	break;
+	case '\\':	putchar('\\');	break;
+	case '\0':
+		putchar('\\');
+		return p;
+	default:
+		putchar('\\');
+		putchar(*p);
+		break;
+	}
+
+	return p + 1;
+}
+
+// executePrintf() function implements the "printf" builtin.
+// The format understands the escapes of printEscape() and
+// the %d %i %u %o %x %X %c %s conversions with their flags,
+// width and precision. Like in other shells, the format is
+// used again as long as there are arguments left.
+int executePrintf(char **args)
+{
+	char **arg;
+
+	if (args[1] == NULL)
+	{
+		fprintf(stderr, "printf: usage: printf format [arguments]\n");
+		return 2;
+	}
+
+	arg = &args[2];
+
+	while (1)
+	{
+		char **argsBefore = arg;
+		const char *p = args[1];
+
+		while (*p != '\0')
+		{
+			char spec[32];
+			size_t iSpecLength = 0;
+
+			if (*p == '\\')
+			{
+				p = printEscape(p + 1);
+				continue;
+			}
+
+			if (*p != '%')
+			{
+				putchar(*p++);
+				continue;
+			}
+
+			if (p[1] == '%')
+			{
+				putchar('%');
+				p += 2;
+				continue;
+			}
+
+			// Copy the conversion up to its letter
+			spec[iSpecLength++] = *p++;
+
+			while ((*p != '\0') && strchr("-+ #0123456789.", *p) && (iSpecLength < sizeof(spec) - 4))
+				spec[iSpecLength++] = *p++;
+
+			switch (*p)
+			{
+			case 'd':
+			case 'i':
+				strcpy(spec + iSpecLength, "lld");
+				printf(spec, *arg ? strtoll(*arg++, NULL, 0) : 0LL);
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				spec[iSpecLength++] = 'l';
+				spec[iSpecLength++] = 'l';
+				spec[iSpecLength++] = *p;
+				spec[iSpecLength] = '\0';
+				printf(spec, *arg ? strtoull(*arg++, NULL, 0) : 0ULL);
+				break;
+			case 'c':
+				strcpy(spec + iSpecLength, "c");
+				printf(spec, *arg ? (*arg++)[0] : '\0');
+				break;
+			case 's':
+				strcpy(spec + iSpecLength, "s");
+				printf(spec, *arg ? *arg++ : "");
+				break;
+			default:
+				fprintf(stderr, "printf: %c: invalid format character\n", *p ? *p : '%');
+				return 1;
+			}
+
+			p++;
+		}
+
+		// Stop when all the arguments are used, or if
+		// the format doesn't use any of them
+		if ((*arg == NULL) || (arg == argsBefore))
+			break;
+	}
+
+	return 0;
+}
+
+// TestParser structure type holds the state of the
+// recursive descent parser of the "test" builtin.
+typedef struct
+{
+	char **args;					// the expression
+	int iPos;						// next argument to look at
+	int iEnd;						// number of arguments in the expression
+	int iError;						// set to 1 on a syntax error
+} TestParser;
+
+int evaluateTestOr(TestParser *test);	// forward declaration
+
+// getTestNumber() function converts an operand of a
+// numeric comparison, flagging an error if it isn't one.
+long long getTestNumber(TestParser *test, const char *str)
+{
+	char *end;
+	long long n = strtoll(str, &end, 10);
+
+	if ((*str == '\0') || (*end != '\0'))
+	{
+		fprintf(stderr, "test: %s: integer expression expected\n", str);
+		test->iError = 1;
+	}
+
+	return n;
+}
+
+// evaluateTestPrimary() function evaluates a single
+// condition: ( expr ), a unary file or string test,
+// a binary comparison or a string on its own.
+int evaluateTestPrimary(TestParser *test)
+{
+	char **args = test->args;
+	int i = test->iPos;
+
+	if (i >= test->iEnd)
+	{
+		test->iError = 1;
+		return 0;
+	}
+
+	// A binary comparison
+	if (i + 2 < test->iEnd)
+	{
+		const char *a = args[i], *op = args[i + 1], *b = args[i + 2];
+		int iResult = -1;
+
+		if ((strcmp(op, "=") == 0) || (strcmp(op, "==") == 0))
+			iResult = (strcmp(a, b) == 0);
+		else if (strcmp(op, "!=") == 0)
+			iResult = (strcmp(a, b) != 0);
+		else if (strcmp(op, "-eq") == 0)
+			iResult = (getTestNumber(test, a) == getTestNumber(test, b));
+		else if (strcmp(op, "-ne") == 0)
+			iResult = (getTestNumber(test, a) != getTestNumber(test, b));
+		else if (strcmp(op, "-lt") == 0)
+			iResult = (getTestNumber(test, a) < getTestNumber(test, b));
+		else if (strcmp(op, "-le") == 0)
+			iResult = (getTestNumber(test, a) <= getTestNumber(test, b));
+		else if (strcmp(op, "-gt") == 0)
+			iResult = (getTestNumber(test, a) > getTestNumber(test, b));
+		else if (strcmp(op, "-ge") == 0)
+			iResult = (getTestNumber(test, a) >= getTestNumber(test, b));
+
+		if (iResult >= 0)
+		{
+			test->iPos += 3;
+			return iResult;
+		}
+	}
+
+	if ((strcmp(args[i], "(") == 0) && (i + 1 < test->iEnd))
+	{
+		int iResult;
+
+		test->iPos++;
+		iResult = evaluateTestOr(test);
+
+		if ((test->iPos >= test->iEnd) || (strcmp(args[test->iPos], ")") != 0))
+			test->iError = 1;
+
+		test->iPos++;
+		return iResult;
+	}
+
+	// A unary test
+	if ((args[i][0] == '-') && (args[i][1] != '\0') && (args[i][2] == '\0') && (i + 1 < test->iEnd))
+	{
+		const char *operand = args[i + 1];
+		struct stat st;
+		int iResult = -1;
+
+		switch (args[i][1])
+		{
+		case 'n':	iResult = (operand[0] != '\0');		break;
+		case 'z':	iResult = (operand[0] == '\0');		break;
+		case 'e':	iResult = (stat(operand, &st) == 0);	break;
+		case 'f':	iResult = (stat(operand, &st) == 0) && S_ISREG(st.st_mode);	break;
+		case 'd':	iResult = (stat(operand, &st) == 0) && S_ISDIR(st.st_mode);	break;
+		case 's':	iResult = (stat(operand, &st) == 0) && (st.st_size > 0);		break;
+		case 'h':
+		case 'L':	iResult = (lstat(operand, &st) == 0) && S_ISLNK(st.st_mode);	break;
+		case 'r':	iResult = (access(operand, R_OK) == 0);	break;
+		case 'w':	iResult = (access(operand, W_OK) == 0);	break;
+		case 'x':	iResult = (access(operand, X_OK) == 0);	break;
+		}
+
+		if (iResult >= 0)
+		{
+			test->iPos += 2;
+			return iResult;
+		}
+	}
+
+	// Any other string is true if it isn't empty
+	test->iPos++;
+	return args[i][0] != '\0';
+}
+
+// evaluateTestNot() function evaluates a condition
+// that may be negated with !.
+int evaluateTestNot(TestParser *test)
+{
+	if ((strcmp(test->args[test->iPos], "!") == 0) && (test->iPos + 1 < test->iEnd))
+	{
+		test->iPos++;
+		return !evaluateTestNot(test);
+	}
+
+	return evaluateTestPrimary(test);
+}
+
+// evaluateTestAnd() function evaluates conditions
+// joined with -a.
+int evaluateTestAnd(TestParser *test)
+{
+	int iResult = evaluateTestNot(test);
+
+	while ((test->iPos < test->iEnd) && (strcmp(test->args[test->iPos], "-a") == 0))
+	{
+		test->iPos++;
+		iResult = evaluateTestNot(test) && iResult;
+	}
+
+	return iResult;
+}
+
+// evaluateTestOr() function evaluates conditions
+// joined with -o, which binds less tightly than -a.
+int evaluateTestOr(TestParser *test)
+{
+	int iResult = evaluateTestAnd(test);
+
+	while ((test->iPos < test->iEnd) && (strcmp(test->args[test->iPos], "-o") == 0))
+	{
+		test->iPos++;
+		iResult = evaluateTestAnd(test) || iResult;
+	}
+
+	return iResult;
+}
+
+// executeTest() function implements the "test" builtin
+// and its "[" form, which needs a "]" at the end. It
+// returns 0 if the expression is true, 1 if it is false
+// and 2 if it can't be evaluated.
+int executeTest(char **args)
+{
+	TestParser test;
+	int iResult;
+
+	test.args = args + 1;
+	test.iPos = 0;
+	test.iEnd = 0;
+	test.iError = 0;
+
+	while (test.args[test.iEnd] != NULL)
+		test.iEnd++;
+
+	if (strcmp(args[0], "[") == 0)
+	{
+		if ((test.iEnd == 0) || (strcmp(test.args[test.iEnd - 1], "]") != 0))
+		{
+			fprintf(stderr, "[: missing `]'\n");
+			return 2;
+		}
+
+		test.iEnd--;
+	}
+
+	// No expression at all is false
+	if (test.iEnd == 0)
+		return 1;
+
+	iResult = evaluateTestOr(&test);
+
+	if (test.iError || (test.iPos != test.iEnd))
+	{
+		if (!test.iError || (test.iPos < test.iEnd))
+			fprintf(stderr, "%s: syntax error in expression\n", args[0]);
+		return 2;
+	}
+
+	return iResult ? 0 : 1;
+}
+
+// executeTrue() function implements the "true" builtin.
+int executeTrue(char **args)
+{
+	return 0;
+}
+
+// executeFalse() function implements the "false" builtin.
+int executeFalse(char **args)
+{
+	return 1;
+}
+
+// executeExit() function implements the "exit" builtin.
+// The shell exits with the given status, or with the
+// status of the last command if there is none.
+int executeExit(char **args)
+{
+	int iStatus = args[1] ? atoi(args[1]) : iLastStatus;
+
+	fflush(stdout);
+	exit(iStatus & 0xff);
+}
+
+// executeExport() function implements the "export" builtin.
+// "export NAME=value" sets the variable and puts it into the
+// environment of the commands started from now on, "export
+// NAME" does the same with the value it already has, and
+// "export" alone lists the environment, sorted by name.
+int executeExport(char **args)
+{
+	int iStatus = 0;
+	int i;
+
+	if (args[1] == NULL)
+	{
+		char **envp = getEnvironment();
+		char **sorted;
+		int iCount = 0;
+
+		while (envp[iCount] != NULL)
+			iCount++;
+
+		sorted = malloc((iCount + 1) * sizeof(char *));
+		memcpy(sorted, envp, iCount * sizeof(char *));
+		qsort(sorted, iCount, sizeof(char *), compareStrings);
+
+		for (i = 0; i < iCount; ++i)
+			printf("export %s\n", sorted[i]);
+
+		free(sorted);
+		return 0;
+	}
+
+	for (i = 1; args[i] != NULL; ++i)
+	{
+		char *equals = strchr(args[i], '=');
+		size_t iNameLength = equals ? (size_t) (equals - args[i]) : strlen(args[i]);
+
+		if (!isValidName(args[i], iNameLength))
+		{
+			fprintf(stderr, "export: `%s': not a valid identifier\n", args[i]);
+			iStatus = 1;
+			continue;
+		}
+
+		setVariable(args[i], iNameLength, equals ? equals + 1 : NULL, 1);
+	}
+
+	return iStatus;
+}
+
+// executeUnset() function implements the "unset" builtin,
+// which removes the given variables, from the environment
+// of the commands as well.
+int executeUnset(char **args)
+{
+	int iStatus = 0;
+	int i;
+
+	for (i = 1; args[i] != NULL; ++i)
+	{
+		if (!isValidName(args[i], strlen(args[i])))
+		{
+			fprintf(stderr, "unset: `%s': not a valid identifier\n", args[i]);
+			iStatus = 1;
+			continue;
+		}
+
+		unsetVariable(args[i]);
+	}
+
+	return iStatus;
+}
+
+const Builtin* findBuiltin(const char *name);	// forward declaration
+int prepareLaunchSpec(LaunchSpec *spec, char **args);	// forward declaration
+
+// executeType() function implements the "type" builtin,
+// which tells how each of the given names would be run.
+int executeType(char **args)
+{
+	int iStatus = 0;
+	int i;
+
+	for (i = 1; args[i] != NULL; ++i)
+	{
+		char *path;
+
+		if (findBuiltin(args[i]) != NULL)
+			printf("%s is a shell builtin\n", args[i]);
+		else if ((path = resolveCommandPath(args[i])) != NULL)
+			printf("%s is %s\n", args[i], path);
+		else
+		{
+			fprintf(stderr, "type: %s: not found\n", args[i]);
+			iStatus = 1;
+		}
+	}
+
+	return iStatus;
+}
+
+// findJob() function returns the job named by "spec" for
+// the job control builtins: %n for job number n, %+ or %%
+// (or no spec at all) for the most recent job, or the PID
+// of one of its processes. It prints an error and returns
+// NULL if there is no such job. SIGCHLD must be blocked.
+Job* findJob(const char *name, const char *spec)
+{
+	int i, j;
+
+	if ((spec == NULL) || (strcmp(spec, "%+") == 0) || (strcmp(spec, "%%") == 0))
+	{
+		if (jobTable.iCount > 0)
+			return jobTable.jobs[jobTable.iCount - 1];
+
+		fprintf(stderr, "%s: current: no such job\n", name);
+		return NULL;
+	}
+
+	for (i = 0; i < jobTable.iCount; ++i)
+	{
+		Job *job = jobTable.jobs[i];
+
+		if (spec[0] == '%')
+		{
+			if (job->iId == atoi(spec + 1))
+				return job;
+		}
+		else
+		{
+			for (j = 0; j < job->iNumProcs; ++j)
+				if (job->procs[j].pid == atoi(spec))
+					return job;
+		}
+	}
+
+	fprintf(stderr, "%s: %s: no such job\n", name, spec);
+	return NULL;
+}
+
+// continueJob() function lets the stopped processes of
+// a job run again. SIGCHLD must be blocked.
+void continueJob(Job *job)
+{
+	int i;
+
+	for (i = 0; i < job->iNumProcs; ++i)
+		if (job->procs[i].iState == Process_Stopped)
+			job->procs[i].iState = Process_Running;
+
+	if (job->pgid > 0)
+		kill(iJobControl ? -job->pgid : job->pgid, SIGCONT);
+}
+
+// executeJobs() function implements the "jobs" builtin,
+// which lists the jobs of the shell. Finished background
+// jobs are listed one last time and then forgotten.
+int executeJobs(char **args)
+{
+	int i;
+
+	blockChildSignal();
+
+	for (i = 0; i < jobTable.iCount; ++i)
+	{
+		Job *job = jobTable.jobs[i];
+
+		printJob(job);
+
+		if (getJobState(job) == Process_Done)
+		{
+			removeJob(job);
+			i--;
+		}
+	}
+
+	unblockChildSignal();
+	return 0;
+}
+
+// executeFg() function implements the "fg" builtin. The
+// job is continued if it was stopped, gets the terminal
+// and the shell waits for it as for any foreground job.
+int executeFg(char **args)
+{
+	int iStatus = 1;
+	Job *job;
+
+	blockChildSignal();
+	job = findJob(args[0], args[1]);
+
+	if (job != NULL)
+	{
+		printf("%s\n", job->command);
+		fflush(stdout);
+
+		job->iBackground = 0;
+		continueJob(job);
+
+		if (waitForJob(job))
+		{
+			iStatus = getJobExitStatus(job);
+			removeJob(job);
+		}
+		else
+		{
+			iStatus = 128 + SIGTSTP;
+		}
+	}
+
+	unblockChildSignal();
+	return iStatus;
+}
+
+// executeBg() function implements the "bg" builtin,
+// which lets a stopped job go on in the background.
+int executeBg(char **args)
+{
+	Job *job;
+
+	blockChildSignal();
+	job = findJob(args[0], args[1]);
+
+	if (job != NULL)
+	{
+		job->iBackground = 1;
+		continueJob(job);
+		printf("[%d]+ %s &\n", job->iId, job->command);
+	}
+
+	unblockChildSignal();
+	return job ? 0 : 1;
+}
+
+// executeWait() function implements the "wait" builtin. It
+// waits for the given jobs (see findJob()), or for all the
+// running jobs if none is given, and returns the exit
+// status of the last one. Stopped jobs are not waited for.
+int executeWait(char **args)
+{
+	int iStatus = 0;
+	int i;
+
+	blockChildSignal();
+
+	if (args[1] == NULL)
+	{
+		for (i = 0; i < jobTable.iCount; ++i)
+		{
+			Job *job = jobTable.jobs[i];
+
+			while (getJobState(job) == Process_Running)
+				sigsuspend(&waitMask);
+
+			if (getJobState(job) == Process_Done)
+			{
+				removeJob(job);
+				i--;
+			}
+		}
+	}
+
+	for (i = 1; args[i] != NULL; ++i)
+	{
+		Job *job = findJob(args[0], args[i]);
+
+		if (job == NULL)
+		{
+			iStatus = 127;
+			continue;
+		}
+
+		while (getJobState(job) == Process_Running)
+			sigsuspend(&waitMask);
+
+		if (getJobState(job) == Process_Done)
+		{
+			iStatus = getJobExitStatus(job);
+			removeJob(job);
+		}
+		else
+		{
+			iStatus = 128 + SIGTSTP;
+		}
+	}
+
+	unblockChildSignal();
+	return iStatus;
+}
+
+// PexecTask structure type is used to contain one command
+// run by "pexec", with the output it has written so far.
+typedef struct
+{
+	char *input;					// the argument the command was made from
+	pid_t pid;						// PID of the command, or -1 if it could not be started
+	int iProc;						// index of the process in the job of "pexec"
+	int fdOutput;					// read end of the pipe of its standard output, -1 after end of file
+	char *output;					// everything read from fdOutput
+	size_t iLength;					// number of bytes in output
+	size_t iAllocated;				// allocated size of output
+	int status;						// status from waitpid() once it has finished
+	double startTime;				// when it was started, see getMonotonicTime()
+	double elapsed;					// seconds from its start until it finished
+	int iFinished;					// 1 once it has exited and all its output is read
+} PexecTask;
+
+// buildPexecArgs() function returns the arguments for running
+// the command "pattern" (of "iNumArgs" words) on "input": every
+// {} is replaced by the input, or the input is added as the
+// last argument if there is no {}. They are allocated from
+// the command arena.
+char** buildPexecArgs(char **pattern, int iNumArgs, char *input)
+{
+	char **args = arenaAlloc(&commandArena, (iNumArgs + 2) * sizeof(char *));
+	size_t iInputLength = strlen(input);
+	int iReplaced = 0;
+	int i;
+
+	for (i = 0; i < iNumArgs; ++i)
+	{
+		const char *p = pattern[i];
+		const char *q;
+		char *arg;
+		int iCount = 0;
+
+		for (q = strstr(p, "{}"); q != NULL; q = strstr(q + 2, "{}"))
+			iCount++;
+
+		if (iCount == 0)
+		{
+			args[i] = pattern[i];
+			continue;
+		}
+
+		arg = arenaAlloc(&commandArena, strlen(p) + iCount * iInputLength + 1);
+		args[i] = arg;
+		iReplaced = 1;
+
+		while ((q = strstr(p, "{}")) != NULL)
+		{
+			memcpy(arg, p, q - p);
+			arg += q - p;
+			memcpy(arg, input, iInputLength);
+			arg += iInputLength;
+			p = q + 2;
+		}
+
+		strcpy(arg, p);
+	}
+
+	if (!iReplaced)
+		args[i++] = input;
+
+	args[i] = NULL;
+	return args;
+}
+
+// startPexecTask() function starts the command "args" for
+// "task" with its standard output going into a pipe that
+// "pexec" reads, and its standard input from /dev/null so
+// that the commands don't compete for the input of the
+// shell. The process is recorded in "job" so that the
+// SIGCHLD handler reaps it, but it stays in the process
+// group of the shell: the commands are in the foreground
+// together with the shell and ^C stops all of them.
+void startPexecTask(Job *job, PexecTask *task, char **args)
+{
+	LaunchSpec spec;
+	int fds[2];
+
+	task->pid = -1;
+	task->fdOutput = -1;
+	task->startTime = getMonotonicTime();
+
+	if (prepareLaunchSpec(&spec, args) < 0)
+		return;
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+	{
+		perror("pipe() error: ");
+		return;
+	}
+
+	spec.fdout = fds[1];
+	spec.inputFile = "/dev/null";
+
+	task->pid = launchProcess(&spec);
+	close(fds[1]);
+
+	if (fdTrace >= 0)
+		traceLaunch(job, &spec, task->pid, task->startTime);
+
+	if (task->pid < 0)
+	{
+		close(fds[0]);
+		return;
+	}
+
+	addProcessToJob(job, task->pid);
+	task->iProc = job->iNumProcs - 1;
+	task->fdOutput = fds[0];
+}
+
+// readPexecOutput() function reads what is available on
+// the output pipe of "task" and closes it at end of file.
+void readPexecOutput(PexecTask *task)
+{
+	ssize_t n;
+
+	if (task->iAllocated - task->iLength < 4096)
+	{
+		task->iAllocated = task->iAllocated ? task->iAllocated * 2 : 16 * 1024;
+		task->output = realloc(task->output, task->iAllocated);
+	}
+
+	n = read(task->fdOutput, task->output + task->iLength, task->iAllocated - task->iLength);
+
+	if ((n < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+		return;
+
+	if (n <= 0)
+	{
+		close(task->fdOutput);
+		task->fdOutput = -1;
+		return;
+	}
+
+	task->iLength += n;
+}
+
+// printPexecTask() function writes the whole output of a
+// finished task in one go, so that it doesn't mix with the
+// output of the others, followed by a line on standard
+// error with its exit status and how long it ran.
+void printPexecTask(PexecTask *task, int iTask, int iNumTasks)
+{
+	char description[64];
+
+	if (task->pid < 0)
+		strcpy(description, "not started");
+	else if (WIFSIGNALED(task->status))
+		snprintf(description, sizeof(description), "%s", strsignal(WTERMSIG(task->status)));
+	else
+		snprintf(description, sizeof(description), "exit %d", getExitStatus(task->status));
+
+	fwrite(task->output, 1, task->iLength, stdout);
+	fflush(stdout);
+
+	fprintf(stderr, "pexec: [%d/%d] %s: %s, %.3f s\n", iTask + 1, iNumTasks,
+			task->input, description, task->elapsed);
+
+	free(task->output);
+	task->output = NULL;
+}
+
+// splitPexecInput() function splits "text", the arguments
+// read from standard input, into lines in place. Empty lines
+// are skipped. It returns the lines, allocated from the
+// command arena, and their number in "pNumInputs".
+char** splitPexecInput(char *text, int *pNumInputs)
+{
+	char **inputs;
+	char *p;
+	int iCount = 1;
+
+	for (p = text; *p; ++p)
+		if (*p == '\n')
+			iCount++;
+
+	inputs = arenaAlloc(&commandArena, iCount * sizeof(char *));
+	*pNumInputs = 0;
+
+	for (p = strtok(text, "\n"); p != NULL; p = strtok(NULL, "\n"))
+		inputs[(*pNumInputs)++] = p;
+
+	return inputs;
+}
+
+// executePexec() function implements the "pexec" builtin,
+// which runs a command once for every argument with up to
+// N of them at a time, e.g.
+//		pexec -j 4 gzip -9 {} ::: a.txt b.txt c.txt
+//		ls *.c | pexec wc -l
+// The arguments come after ::: or, without it, one per line
+// from standard input. N is given with -j and is the number
+// of online CPUs by default. The output of every command is
+// collected and printed in one piece when it finishes, or
+// in the order of the arguments with -k. The commands are
+// started with the launcher of the shell, like any other
+// command. It returns 0 if all the commands succeeded, and
+// otherwise the number of failed ones (at most 101). After
+// ^C it waits for the running commands and starts no more.
+int executePexec(char **args)
+{
+	int iMaxRunning = sysconf(_SC_NPROCESSORS_ONLN);
+	int iKeepOrder = 0;
+	int iNumRunning = 0;
+	int iNumDone = 0;
+	int iNumFailed = 0;
+	int iNumPrinted = 0;
+	int iNext = 0;
+	int iInterrupted = 0;
+	int iFirst, iSeparator, iNumInputs;
+	char **inputs;
+	char *text = NULL;
+	PexecTask *tasks;
+	struct pollfd *fds;
+	int *running;
+	double startTime = getMonotonicTime();
+	Job *job;
+	int i;
+
+	for (iFirst = 1; (args[iFirst] != NULL) && (args[iFirst][0] == '-'); ++iFirst)
+	{
+		if (strcmp(args[iFirst], "--") == 0)
+		{
+			iFirst++;
+			break;
+		}
+
+		if (strcmp(args[iFirst], "-k") == 0)
+			iKeepOrder = 1;
+		else if ((strcmp(args[iFirst], "-j") == 0) && (args[iFirst + 1] != NULL))
+			iMaxRunning = atoi(args[++iFirst]);
+		else if ((strncmp(args[iFirst], "-j", 2) == 0) && (args[iFirst][2] != '\0'))
+			iMaxRunning = atoi(args[iFirst] + 2);
+		else
+			break;
+	}
+
+	for (iSeparator = iFirst; args[iSeparator] != NULL; ++iSeparator)
+		if (strcmp(args[iSeparator], ":::") == 0)
+			break;
+
+	if ((iSeparator == iFirst) || (args[iFirst][0] == '-'))
+	{
+		fprintf(stderr, "usage: pexec [-j N] [-k] command [arguments] [::: inputs]\n");
+		return 2;
+	}
+
+	if (iMaxRunning < 1)
+		iMaxRunning = 1;
+
+	if (args[iSeparator] != NULL)
+	{
+		inputs = &args[iSeparator + 1];
+
+		for (iNumInputs = 0; inputs[iNumInputs] != NULL; ++iNumInputs)
+			;
+	}
+	else
+	{
+		text = readWholeFile(STDIN_FILENO);
+
+		if (text == NULL)
+		{
+			perror("pexec: ");
+			return 1;
+		}
+
+		inputs = splitPexecInput(text, &iNumInputs);
+	}
+
+	tasks = arenaAlloc(&commandArena, (iNumInputs + 1) * sizeof(PexecTask));
+	fds = arenaAlloc(&commandArena, iMaxRunning * sizeof(struct pollfd));
+	running = arenaAlloc(&commandArena, iMaxRunning * sizeof(int));
+	memset(tasks, 0, iNumInputs * sizeof(PexecTask));
+
+	// SIGCHLD is blocked except inside ppoll(), like
+	// in waitForJob(), so no exit can go unnoticed.
+	job = addJob(strdup(args[0]), iMaxRunning, 0);
+
+	while (1)
+	{
+		int iNumPolled = 0;
+
+		while ((iNumRunning < iMaxRunning) && (iNext < iNumInputs) && !iInterrupted)
+		{
+			tasks[iNext].input = inputs[iNext];
+			startPexecTask(job, &tasks[iNext], buildPexecArgs(&args[iFirst], iSeparator - iFirst, inputs[iNext]));
+			running[iNumRunning++] = iNext++;
+		}
+
+		// A task is finished when its output is closed and
+		// the SIGCHLD handler has seen its process exit.
+		for (i = 0; i < iNumRunning; )
+		{
+			PexecTask *task = &tasks[running[i]];
+
+			if ((task->fdOutput >= 0) ||
+				((task->pid > 0) && (job->procs[task->iProc].iState != Process_Done)))
+			{
+				++i;
+				continue;
+			}
+
+			task->status = (task->pid > 0) ? job->procs[task->iProc].status : 0;
+			task->elapsed = getMonotonicTime() - task->startTime;
+			task->iFinished = 1;
+
+			if ((task->pid < 0) || !WIFEXITED(task->status) || (WEXITSTATUS(task->status) != 0))
+				iNumFailed++;
+
+			// After ^C no more commands are started
+			if (WIFSIGNALED(task->status) && (WTERMSIG(task->status) == SIGINT))
+				iInterrupted = 1;
+
+			if (!iKeepOrder)
+				printPexecTask(task, running[i], iNumInputs);
+
+			iNumDone++;
+			running[i] = running[--iNumRunning];
+		}
+
+		while (iKeepOrder && (iNumPrinted < iNumInputs) && tasks[iNumPrinted].iFinished)
+		{
+			printPexecTask(&tasks[iNumPrinted], iNumPrinted, iNumInputs);
+			iNumPrinted++;
+		}
+
+		if ((iNumRunning == 0) && (iInterrupted || (iNext == iNumInputs)))
+			break;
+
+		if ((iNumRunning < iMaxRunning) && (iNext < iNumInputs) && !iInterrupted)
+			continue;
+
+		for (i = 0; i < iNumRunning; ++i)
+		{
+			if (tasks[running[i]].fdOutput >= 0)
+			{
+				fds[iNumPolled].fd = tasks[running[i]].fdOutput;
+				fds[iNumPolled].events = POLLIN;
+				iNumPolled++;
+			}
+		}
+
+		if (ppoll(fds, iNumPolled, NULL, &waitMask) < 0)
+			continue;
+
+		for (i = 0; i < iNumRunning; ++i)
+		{
+			PexecTask *task = &tasks[running[i]];
+			int j;
+
+			for (j = 0; j < iNumPolled; ++j)
+				if ((fds[j].fd == task->fdOutput) && fds[j].revents)
+					readPexecOutput(task);
+		}
+	}
+
+	removeJob(job);
+	unblockChildSignal();
+	free(text);
+
+	fprintf(stderr, "pexec: %d commands, %d failed, %.3f s\n", iNumDone, iNumFailed,
+			getMonotonicTime() - startTime);
+
+	if (iInterrupted)
+		return 128 + SIGINT;
+
+	return (iNumFailed > 101) ? 101 : iNumFailed;
+}
+
+// executeTime() function implements the "time" builtin. A
+// line starting with "time command" is marked by the parser
+// and timed as a whole (see reportJobUsage()), so this is
+// only what is left of it:
+//		time				resources used by the shell and its children so far
+//		time -a [on|off]	report the resources of every command, or stop it
+//		... | time command	time one stage of a pipe chain
+// The reports are written to the standard error.
+int executeTime(char **args)
+{
+	SimpleCommand command;
+	LaunchSpec spec;
+	Job *job;
+	int iStatus;
+
+	if (args[1] == NULL)
+	{
+		struct rusage usage;
+		double real = getMonotonicTime() - shellStartTime;
+
+		getrusage(RUSAGE_SELF, &usage);
+		printResourceUsage("shell", real, &usage);
+		getrusage(RUSAGE_CHILDREN, &usage);
+		printResourceUsage("children", real, &usage);
+		return 0;
+	}
+
+	if ((strcmp(args[1], "-a") == 0) && (args[2] == NULL))
+	{
+		printf("time -a %s\n", iTimeAll ? "on" : "off");
+		return 0;
+	}
+
+	if ((strcmp(args[1], "-a") == 0) && ((strcmp(args[2], "on") == 0) || (strcmp(args[2], "off") == 0)))
+	{
+		iTimeAll = (strcmp(args[2], "on") == 0);
+		return 0;
+	}
+
+	if (args[1][0] == '-')
+	{
+		fprintf(stderr, "usage: time [-a [on|off]] [command [arguments]]\n");
+		return 2;
+	}
+
+	if (prepareLaunchSpec(&spec, &args[1]) < 0)
+		return 127;
+
+	job = addJob(strdup(args[1]), 1, 0);
+	launchInJob(job, &spec);
+
+	if (!waitForJob(job))
+	{
+		unblockChildSignal();
+		return 128 + SIGTSTP;
+	}
+
+	command.iNumArgs = 1;
+	command.args = &args[1];
+	command.iNumAssignments = 0;
+	command.assignments = NULL;
+	command.redirections = NULL;
+	reportJobUsage(job, &command);
+
+	iStatus = getJobExitStatus(job);
+	removeJob(job);
+	unblockChildSignal();
+
+	return iStatus;
+}
+
+// Table of the builtin commands, sorted by name
+// so that findBuiltin() can use a binary search.
+const Builtin builtins[] =
+{
+	{ "[",			executeTest },
+	{ "bg",			executeBg },
+	{ "cd",			executeCd },
+	{ "cmdcache",	executeCmdCache },
+	{ "cmdhist",	executeCommandHistory },
+	{ "echo",		executeEcho },
+	{ "exit",		executeExit },
+	{ "export",		executeExport },
+	{ "false",		executeFalse },
+	{ "fg",			executeFg },
+	{ "hash",		executeHash },
+	{ "jobs",		executeJobs },
+	{ "pexec",		executePexec },
+	{ "printf",		executePrintf },
+	{ "pwd",		executePwd },
+	{ "test",		executeTest },
+	{ "time",		executeTime },
+	{ "true",		executeTrue },
+	{ "type",		executeType },
+	{ "unset",		executeUnset },
+	{ "wait",		executeWait }
+};
+
+// compareBuiltinName() is the bsearch() comparison
+// function for looking up a name in "builtins".
+int compareBuiltinName(const void *name, const void *builtin)
+{
+	return strcmp((const char *) name, ((const Builtin *) builtin)->name);
+}
+
+// findBuiltin() function returns the entry of the
+// builtin command "name", or NULL if "name" is not
+// a builtin and has to be run as a program.
+const Builtin* findBuiltin(const char *name)
+{
+	if (name == NULL)
+		return NULL;
+
+	return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]),
+				   sizeof(Builtin), compareBuiltinName);
+}
+
+// prepareLaunchSpec() function fills "spec" for running
+// the command "args": a builtin runs in a forked child,
+// anything else is looked up in PATH. It returns -1 if
+// the command can't be found.
+int prepareLaunchSpec(LaunchSpec *spec, char **args)
+{
+	const Builtin *builtin = findBuiltin(args[0]);
+	char *path = NULL;
+
+	if (builtin == NULL)
+	{
+		// Find the command before creating the child,
+		// so that the lookup stays in the path cache.
+		path = resolveOrReport(args[0]);
+
+		if (path == NULL)
+		{
+			iLastStatus = 127;
+			return -1;
+		}
+	}
+
+	initLaunchSpec(spec, path, args);
+	spec->builtin = builtin ? builtin->function : NULL;
+
+	return 0;
+}
+
+// Largest here-document that is fed through a pipe
+#define HERE_DOCUMENT_PIPE_MAX (64 * 1024)
+
+// openHereDocument() function returns a descriptor from which
+// a command can read the text of a here-document, or of a
+// here-string with a newline added to it, without creating a
+// temporary file or an "echo" process. A text that fits into
+// a pipe is written into it at once, before the command even
+// starts. The pipe doesn't block the shell, so a text that
+// doesn't fit after all can't hang it waiting for a reader.
+// Bigger texts go into an anonymous file in memory, made by
+// memfd_create(). It returns -1 on error.
+int openHereDocument(Redirection *redirection)
+{
+	size_t iLength = strlen(redirection->target);
+	size_t iTotal = iLength + (redirection->type == Redirect_Here_String);
+	struct iovec iov[2];
+	size_t iDone = 0;
+	int p[2];
+	int fd;
+
+	iov[0].iov_base = redirection->target;
+	iov[0].iov_len = iLength;
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = iTotal - iLength;
+
+	if ((iTotal <= HERE_DOCUMENT_PIPE_MAX) && (pipe2(p, O_CLOEXEC | O_NONBLOCK) == 0))
+	{
+		if (writev(p[1], iov, 2) == (ssize_t) iTotal)
+		{
+			// The command reads it like any other pipe
+			close(p[1]);
+			fcntl(p[0], F_SETFL, 0);
+			return p[0];
+		}
+
+		close(p[0]);
+		close(p[1]);
+	}
+
+	fd = memfd_create("here-document", MFD_CLOEXEC);
+
+	if (fd < 0)
+	{
+		perror("memfd_create() error: ");
+		return -1;
+	}
+
+	while (iDone < iTotal)
+	{
+		ssize_t n = (iDone < iLength) ?
+					write(fd, redirection->target + iDone, iLength - iDone) : write(fd, "\n", 1);
+
+		if ((n < 0) && (errno == EINTR))
+			continue;
+
+		if (n < 0)
+		{
+			perror("here-document");
+			close(fd);
+			return -1;
+		}
+
+		iDone += n;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+// setLaunchCommand() function gives the redirections and
+// the variable assignments of "command" to "spec". The files
+// are opened by the child, but the text of a here-document
+// has to be put into a pipe or a memory file by the shell
+// first. It returns 0 on success and -1 if a here-document
+// could not be opened.
+int setLaunchCommand(LaunchSpec *spec, SimpleCommand *command)
+{
+	Redirection *redirection;
+	int iNumRedirections = 0;
+	int iNumHereDocs = 0;
+	int i;
+
+	spec->redirections = command->redirections;
+	spec->envp = getCommandEnvironment(command);
+
+	for (redirection = command->redirections; redirection; redirection = redirection->next)
+	{
+		if ((redirection->type == Redirect_Here_Doc) || (redirection->type == Redirect_Here_String))
+			iNumHereDocs++;
+		iNumRedirections++;
+	}
+
+	if (iNumHereDocs == 0)
+		return 0;
+
+	spec->hereFds = arenaAlloc(&commandArena, iNumRedirections * sizeof(int));
+
+	for (redirection = command->redirections, i = 0; redirection; redirection = redirection->next, ++i)
+	{
+		spec->hereFds[i] = -1;
+
+		if ((redirection->type == Redirect_Here_Doc) || (redirection->type == Redirect_Here_String))
+		{
+			spec->hereFds[i] = openHereDocument(redirection);
+
+			if (spec->hereFds[i] < 0)
+			{
+				closeHereDocuments(spec);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// SavedVariable structure type is used to remember a
+// variable that a builtin command sets only while it
+// runs, as in "HOME=/tmp cd".
+typedef struct
+{
+	char *value;					// value it had before, or NULL if it wasn't set
+	int iExported;					// 1 if it was exported
+} SavedVariable;
+
+// setCommandVariables() function sets the variables assigned
+// in front of the builtin "command", exported so that the
+// commands it starts see them too, and returns what they
+// were before, for restoreCommandVariables().
+SavedVariable* setCommandVariables(SimpleCommand *command)
+{
+	SavedVariable *saved = arenaAlloc(&commandArena, command->iNumAssignments * sizeof(SavedVariable));
+	int i;
+
+	for (i = 0; i < command->iNumAssignments; ++i)
+	{
+		const char *assignment = command->assignments[i];
+		size_t iNameLength = strchr(assignment, '=') - assignment;
+		Variable *slot = findVariable(assignment, iNameLength);
+		int iSet = (slot->text != NULL) && !slot->iRemoved && (slot->text[iNameLength] == '=');
+
+		saved[i].value = iSet ? arenaStrndup(&commandArena, slot->text + iNameLength + 1,
+											 strlen(slot->text + iNameLength + 1)) : NULL;
+		saved[i].iExported = (slot->text != NULL) && !slot->iRemoved && slot->iExported;
+		assignVariable(assignment, 1);
+	}
+
+	return saved;
+}
+
+// restoreCommandVariables() function puts back the variables
+// changed by setCommandVariables(), in reverse order in case
+// the same one was assigned twice.
+void restoreCommandVariables(SimpleCommand *command, SavedVariable *saved)
+{
+	int i;
+
+	for (i = command->iNumAssignments - 1; i >= 0; --i)
+	{
+		const char *assignment = command->assignments[i];
+		size_t iNameLength = strchr(assignment, '=') - assignment;
+		Variable *slot;
+
+		if (saved[i].value == NULL)
+		{
+			unsetVariable(arenaStrndup(&commandArena, assignment, iNameLength));
+			continue;
+		}
+
+		setVariable(assignment, iNameLength, saved[i].value, 0);
+
+		// The new text isn't in the environment yet,
+		// so it may simply stop being exported
+		slot = findVariable(assignment, iNameLength);
+		variables.iEnvChanged |= (slot->iExported != saved[i].iExported);
+		slot->iExported = saved[i].iExported;
+	}
+}
+
+// runBuiltin() function runs a builtin command in the
+// shell process itself, without creating a child. This
+// is how "cd" and "exit" can work at all, and it saves
+// a fork() and exec() for "echo", "test" and the like.
+// The redirections of the command are applied to the
+// shell's own descriptors for the duration of the command
+// and undone in reverse order afterwards, and so are its
+// variable assignments. It returns the exit status of the
+// command.
+int runBuiltin(const Builtin *builtin, SimpleCommand *command)
+{
+	Redirection *redirection;
+	int iNumRedirections = 0;
+	int *targetFds;				// descriptor changed by each redirection
+	int *savedFds;				// copy of what it was before, or -1 if it was closed
+	int iFailed = 0;
+	int iStatus = 1;
+	int i;
+
+	for (redirection = command->redirections; redirection; redirection = redirection->next)
+		iNumRedirections++;
+
+	if ((iNumRedirections == 0) && (command->iNumAssignments == 0))
+		return builtin->function(command->args);
+
+	targetFds = arenaAlloc(&commandArena, 2 * iNumRedirections * sizeof(int));
+	savedFds = targetFds + iNumRedirections;
+
+	// Anything the shell has printed so far
+	// belongs to the old standard output.
+	fflush(stdout);
+
+	for (redirection = command->redirections, i = 0; redirection && !iFailed; redirection = redirection->next)
+	{
+		int fd;
+
+		targetFds[i] = redirection->fd;
+		savedFds[i] = fcntl(redirection->fd, F_DUPFD_CLOEXEC, 10);
+		i++;
+
+		switch (redirection->type)
+		{
+		case Redirect_Output:
+		case Redirect_Append:
+			fd = open(redirection->target,
+					  getOutputFileFlags(redirection->type == Redirect_Append) | O_CLOEXEC, 0644);
+			break;
+
+		case Redirect_Input:
+			fd = open(redirection->target, O_RDONLY | O_CLOEXEC);
+			break;
+
+		case Redirect_Here_Doc:
+		case Redirect_Here_String:
+			// It reports its own errors
+			fd = openHereDocument(redirection);
+			iFailed = (fd < 0);
+			break;
+
+		case Redirect_Duplicate:
+			fd = fcntl(parseDescriptor(redirection->target), F_DUPFD_CLOEXEC, 0);
+			break;
+
+		case Redirect_Close:
+			close(redirection->fd);
+			continue;
+
+		default:
+			continue;
+		}
+
+		if (fd < 0)
+		{
+			if (!iFailed)
+				fprintf(stderr, "%s: %s: %s\n", command->args[0], redirection->target, strerror(errno));
+			iFailed = 1;
+			continue;
+		}
+
+		// The file may have got the wanted number itself
+		if (fd != redirection->fd)
+		{
+			dup2(fd, redirection->fd);
+			close(fd);
+		}
+		else
+		{
+			fcntl(fd, F_SETFD, 0);
+		}
+	}
+
+	if (!iFailed)
+	{
+		SavedVariable *saved = setCommandVariables(command);
+
+		iStatus = builtin->function(command->args);
+		restoreCommandVariables(command, saved);
+	}
+
+	fflush(stdout);
+
+	while (i-- > 0)
+	{
+		if (savedFds[i] >= 0)
+		{
+			dup2(savedFds[i], targetFds[i]);
+			close(savedFds[i]);
+		}
+		else
+		{
+			close(targetFds[i]);
+		}
+	}
+
+	return iStatus;
+}
+
+// runTimedBuiltin() function runs a builtin command in
+// the shell like runBuiltin() and then reports what it
+// cost. That is what the shell process used in between,
+// plus its children reaped meanwhile, e.g. by "pexec".
+int runTimedBuiltin(const Builtin *builtin, SimpleCommand *command)
+{
+	struct rusage selfBefore, selfAfter, childrenBefore, childrenAfter;
+	double startTime = getMonotonicTime();
+	int iStatus;
+
+	getrusage(RUSAGE_SELF, &selfBefore);
+	getrusage(RUSAGE_CHILDREN, &childrenBefore);
+
+	iStatus = runBuiltin(builtin, command);
+
+	getrusage(RUSAGE_SELF, &selfAfter);
+	getrusage(RUSAGE_CHILDREN, &childrenAfter);
+
+	timersub(&selfAfter.ru_utime, &selfBefore.ru_utime, &selfAfter.ru_utime);
+	timersub(&selfAfter.ru_stime, &selfBefore.ru_stime, &selfAfter.ru_stime);
+	timersub(&childrenAfter.ru_utime, &childrenBefore.ru_utime, &childrenAfter.ru_utime);
+	timersub(&childrenAfter.ru_stime, &childrenBefore.ru_stime, &childrenAfter.ru_stime);
+	timeradd(&selfAfter.ru_utime, &childrenAfter.ru_utime, &selfAfter.ru_utime);
+	timeradd(&selfAfter.ru_stime, &childrenAfter.ru_stime, &selfAfter.ru_stime);
+
+	selfAfter.ru_nvcsw += childrenAfter.ru_nvcsw - selfBefore.ru_nvcsw - childrenBefore.ru_nvcsw;
+	selfAfter.ru_nivcsw += childrenAfter.ru_nivcsw - selfBefore.ru_nivcsw - childrenBefore.ru_nivcsw;
+
+	if (childrenAfter.ru_maxrss > selfAfter.ru_maxrss)
+		selfAfter.ru_maxrss = childrenAfter.ru_maxrss;
+
+	printResourceUsage(command->args[0], getMonotonicTime() - startTime, &selfAfter);
+
+	return iStatus;
+}
+
+// executeNormal() function is used for execution of a
+// single command, with its redirections applied by the
+// child itself. E.g.
+//		ls -l
+//		sort < names.txt > sorted.txt 2> errors.txt
+//		make &> build.log
+// The files are opened by the child and put directly on
+// its descriptors, so the data never passes through the
+// shell. Like all the execute*() functions below, it
+// starts the processes of "job" and leaves the waiting to
+// the caller.
+void executeNormal(SimpleCommand *command, Job *job)
+{
+	LaunchSpec spec;
+
+	if (prepareLaunchSpec(&spec, command->args) < 0)
+		return;
+
+	if (setLaunchCommand(&spec, command) < 0)
+	{
+		iLastStatus = 1;
+		return;
+	}
+
+	// Start the command as a child process
+	launchInJob(job, &spec);
+}
+
+// moveFromPipe() function moves exactly "len" bytes out
+// of the pipe "fdPipe" into "fdOut". It uses splice(), so
+// the data is moved inside the kernel and never copied
+// into the shell. If "fdOut" doesn't support splice() (a
+// terminal, for example) it falls back to a read()/write()
+// loop. It returns 0 on success and -1 on error.
+int moveFromPipe(int fdPipe, int fdOut, size_t len)
+{
+	char buff[65536];
+	int iUseSplice = 1;
+
+	while (len > 0)
+	{
+		ssize_t iNumMoved;
+
+		if (iUseSplice)
+		{
+			iNumMoved = splice(fdPipe, NULL, fdOut, NULL, len, SPLICE_F_MOVE);
+
+			if ((iNumMoved < 0) && (errno == EINVAL))
+			{
+				// fdOut can't be spliced into,
+				// copy the rest of the data.
+				iUseSplice = 0;
+				continue;
+			}
+		}
+		else
+		{
+			size_t iChunk = (len < sizeof(buff)) ? len : sizeof(buff);
+			ssize_t iNumRead = read(fdPipe, buff, iChunk);
+			ssize_t iDone = 0;
+
+			if (iNumRead <= 0)
+				return -1;
+
+			while (iDone < iNumRead)
+			{
+				ssize_t iNumWritten = write(fdOut, buff + iDone, iNumRead - iDone);
+
+				if (iNumWritten < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					return -1;
+				}
+
+				iDone += iNumWritten;
+			}
+
+			iNumMoved = iNumRead;
+		}
+
+		if (iNumMoved < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		len -= iNumMoved;
+	}
+
+	return 0;
+}
+
+// executeTeeRedirect() function is used for execution of a
+// command which uses |> or |>> operators. The output of the
+// command is written to the given file (truncating it, or
+// appending to it if iAppend is 1) and is also shown on the
+// standard output, like piping it through "tee".
+//
+// E.g. make |> build.log
+// or
+// make |>> build.log
+//
+// The child writes into a pipe. The shell duplicates the pipe
+// contents with tee(), which only takes extra references on
+// the pipe pages, and then splice()s one copy into the file
+// and the other onto the standard output. If the standard
+// output is itself a pipe, tee() targets it directly. If the
+// kernel can't do this for the given descriptors, a plain
+// read()/write() loop is used instead. Any other redirections
+// of "command" are applied by the child after the pipe, so
+// e.g. make 2>&1 |> build.log saves the errors too. If the
+// standard output goes away, the file still gets it all.
+void executeTeeRedirect(SimpleCommand *command, char *filename, int iAppend, Job *job)
+{
+	int p[2];		// child's standard output
+	int q[2];		// second copy of the data for our standard output
+	int iStdoutIsPipe;
+	struct stat st;
+	LaunchSpec spec;
+
+	if (prepareLaunchSpec(&spec, command->args) < 0)
+		return;
+
+	if (setLaunchCommand(&spec, command) < 0)
+	{
+		iLastStatus = 1;
+		return;
+	}
+
+	// Open the file in the parent, we will write
+	// the data into it ourselves.
+	int fd = open(filename, getOutputFileFlags(iAppend) | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+	{
+		perror(filename);
+		closeHereDocuments(&spec);
+		iLastStatus = 1;
+		return;
+	}
+
+	iStdoutIsPipe = (fstat(STDOUT_FILENO, &st) == 0) && S_ISFIFO(st.st_mode);
+
+	// The pipes are close-on-exec, so the child
+	// only keeps the end it gets as its output.
+	if (pipe2(p, O_CLOEXEC) < 0)
+	{
+		perror("pipe() error: ");
+		closeHereDocuments(&spec);
+		close(fd);
+		iLastStatus = 1;
+		return;
+	}
+
+	if (!iStdoutIsPipe && (pipe2(q, O_CLOEXEC) < 0))
+	{
+		perror("pipe() error: ");
+		closeHereDocuments(&spec);
+		close(p[0]);
+		close(p[1]);
+		close(fd);
+		iLastStatus = 1;
+		return;
+	}
+
+	// Start the child, it will write to the pipe
+	spec.fdout = p[1];
+
+	pid_t pid = launchInJob(job, &spec);
+
+	if (pid < 0)
+	{
+		close(p[0]);
+		close(p[1]);
+		if (!iStdoutIsPipe)
+		{
+			close(q[0]);
+			close(q[1]);
+		}
+		close(fd);
+		return;
+	}
+
+	close(p[1]);	// we only read from the pipe in the parent process
+
+	int fdCopy = iStdoutIsPipe ? STDOUT_FILENO : q[1];
+	int iUseTee = 1;
+	int iStdoutGone = 0;
+	char buff[65536];
+	long long iNumBytes = 0;
+	double startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+
+	// The reader of our standard output may go away, e.g.
+	// with "make |> build.log | head". Writing to it must
+	// then fail with EPIPE rather than kill the shell, and
+	// the file still gets everything the child writes.
+	void (*oldHandler)(int) = signal(SIGPIPE, SIG_IGN);
+
+	while (1)
+	{
+		ssize_t iNumRead;
+
+		if (iUseTee)
+		{
+			// Duplicate whatever is in the pipe without
+			// consuming it. This blocks until the child
+			// writes something, and returns 0 at EOF.
+			iNumRead = tee(p[0], fdCopy, 1 << 20, 0);
+
+			if ((iNumRead < 0) && ((errno == EINVAL) || (errno == EPIPE)))
+			{
+				// Nothing was consumed, the rest is
+				// copied by read() and write()
+				iStdoutGone = (errno == EPIPE);
+				iUseTee = 0;
+				continue;
+			}
+
+			if (iNumRead < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				perror("tee() error: ");
+				break;
+			}
+
+			if (iNumRead == 0)
+				break;
+
+			// Now consume the same bytes into the file, and
+			// send the duplicated copy to standard output.
+			if (moveFromPipe(p[0], fd, iNumRead) < 0)
+			{
+				perror(filename);
+				break;
+			}
+
+			if (!iStdoutIsPipe && (moveFromPipe(q[0], STDOUT_FILENO, iNumRead) < 0))
+			{
+				if (errno != EPIPE)
+					break;
+
+				// The file already has these bytes
+				iStdoutGone = 1;
+				iUseTee = 0;
+			}
+
+			iNumBytes += iNumRead;
+		}
+		else
+		{
+			iNumRead = read(p[0], buff, sizeof(buff));
+
+			if (iNumRead < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			if (iNumRead == 0)
+				break;
+
+			if (write(fd, buff, iNumRead) != iNumRead)
+				break;
+
+			if (!iStdoutGone && (write(STDOUT_FILENO, buff, iNumRead) != iNumRead))
+			{
+				if (errno != EPIPE)
+					break;
+
+				iStdoutGone = 1;
+			}
+
+			iNumBytes += iNumRead;
+		}
+	}
+
+	signal(SIGPIPE, oldHandler);
+
+	if (fdTrace >= 0)
+	{
+		TraceArgs traceArgs;
+
+		initTraceArgs(&traceArgs);
+		addTraceNumber(&traceArgs, "job", job->iId);
+		addTraceString(&traceArgs, "file", filename);
+		addTraceNumber(&traceArgs, "bytes", iNumBytes);
+		addTraceNumber(&traceArgs, "tee", iUseTee);
+		traceEvent("tee copy", startTime, getMonotonicTime(), getpid(), &traceArgs);
+	}
+
+	close(p[0]);
+	close(fd);
+	if (!iStdoutIsPipe)
+	{
+		close(q[0]);
+		close(q[1]);
+	}
+}
+
+// executeSingleCommand() is used to start a given command as a child process.
+// The given command is passed as "command" parameter to this function. It can do
+// input/output from any file descriptors given to it, which its own redirections
+// may still override, e.g. a < names.txt | b. The "fdclose" parameter
+// is a descriptor the child must not keep open (the read end of the pipe that
+// feeds the next stage), or -1 if there is none. This function does not wait
+// for the child, it returns the PID (or -1 if it failed to start) so that the
+// caller can start the remaining stages first. The process, or the failure to
+// start it, is recorded in "job" so that all the stages are reaped together.
+pid_t executeSingleCommand(SimpleCommand *command, int fdin, int fdout, int fdclose, Job *job)
+{
+	LaunchSpec spec;
+
+	if ((prepareLaunchSpec(&spec, command->args) < 0) || (setLaunchCommand(&spec, command) < 0))
+	{
+		addProcessToJob(job, -1);
+		return -1;
+	}
+
+	// Start the given command as a child process, reading
+	// from fdin and writing to fdout.
+	spec.fdin = fdin;
+	spec.fdout = fdout;
+	spec.fdclose = fdclose;
+
+	return launchInJob(job, &spec);
+}
+
+// printPipelineStatus() function will print the pid
+// and status of every stage of a piped chain. The
+// "commands" parameter is the chain itself, so that
+// each line can name the command it belongs to.
+void printPipelineStatus(SimpleCommand *commands, JobProcess *procs, int iNumCommands)
+{
+	int i;
+
+	printf("\n");
+
+	for (i = 0; i < iNumCommands; ++i)
+	{
+		int status = procs[i].status;
+
+		if (procs[i].pid < 0)
+		{
+			printf("Stage %d (%s) could not be started.\n", i + 1, commands[i].args[0]);
+			continue;
+		}
+
+		printf("Stage %d (%s): PID = %d and ", i + 1, commands[i].args[0], procs[i].pid);
+
+		if (WIFEXITED(status))
+			printf("Status = %d (exit code %d).\n", status, WEXITSTATUS(status));
+		else if (WIFSIGNALED(status))
+			printf("Status = %d (killed by signal %d).\n", status, WTERMSIG(status));
+		else
+			printf("Status = %d.\n", status);
+	}
+}
+
+// executePipedChain() function is used to execute a command
+// with one or more | operators in it. Internally, it will
+// start every command of the chain as a child process up
+// front, with the output of each command connected to the
+// input of the next command through a pipe. All the stages
+// run concurrently, so data streams through the chain at the
+// speed of its slowest stage and no stage can block forever
+// on a full pipe. All the stages are processes of "job",
+// so the chain is reaped as a unit. If a pipe can't be
+// created, the chain is given up as a whole.
+void executePipedChain(CommandLine *cmdLine, Job *job)
+{
+	int fdin, fdout;
+	int p[2];
+	int iNumCommands = cmdLine->iNumCommands;	// this will contain the total number of commands
+	int i;
+
+	// For first process in the chain, read
+	// from standard input (keyboard) only.
+	fdin = STDIN_FILENO;
+
+	// Start all the commands in the piped chain
+	// in this for loop, without waiting for any.
+	for (i = 0; i < iNumCommands; ++i)
+	{
+		// For the last command/process in the chain,
+		// write to standard output (terminal). For all
+		// the preceding commands/processes in the chain,
+		// write to write end of a new pipe.
+		if (i == (iNumCommands-1))
+		{
+			fdout = STDOUT_FILENO;
+			p[0] = -1;
+		}
+		else if (pipe2(p, O_CLOEXEC) == 0)
+		{
+			fdout = p[1];
+		}
+		else
+		{
+			// Nothing more can be started, the stages
+			// already running would wait for input
+			perror("pipe() error: ");
+
+			if (fdin != STDIN_FILENO)
+				close(fdin);
+
+			abortJobLaunch(job, iNumCommands);
+			return;
+		}
+
+		// Now start this command/process as a child process. This
+		// will be done by executeSingleCommand() function.
+		executeSingleCommand(&cmdLine->commands[i], fdin, fdout, p[0], job);
+
+		// Parent process doesn't need the pipe ends it has
+		// handed over to this child. They must be closed here,
+		// otherwise readers never see EOF.
+		if (fdin != STDIN_FILENO)
+			close(fdin);
+		if (fdout != STDOUT_FILENO)
+			close(fdout);
+
+		// The next command will read from the read end
+		// of the pipe, so let's save it.
+		fdin = p[0];
+	}
+}
+
+// FAN_OUT_RING_SIZE is the size of the bounded buffer used by
+// pumpFanOutRing(). The producer is not read any further while
+// the slowest consumer is this many bytes behind.
+#define FAN_OUT_RING_SIZE (256 * 1024)
+
+// pumpFanOutRing() function copies everything the producer writes
+// into "fdProducer" to each of the "iNumConsumers" descriptors in
+// "fdConsumers", using a bounded ring buffer. Every consumer drains
+// the ring at its own pace, so a slow consumer doesn't hold back
+// the others until the ring is full, at which point the producer
+// is throttled. Consumers whose descriptor is -1 are skipped, and
+// a consumer that has gone away is dropped. Each consumer's write
+// end is closed as soon as it has received all the data. Returns
+// the number of bytes read from the producer.
+long long pumpFanOutRing(int fdProducer, int *fdConsumers, int iNumConsumers)
+{
+	char *ring = malloc(FAN_OUT_RING_SIZE);
+	unsigned long long head = 0;	// total bytes read from the producer
+	unsigned long long *tail = arenaAlloc(&commandArena, iNumConsumers * sizeof(unsigned long long));
+	struct pollfd *fds = arenaAlloc(&commandArena, (iNumConsumers + 1) * sizeof(struct pollfd));
+	int *pollIndex = arenaAlloc(&commandArena, (iNumConsumers + 1) * sizeof(int));
+	int iEOF = 0;
+	int i;
+
+	memset(tail, 0, iNumConsumers * sizeof(unsigned long long));
+
+	// Nothing may block except poll() itself.
+	fcntl(fdProducer, F_SETFL, fcntl(fdProducer, F_GETFL) | O_NONBLOCK);
+	for (i = 0; i < iNumConsumers; ++i)
+		if (fdConsumers[i] >= 0)
+			fcntl(fdConsumers[i], F_SETFL, fcntl(fdConsumers[i], F_GETFL) | O_NONBLOCK);
+
+	while (1)
+	{
+		unsigned long long minTail = head;
+		int iNumFds = 0;
+
+		for (i = 0; i < iNumConsumers; ++i)
+		{
+			if (fdConsumers[i] < 0)
+				continue;
+
+			if (iEOF && (tail[i] == head))
+			{
+				// This consumer has got everything.
+				close(fdConsumers[i]);
+				fdConsumers[i] = -1;
+				continue;
+			}
+
+			if (tail[i] < minTail)
+				minTail = tail[i];
+
+			if (tail[i] < head)
+			{
+				fds[iNumFds].fd = fdConsumers[i];
+				fds[iNumFds].events = POLLOUT;
+				pollIndex[iNumFds++] = i;
+			}
+		}
+
+		// Keep reading only while there are consumers
+		// left and the slowest of them has room.
+		int iAnyConsumer = 0;
+		for (i = 0; i < iNumConsumers; ++i)
+			if (fdConsumers[i] >= 0)
+				iAnyConsumer = 1;
+
+		if (!iAnyConsumer)
+			break;
+
+		if (!iEOF && ((head - minTail) < FAN_OUT_RING_SIZE))
+		{
+			fds[iNumFds].fd = fdProducer;
+			fds[iNumFds].events = POLLIN;
+			pollIndex[iNumFds++] = -1;
+		}
+
+		if (poll(fds, iNumFds, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll() error: ");
+			break;
+		}
+
+		for (int k = 0; k < iNumFds; ++k)
+		{
+			if (fds[k].revents == 0)
+				continue;
+
+			if (pollIndex[k] < 0)
+			{
+				// Read as much as fits contiguously in the ring.
+				size_t iOffset = head % FAN_OUT_RING_SIZE;
+				size_t iRoom = FAN_OUT_RING_SIZE - (head - minTail);
+
+				if (iRoom > FAN_OUT_RING_SIZE - iOffset)
+					iRoom = FAN_OUT_RING_SIZE - iOffset;
+
+				ssize_t iNumRead = read(fdProducer, ring + iOffset, iRoom);
+
+				if (iNumRead > 0)
+					head += iNumRead;
+				else if ((iNumRead == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+					iEOF = 1;
+			}
+			else
+			{
+				// Write as much of the pending data as
+				// the consumer's pipe accepts right now.
+				i = pollIndex[k];
+
+				size_t iOffset = tail[i] % FAN_OUT_RING_SIZE;
+				size_t iLen = head - tail[i];
+
+				if (iLen > FAN_OUT_RING_SIZE - iOffset)
+					iLen = FAN_OUT_RING_SIZE - iOffset;
+
+				ssize_t iNumWritten = write(fdConsumers[i], ring + iOffset, iLen);
+
+				if (iNumWritten > 0)
+				{
+					tail[i] += iNumWritten;
+				}
+				else if ((iNumWritten < 0) && (errno != EAGAIN) && (errno != EINTR))
+				{
+					// The consumer has exited, drop it.
+					close(fdConsumers[i]);
+					fdConsumers[i] = -1;
+				}
+			}
+		}
+	}
+
+	free(ring);
+
+	return head;
+}
+
+// pumpFanOutTee() function copies everything the producer writes
+// into "fdProducer" to each of the consumer pipes in "fdConsumers"
+// without copying it through user space. Every chunk is duplicated
+// with tee() into all consumers but the last one, and then moved
+// into the last consumer with splice(). The first consumer's pipe
+// paces the loop; a consumer that can't take the whole chunk at
+// that moment gets the remainder from a bounce buffer, so nothing
+// is lost or reordered. Returns the number of bytes read from the
+// producer, or -1 if tee() or splice() isn't usable on these
+// descriptors, in which case nothing has been consumed yet.
+long long pumpFanOutTee(int fdProducer, int *fdConsumers, int iNumConsumers)
+{
+	const size_t CHUNK_SIZE = 1 << 20;
+	size_t *sent = arenaAlloc(&commandArena, iNumConsumers * sizeof(size_t));
+	char *buff = NULL;
+	long long iTotal = 0;
+	int i;
+
+	while (1)
+	{
+		int iFirst = -1;
+		int iLast = -1;
+		ssize_t n;
+
+		for (i = 0; i < iNumConsumers; ++i)
+		{
+			if (fdConsumers[i] < 0)
+				continue;
+			if (iFirst < 0)
+				iFirst = i;
+			iLast = i;
+		}
+
+		// All the consumers have gone away.
+		if (iFirst < 0)
+			break;
+
+		if (iFirst == iLast)
+		{
+			// Only one consumer left, just move data.
+			n = splice(fdProducer, NULL, fdConsumers[iFirst], NULL, CHUNK_SIZE, SPLICE_F_MOVE);
+
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if ((errno == EINVAL) && (iTotal == 0))
+					return -1;
+				close(fdConsumers[iFirst]);
+				fdConsumers[iFirst] = -1;
+				continue;
+			}
+
+			if (n == 0)
+				break;
+
+			iTotal += n;
+			continue;
+		}
+
+		// Duplicate the next chunk into the first consumer. This
+		// blocks until the producer has written something and the
+		// consumer has room, and returns 0 at EOF.
+		n = tee(fdProducer, fdConsumers[iFirst], CHUNK_SIZE, 0);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EINVAL) && (iTotal == 0))
+				return -1;
+			close(fdConsumers[iFirst]);
+			fdConsumers[iFirst] = -1;
+			continue;
+		}
+
+		if (n == 0)
+			break;
+
+		// Offer the same bytes to the others, except the last one,
+		// without blocking. Whatever doesn't fit is sent later.
+		int iLagging = 0;
+
+		sent[iFirst] = n;
+
+		for (i = iFirst + 1; i < iLast; ++i)
+		{
+			if (fdConsumers[i] < 0)
+				continue;
+
+			ssize_t m = tee(fdProducer, fdConsumers[i], n, SPLICE_F_NONBLOCK);
+
+			if ((m < 0) && (errno == EPIPE))
+			{
+				close(fdConsumers[i]);
+				fdConsumers[i] = -1;
+				continue;
+			}
+
+			sent[i] = (m > 0) ? m : 0;
+
+			if (sent[i] < (size_t) n)
+				iLagging = 1;
+		}
+
+		if (!iLagging)
+		{
+			// Everybody has the chunk, move the original
+			// into the last consumer.
+			size_t iMoved = 0;
+
+			while (iMoved < (size_t) n)
+			{
+				ssize_t m = splice(fdProducer, NULL, fdConsumers[iLast], NULL, n - iMoved, SPLICE_F_MOVE);
+
+				if ((m < 0) && (errno == EINTR))
+					continue;
+
+				if (m <= 0)
+				{
+					// The last consumer went away, throw the
+					// rest of the chunk away.
+					close(fdConsumers[iLast]);
+					fdConsumers[iLast] = -1;
+
+					if (buff == NULL)
+						buff = malloc(CHUNK_SIZE);
+
+					while (iMoved < (size_t) n)
+					{
+						m = read(fdProducer, buff, n - iMoved);
+						if (m <= 0)
+							break;
+						iMoved += m;
+					}
+					break;
+				}
+
+				iMoved += m;
+			}
+		}
+		else
+		{
+			// Someone couldn't take the whole chunk. Consume the
+			// chunk into the bounce buffer and finish it with
+			// blocking writes.
+			size_t iRead = 0;
+
+			if (buff == NULL)
+				buff = malloc(CHUNK_SIZE);
+
+			while (iRead < (size_t) n)
+			{
+				ssize_t m = read(fdProducer, buff + iRead, n - iRead);
+
+				if ((m < 0) && (errno == EINTR))
+					continue;
+				if (m <= 0)
+					break;
+				iRead += m;
+			}
+
+			sent[iLast] = 0;
+
+			for (i = iFirst + 1; i <= iLast; ++i)
+			{
+				if (fdConsumers[i] < 0)
+					continue;
+
+				while (sent[i] < iRead)
+				{
+					ssize_t m = write(fdConsumers[i], buff + sent[i], iRead - sent[i]);
+
+					if ((m < 0) && (errno == EINTR))
+						continue;
+
+					if (m <= 0)
+					{
+						close(fdConsumers[i]);
+						fdConsumers[i] = -1;
+						break;
+					}
+
+					sent[i] += m;
+				}
+			}
+		}
+
+		iTotal += n;
+	}
+
+	// EOF, let the consumers see it too.
+	for (i = 0; i < iNumConsumers; ++i)
+	{
+		if (fdConsumers[i] >= 0)
+		{
+			close(fdConsumers[i]);
+			fdConsumers[i] = -1;
+		}
+	}
+
+	free(buff);
+
+	return iTotal;
+}
+
+// executeFanOut() function is used to execute a command with
+// the || or ||| fan-out operator in it. This command looks like:
+// 			ls -l || wc -w, grep abc, wc -l
+// i.e. the output of the first command before the operator is
+// passed as input to every one of the comma-separated commands
+// after it. There may be any number of them.
+//
+// The producer and all the consumers are started together, each
+// consumer reading from a pipe of its own. The shell then streams
+// the producer's output into all those pipes at once, using
+// pumpFanOutTee() where the kernel supports it and pumpFanOutRing()
+// otherwise, so the output is neither truncated nor serialized.
+// If a pipe can't be created, the whole line is given up.
+void executeFanOut(CommandLine *cmdLine, Job *job)
+{
+	int iNumCommands = cmdLine->iNumCommands;
+	int i;
+
+	int iNumConsumers = iNumCommands - 1;
+	pid_t *pids = arenaAlloc(&commandArena, iNumCommands * sizeof(pid_t));
+	int *fdConsumers = arenaAlloc(&commandArena, iNumConsumers * sizeof(int));
+	int p[2];
+
+	// All the pipes are close-on-exec, so no child keeps
+	// another consumer's pipe open after dup2().
+	if (pipe2(p, O_CLOEXEC) < 0)
+	{
+		perror("pipe() error: ");
+		abortJobLaunch(job, iNumCommands);
+		return;
+	}
+
+	pids[0] = executeSingleCommand(&cmdLine->commands[0], STDIN_FILENO, p[1], -1, job);
+	close(p[1]);
+
+	for (i = 0; i < iNumConsumers; ++i)
+	{
+		int c[2];
+
+		if (pipe2(c, O_CLOEXEC) < 0)
+		{
+			// Without all its consumers the
+			// producer's output can't be copied
+			perror("pipe() error: ");
+
+			while (--i >= 0)
+				if (fdConsumers[i] >= 0)
+					close(fdConsumers[i]);
+
+			close(p[0]);
+			abortJobLaunch(job, iNumCommands);
+			return;
+		}
+
+		pids[i + 1] = executeSingleCommand(&cmdLine->commands[i + 1], c[0], STDOUT_FILENO, -1, job);
+		close(c[0]);
+
+		fdConsumers[i] = (pids[i + 1] > 0) ? c[1] : -1;
+		if (pids[i + 1] <= 0)
+			close(c[1]);
+	}
+
+	// A consumer may exit before reading everything. Writing
+	// to its pipe must then fail with EPIPE rather than kill
+	// the shell. The children are already started, so they
+	// keep the default SIGPIPE behaviour.
+	void (*oldHandler)(int) = signal(SIGPIPE, SIG_IGN);
+	double startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+	int iUseTee = 1;
+	long long iNumBytes = pumpFanOutTee(p[0], fdConsumers, iNumConsumers);
+
+	if (iNumBytes < 0)
+	{
+		iUseTee = 0;
+		iNumBytes = pumpFanOutRing(p[0], fdConsumers, iNumConsumers);
+	}
+
+	signal(SIGPIPE, oldHandler);
+	close(p[0]);
+
+	if (fdTrace >= 0)
+	{
+		TraceArgs args;
+
+		initTraceArgs(&args);
+		addTraceNumber(&args, "job", job->iId);
+		addTraceNumber(&args, "consumers", iNumConsumers);
+		addTraceNumber(&args, "bytes", iNumBytes);
+		addTraceNumber(&args, "tee", iUseTee);
+		traceEvent("fan-out copy", startTime, getMonotonicTime(), getpid(), &args);
+	}
+}
+
+// initCommandHistory() function sets up an empty command
+// history. Its capacity is read from the HISTSIZE
+// environment variable.
+void initCommandHistory()
+{
+	const char *histSize = getVariable("HISTSIZE");
+	int iCapacity = histSize ? atoi(histSize) : DEFAULT_HISTSIZE;
+
+	if (iCapacity <= 0)
+		iCapacity = DEFAULT_HISTSIZE;
+
+	cmdHistory.entries = malloc(iCapacity * sizeof(HistoryEntry));
+	cmdHistory.iCapacity = iCapacity;
+	cmdHistory.iFirst = 0;
+	cmdHistory.iCount = 0;
+	cmdHistory.iArenaSize = 4096;
+	cmdHistory.arena = malloc(cmdHistory.iArenaSize);
+	cmdHistory.iArenaUsed = 0;
+	cmdHistory.iArenaLive = 0;
+}
+
+// getHistoryEntry() function returns the i-th oldest
+// command kept in the history (i starts from 0).
+HistoryEntry* getHistoryEntry(int i)
+{
+	return &cmdHistory.entries[(cmdHistory.iFirst + i) % cmdHistory.iCapacity];
+}
+
+// findHistoryEntry() function returns the history entry
+// with the given sequence number, or NULL if it has never
+// been used or has already dropped out of the history.
+HistoryEntry* findHistoryEntry(int iSequenceNo)
+{
+	if (cmdHistory.iCount == 0)
+		return NULL;
+
+	int i = iSequenceNo - getHistoryEntry(0)->iSequenceNo;
+
+	if ((i < 0) || (i >= cmdHistory.iCount))
+		return NULL;
+
+	return getHistoryEntry(i);
+}
+
+// getHistoryText() function returns the text of the
+// command stored in the given history entry.
+char* getHistoryText(HistoryEntry *entry)
+{
+	return cmdHistory.arena + entry->iOffset;
+}
+
+// reserveHistoryArena() function makes sure "iNeeded"
+// more bytes can be appended to the history arena.
+// The arena only holds commands in the order they were
+// entered, so when it is full and at least half of it
+// belongs to commands that have dropped out of the ring,
+// the live commands are slid down to the start. Otherwise
+// it is doubled. Either way the work is paid for by the
+// bytes appended since the last time, so appending is
+// O(1) amortized.
+void reserveHistoryArena(size_t iNeeded)
+{
+	int i;
+
+	if (cmdHistory.iArenaUsed + iNeeded <= cmdHistory.iArenaSize)
+		return;
+
+	if (cmdHistory.iArenaLive + iNeeded <= cmdHistory.iArenaSize / 2)
+	{
+		size_t iOffset = 0;
+
+		for (i = 0; i < cmdHistory.iCount; ++i)
+		{
+			HistoryEntry *entry = getHistoryEntry(i);
+
+			memmove(cmdHistory.arena + iOffset, getHistoryText(entry), entry->iLength + 1);
+			entry->iOffset = iOffset;
+			iOffset += entry->iLength + 1;
+		}
+
+		cmdHistory.iArenaUsed = iOffset;
+		return;
+	}
+
+	while (cmdHistory.iArenaUsed + iNeeded > cmdHistory.iArenaSize)
+		cmdHistory.iArenaSize *= 2;
+
+	cmdHistory.arena = realloc(cmdHistory.arena, cmdHistory.iArenaSize);
+}
+
+// compactHistoryFile() function rewrites the history file
+// at "path" keeping only the newest occurrence of every
+// command, and at most "iMaxLines" commands. It takes an
+// exclusive lock on the file, which every appender also
+// takes (shared) around its write, so no command is lost,
+// and replaces the file atomically with rename(). It only
+// rewrites the file if that saves a good amount of space.
+// This is run in a background process, see
+// startHistoryCompaction().
+void compactHistoryFile(const char *path, int iMaxLines)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return;
+
+	if ((flock(fd, LOCK_EX) < 0) || (fstat(fd, &st) < 0) ||
+		(st.st_nlink == 0) || (st.st_size == 0))
+	{
+		// Another session has just replaced the file.
+		close(fd);
+		return;
+	}
+
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return;
+	}
+
+	// Find the start of every line
+	int iNumLines = 0;
+	int iAllocated = 1024;
+	size_t *starts = malloc(iAllocated * sizeof(size_t));
+	size_t iPos = 0;
+
+	while (iPos < (size_t) st.st_size)
+	{
+		char *nl = memchr(map + iPos, '\n', st.st_size - iPos);
+
+		if (nl == NULL)
+			break;
+
+		if (iNumLines == iAllocated)
+		{
+			iAllocated *= 2;
+			starts = realloc(starts, iAllocated * sizeof(size_t));
+		}
+
+		starts[iNumLines++] = iPos;
+		iPos = (nl - map) + 1;
+	}
+
+	// Walk from the newest command to the oldest one and
+	// keep each command the first time it is seen, using
+	// an open addressing set of line numbers.
+	int iSetSize = 1;
+	while (iSetSize < 2 * iNumLines)
+		iSetSize *= 2;
+
+	int *set = malloc(iSetSize * sizeof(int));
+	char *keep = calloc(iNumLines ? iNumLines : 1, 1);
+	int iNumKept = 0;
+	int i;
+
+	memset(set, -1, iSetSize * sizeof(int));
+
+	for (i = iNumLines - 1; (i >= 0) && (iNumKept < iMaxLines); --i)
+	{
+		size_t iLen = ((i + 1 < iNumLines) ? starts[i + 1] : iPos) - starts[i];
+		unsigned int h = 2166136261u;
+		size_t k;
+
+		for (k = 0; k < iLen; ++k)
+		{
+			h ^= (unsigned char) map[starts[i] + k];
+			h *= 16777619u;
+		}
+
+		unsigned int iSlot = h & (iSetSize - 1);
+		int iDuplicate = 0;
+
+		while (set[iSlot] >= 0)
+		{
+			int j = set[iSlot];
+			size_t jLen = ((j + 1 < iNumLines) ? starts[j + 1] : iPos) - starts[j];
+
+			if ((jLen == iLen) && (memcmp(map + starts[j], map + starts[i], iLen) == 0))
+			{
+				iDuplicate = 1;
+				break;
+			}
+
+			iSlot = (iSlot + 1) & (iSetSize - 1);
+		}
+
+		if (!iDuplicate)
+		{
+			set[iSlot] = i;
+			keep[i] = 1;
+			iNumKept++;
+		}
+	}
+
+	// Only rewrite the file if at least a quarter
+	// of the commands go away.
+	if (iNumKept <= iNumLines - (iNumLines / 4))
+	{
+		char *tmpPath = malloc(strlen(path) + 32);
+		sprintf(tmpPath, "%s.tmp.%d", path, (int) getpid());
+
+		int fdTmp = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+		FILE *out = (fdTmp >= 0) ? fdopen(fdTmp, "w") : NULL;
+
+		if (out != NULL)
+		{
+			for (i = 0; i < iNumLines; ++i)
+			{
+				if (keep[i])
+					fwrite(map + starts[i], 1, ((i + 1 < iNumLines) ? starts[i + 1] : iPos) - starts[i], out);
+			}
+
+			if ((fflush(out) == 0) && (fsync(fdTmp) == 0))
+				rename(tmpPath, path);
+			else
+				unlink(tmpPath);
+
+			fclose(out);
+		}
+
+		free(tmpPath);
+	}
+
+	free(starts);
+	free(set);
+	free(keep);
+	munmap(map, st.st_size);
+	close(fd);		// this also releases the lock
+}
+
+// startHistoryCompaction() function runs compactHistoryFile()
+// in a background process so the shell doesn't wait for it.
+// The process is detached with a double fork, so it never
+// shows up as a child of the shell.
+void startHistoryCompaction()
+{
+	const char *histFileSize = getVariable("HISTFILESIZE");
+	int iMaxLines = histFileSize ? atoi(histFileSize) : DEFAULT_HISTFILESIZE;
+
+	if (iMaxLines <= 0)
+		iMaxLines = DEFAULT_HISTFILESIZE;
+
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		if (fork() == 0)
+		{
+			compactHistoryFile(histFile.path, iMaxLines);
+			_exit(0);
+		}
+
+		_exit(0);
+	}
+
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+// initHistoryFile() function opens the history file, given by
+// the HISTFILE environment variable or ~/.cshell_history, and
+// maps it into memory. Nothing is read here, so startup costs
+// the same however long the history is. If the file has grown
+// big, a background compaction is started.
+void initHistoryFile()
+{
+	const char *histFilePath = getVariable("HISTFILE");
+	struct stat st;
+
+	memset(&histFile, 0, sizeof(HistoryFile));
+	histFile.fd = -1;
+
+	if (histFilePath == NULL)
+	{
+		const char *home = getVariable("HOME");
+
+		if (home == NULL)
+			return;
+
+		histFile.path = malloc(strlen(home) + 32);
+		sprintf(histFile.path, "%s/.cshell_history", home);
+	}
+	else if (histFilePath[0] != '\0')
+	{
+		histFile.path = strdup(histFilePath);
+	}
+	else
+	{
+		// HISTFILE is set to empty, don't keep
+		// the history in a file at all.
+		return;
+	}
+
+	histFile.fd = open(histFile.path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0600);
+
+	if (histFile.fd < 0)
+		return;
+
+	int fd = open(histFile.path, O_RDONLY | O_CLOEXEC);
+
+	if ((fd >= 0) && (fstat(fd, &st) == 0) && (st.st_size > 0))
+	{
+		histFile.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (histFile.map == MAP_FAILED)
+			histFile.map = NULL;
+		else
+			histFile.iMapSize = st.st_size;
+
+		if (st.st_size >= HISTORY_COMPACT_MIN_BYTES)
+			startHistoryCompaction();
+	}
+
+	if (fd >= 0)
+		close(fd);
+}
+
+// indexHistoryFile() function finds the start of every
+// line of the mapped history file. It is only done the
+// first time an old command is needed by number, since
+// it has to go over the whole file.
+void indexHistoryFile()
+{
+	int iAllocated = 1024;
+	size_t iPos = 0;
+
+	if (histFile.iIndexed)
+		return;
+
+	histFile.iIndexed = 1;
+	histFile.lineOffsets = malloc(iAllocated * sizeof(size_t));
+
+	while (iPos < histFile.iMapSize)
+	{
+		char *nl = memchr(histFile.map + iPos, '\n', histFile.iMapSize - iPos);
+
+		// A partly written last line is ignored
+		if (nl == NULL)
+			break;
+
+		if (histFile.iNumLines == iAllocated)
+		{
+			iAllocated *= 2;
+			histFile.lineOffsets = realloc(histFile.lineOffsets, iAllocated * sizeof(size_t));
+		}
+
+		histFile.lineOffsets[histFile.iNumLines++] = iPos;
+		iPos = (nl - histFile.map) + 1;
+	}
+}
+
+// getHistoryFileCount() function returns the number of
+// commands from earlier sessions, which is also the offset
+// of the sequence numbers of this session's commands. It
+// indexes the whole file, so it is only used for lookups
+// by absolute number.
+int getHistoryFileCount()
+{
+	indexHistoryFile();
+	return histFile.iNumLines;
+}
+
+// appendToHistoryFile() function adds a command at the end
+// of the history file with a single write(). The file is
+// opened with O_APPEND, so concurrent sessions never
+// overwrite each other's commands. A shared lock is held
+// during the write so that it can't happen while a
+// compaction is copying the file. If a compaction has
+// replaced the file since we opened it, the new file is
+// opened first.
+void appendToHistoryFile(char *command)
+{
+	size_t iLength = strlen(command);
+	struct stat st;
+
+	if ((histFile.fd < 0) || (iLength == 0))
+		return;
+
+	while (1)
+	{
+		flock(histFile.fd, LOCK_SH);
+
+		if ((fstat(histFile.fd, &st) == 0) && (st.st_nlink == 0))
+		{
+			close(histFile.fd);
+			histFile.fd = open(histFile.path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0600);
+
+			if (histFile.fd < 0)
+				return;
+
+			continue;
+		}
+
+		break;
+	}
+
+	if (command[iLength - 1] == '\n')
+	{
+		write(histFile.fd, command, iLength);
+	}
+	else
+	{
+		// Every command has to end up on a line of its own.
+		struct iovec iov[2] = { { command, iLength }, { "\n", 1 } };
+		writev(histFile.fd, iov, 2);
+	}
+
+	flock(histFile.fd, LOCK_UN);
+}
+
+// getHistoryFileLineRef() function returns a pointer to
+// line "iLineNo" (starting from 1) inside the mapped history
+// file, without copying it. Its length without the newline
+// is stored in "pLength".
+const char* getHistoryFileLineRef(int iLineNo, size_t *pLength)
+{
+	size_t iStart = histFile.lineOffsets[iLineNo - 1];
+	char *end = memchr(histFile.map + iStart, '\n', histFile.iMapSize - iStart);
+
+	*pLength = end - (histFile.map + iStart);
+	return histFile.map + iStart;
+}
+
+// getHistoryFileLineFromEnd() function returns a pointer to
+// the "iFromEnd"-th line (1 for the last one) of the mapped
+// history file, and its length without the newline in
+// "pLength", or NULL if the file has fewer lines. Unless the
+// whole file has been indexed already, only the lines up to
+// that one are looked for, backwards from the end.
+const char* getHistoryFileLineFromEnd(int iFromEnd, size_t *pLength)
+{
+	size_t iStart;
+
+	if (histFile.iIndexed)
+		return ((iFromEnd >= 1) && (iFromEnd <= histFile.iNumLines)) ?
+			getHistoryFileLineRef(histFile.iNumLines + 1 - iFromEnd, pLength) : NULL;
+
+	if ((iFromEnd < 1) || (histFile.map == NULL))
+		return NULL;
+
+	if (!histFile.iTailStarted)
+	{
+		// A partly written last line is ignored,
+		// as indexHistoryFile() does
+		char *nl = memrchr(histFile.map, '\n', histFile.iMapSize);
+
+		histFile.iTailStarted = 1;
+		histFile.iTailAllocated = 64;
+		histFile.tailOffsets = malloc(histFile.iTailAllocated * sizeof(size_t));
+
+		// The line ending there is found below,
+		// like any line before another one
+		histFile.tailOffsets[0] = nl ? (nl - histFile.map) + 1 : 0;
+	}
+
+	// tailOffsets[iNumTail] is the start of the line after
+	// the ones found so far, whose newline ends the next one
+	while ((histFile.iNumTail < iFromEnd) && (histFile.tailOffsets[histFile.iNumTail] > 0))
+	{
+		size_t iEnd = histFile.tailOffsets[histFile.iNumTail] - 1;
+		char *nl = memrchr(histFile.map, '\n', iEnd);
+
+		if (histFile.iNumTail + 1 == histFile.iTailAllocated)
+		{
+			histFile.iTailAllocated *= 2;
+			histFile.tailOffsets = realloc(histFile.tailOffsets, histFile.iTailAllocated * sizeof(size_t));
+		}
+
+		histFile.tailOffsets[histFile.iNumTail + 1] = nl ? (nl - histFile.map) + 1 : 0;
+		histFile.iNumTail++;
+	}
+
+	if (histFile.iNumTail < iFromEnd)
+		return NULL;
+
+	iStart = histFile.tailOffsets[iFromEnd];
+	*pLength = histFile.tailOffsets[iFromEnd - 1] - 1 - iStart;
+
+	return histFile.map + iStart;
+}
+
+// TrigramPostings structure type is one slot of a
+// TrigramIndex. It holds, in increasing order, the
+// numbers of all the history commands containing
+// the trigram (the three bytes) in iKey.
+typedef struct
+{
+	unsigned int iKey;				// the trigram, 0 if this slot is free
+	int iCount;						// number of entries in ids
+	int iAllocated;					// allocated size of ids
+	int *ids;						// history numbers, in increasing order
+} TrigramPostings;
+
+// TrigramIndex structure type is an open addressing hash
+// table from every trigram that appears in the history to
+// the commands containing it, used by Ctrl-R search.
+typedef struct
+{
+	TrigramPostings *slots;			// hash table, iSize is a power of two
+	int iSize;						// number of slots
+	int iUsed;						// number of slots in use
+	long iNumIds;					// number of ids in all the lists
+	long iPruneAt;					// iNumIds at which pruneTrigramIndex() is due
+} TrigramIndex;
+
+// Fewest ids an index holds before the ids of the commands
+// that have left the history are pruned
+#define TRIGRAM_PRUNE_MIN 65536
+
+// Index of the commands of this session, by their
+// sequence number in the session. It is kept up to
+// date by insertIntoCommandHistory().
+TrigramIndex sessionTrigrams;
+
+// Index of the lines of the history file, by line
+// number. It is built on the first Ctrl-R.
+TrigramIndex fileTrigrams;
+
+// trigramKey() function returns the key of the
+// trigram starting at "p".
+unsigned int trigramKey(const char *p)
+{
+	return ((unsigned char) p[0] << 16) | ((unsigned char) p[1] << 8) | (unsigned char) p[2];
+}
+
+// placeTrigram() function puts "postings" into a free
+// slot of the table of "index", which must not hold its
+// trigram yet. It is used when the table is rebuilt.
+void placeTrigram(TrigramIndex *index, TrigramPostings *postings)
+{
+	unsigned int iSlot = (postings->iKey * 2654435761u) & (index->iSize - 1);
+
+	while (index->slots[iSlot].iKey != 0)
+		iSlot = (iSlot + 1) & (index->iSize - 1);
+
+	index->slots[iSlot] = *postings;
+}
+
+// findTrigram() function returns the slot for "iKey"
+// in the given index. If the trigram isn't there, a
+// new empty slot is returned when "iCreate" is 1, and
+// NULL otherwise.
+TrigramPostings* findTrigram(TrigramIndex *index, unsigned int iKey, int iCreate)
+{
+	unsigned int iSlot;
+
+	if (index->iSize == 0)
+	{
+		if (!iCreate)
+			return NULL;
+
+		index->iSize = 1024;
+		index->slots = calloc(index->iSize, sizeof(TrigramPostings));
+	}
+
+	if (iCreate && (index->iUsed * 10 >= index->iSize * 7))
+	{
+		// Keep the table at most 70% full
+		TrigramPostings *old = index->slots;
+		int iOldSize = index->iSize;
+		int i;
+
+		index->iSize *= 2;
+		index->slots = calloc(index->iSize, sizeof(TrigramPostings));
+
+		for (i = 0; i < iOldSize; ++i)
+			if (old[i].iKey != 0)
+				placeTrigram(index, &old[i]);
+
+		free(old);
+	}
+
+	iSlot = (iKey * 2654435761u) & (index->iSize - 1);
+
+	while (index->slots[iSlot].iKey != 0)
+	{
+		if (index->slots[iSlot].iKey == iKey)
+			return &index->slots[iSlot];
+
+		iSlot = (iSlot + 1) & (index->iSize - 1);
+	}
+
+	if (!iCreate)
+		return NULL;
+
+	index->slots[iSlot].iKey = iKey;
+	index->iUsed++;
+	return &index->slots[iSlot];
+}
+
+// addToTrigramIndex() function adds the history command
+// "id" with the given text to the index. Ids must be
+// added in increasing order, so every list stays sorted
+// and adding is just an append to each list.
+void addToTrigramIndex(TrigramIndex *index, int id, const char *text, size_t iLength)
+{
+	size_t i;
+
+	while ((iLength > 0) && (text[iLength - 1] == '\n'))
+		iLength--;
+
+	for (i = 0; i + 3 <= iLength; ++i)
+	{
+		TrigramPostings *postings = findTrigram(index, trigramKey(text + i), 1);
+
+		// A trigram repeated in the same command
+		// is only recorded once.
+		if ((postings->iCount > 0) && (postings->ids[postings->iCount - 1] == id))
+			continue;
+
+		if (postings->iCount == postings->iAllocated)
+		{
+			postings->iAllocated = postings->iAllocated ? postings->iAllocated * 2 : 4;
+			postings->ids = realloc(postings->ids, postings->iAllocated * sizeof(int));
+		}
+
+		postings->ids[postings->iCount++] = id;
+		index->iNumIds++;
+	}
+}
+
+// findLastBelow() function returns the position of the last
+// id in the sorted list "ids[0..iCount-1]" which is less than
+// or equal to "id", or -1 if there is none.
+int findLastBelow(int *ids, int iCount, int id)
+{
+	int lo = 0;
+	int hi = iCount;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (ids[mid] <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+// pruneTrigramIndex() function removes the ids below
+// "iOldest", i.e. the commands that have dropped out of
+// the history, from the front of every list of "index".
+// The trigrams left without any command are removed too,
+// and the table is rebuilt for the ones that remain. The
+// next pruning is due once the index has doubled again,
+// so the index stays within twice the size the commands
+// in the history need, at a constant cost per command.
+void pruneTrigramIndex(TrigramIndex *index, int iOldest)
+{
+	TrigramPostings *old = index->slots;
+	int iOldSize = index->iSize;
+	int i;
+
+	index->iUsed = 0;
+	index->iNumIds = 0;
+
+	for (i = 0; i < iOldSize; ++i)
+	{
+		TrigramPostings *postings = &old[i];
+		int iStale;
+
+		if (postings->iKey == 0)
+			continue;
+
+		iStale = findLastBelow(postings->ids, postings->iCount, iOldest - 1) + 1;
+		postings->iCount -= iStale;
+
+		if (postings->iCount == 0)
+		{
+			free(postings->ids);
+			postings->iKey = 0;
+			continue;
+		}
+
+		memmove(postings->ids, postings->ids + iStale, postings->iCount * sizeof(int));
+
+		if (postings->iCount * 4 <= postings->iAllocated)
+		{
+			postings->iAllocated = postings->iCount * 2;
+			postings->ids = realloc(postings->ids, postings->iAllocated * sizeof(int));
+		}
+
+		index->iUsed++;
+		index->iNumIds += postings->iCount;
+	}
+
+	// Keep the table at most 70% full, as findTrigram() does
+	index->iSize = 1024;
+
+	while (index->iUsed * 10 >= index->iSize * 7)
+		index->iSize *= 2;
+
+	index->slots = calloc(index->iSize, sizeof(TrigramPostings));
+
+	for (i = 0; i < iOldSize; ++i)
+		if (old[i].iKey != 0)
+			placeTrigram(index, &old[i]);
+
+	free(old);
+
+	index->iPruneAt = (2 * index->iNumIds > TRIGRAM_PRUNE_MIN) ? 2 * index->iNumIds : TRIGRAM_PRUNE_MIN;
+}
+
+// buildFileTrigrams() function indexes all the lines of
+// the history file the first time they are searched.
+void buildFileTrigrams()
+{
+	static int iBuilt = 0;
+	int i;
+
+	if (iBuilt)
+		return;
+
+	iBuilt = 1;
+	indexHistoryFile();
+
+	for (i = 1; i <= histFile.iNumLines; ++i)
+	{
+		size_t iLength;
+		const char *text = getHistoryFileLineRef(i, &iLength);
+
+		addToTrigramIndex(&fileTrigrams, i, text, iLength);
+	}
+}
+
+// getSessionCommandRef() function returns the text of
+// the command of this session with the given sequence
+// number, or NULL if it is no longer kept. Its length
+// without the newline is stored in "pLength".
+const char* getSessionCommandRef(int iSequenceNo, size_t *pLength)
+{
+	HistoryEntry *entry = findHistoryEntry(iSequenceNo);
+
+	if (entry == NULL)
+		return NULL;
+
+	*pLength = entry->iLength;
+	if ((entry->iLength > 0) && (getHistoryText(entry)[entry->iLength - 1] == '\n'))
+		(*pLength)--;
+
+	return getHistoryText(entry);
+}
+
+// searchTrigramIndex() function finds the newest command in
+// "index" older than "iBefore" which contains "query", and
+// returns its id, or 0 if there is none. "getText" returns
+// the text of a command by id. With a query of three bytes or
+// more, the candidates are the ids present in the lists of all
+// of its trigrams. They are found by walking the shortest list
+// from the newest end and looking each id up in the others by
+// binary search, and only those are compared with the query.
+// Shorter queries fall back to checking every command.
+int searchTrigramIndex(TrigramIndex *index, const char *query, int iBefore, int iOldest,
+					   const char* (*getText)(int, size_t *))
+{
+	size_t iQueryLength = strlen(query);
+	size_t iLength;
+	const char *text;
+	int id;
+	int i;
+
+	if (iQueryLength < 3)
+	{
+		for (id = iBefore - 1; id >= iOldest; --id)
+		{
+			text = getText(id, &iLength);
+
+			if (text && memmem(text, iLength, query, iQueryLength))
+				return id;
+		}
+
+		return 0;
+	}
+
+	int iNumTrigrams = iQueryLength - 2;
+	TrigramPostings **lists = malloc(iNumTrigrams * sizeof(TrigramPostings *));
+	int *limits = malloc(iNumTrigrams * sizeof(int));
+	int iShortest = 0;
+	int iFound = 0;
+
+	for (i = 0; i < iNumTrigrams; ++i)
+	{
+		lists[i] = findTrigram(index, trigramKey(query + i), 0);
+
+		// Some trigram appears nowhere, so no command
+		// can contain the query.
+		if (lists[i] == NULL)
+		{
+			free(lists);
+			free(limits);
+			return 0;
+		}
+
+		limits[i] = lists[i]->iCount;
+
+		if (lists[i]->iCount < lists[iShortest]->iCount)
+			iShortest = i;
+	}
+
+	TrigramPostings *shortest = lists[iShortest];
+	int k = findLastBelow(shortest->ids, shortest->iCount, iBefore - 1);
+
+	for (; (k >= 0) && !iFound; --k)
+	{
+		int iCandidate = shortest->ids[k];
+		int iInAll = 1;
+
+		if (iCandidate < iOldest)
+			break;
+
+		// Candidates only get older, so each list is only
+		// searched below where the previous lookup ended.
+		for (i = 0; (i < iNumTrigrams) && iInAll; ++i)
+		{
+			if (i == iShortest)
+				continue;
+
+			int j = findLastBelow(lists[i]->ids, limits[i], iCandidate);
+
+			limits[i] = (j >= 0) ? (j + 1) : 0;
+			iInAll = (j >= 0) && (lists[i]->ids[j] == iCandidate);
+		}
+
+		if (!iInAll)
+			continue;
+
+		// All the trigrams are there, but not necessarily
+		// next to each other, so compare the text.
+		text = getText(iCandidate, &iLength);
+
+		if (text && memmem(text, iLength, query, iQueryLength))
+			iFound = iCandidate;
+	}
+
+	free(lists);
+	free(limits);
+
+	return iFound;
+}
+
+// HistoryMatch structure type is used to remember where
+// a Ctrl-R search has got to. Commands of this session
+// are newer than all the lines of the history file, whose
+// lines are counted from its end so that the recent ones
+// can be found without reading the whole file.
+typedef struct
+{
+	int iInFile;					// 1 if the match is a line of the history file
+	int id;							// session sequence number or file line number from the end (1 for the last), 0 if none
+} HistoryMatch;
+
+// getMatchText() function returns the text of a match,
+// and its length without the newline in "pLength".
+const char* getMatchText(HistoryMatch *match, size_t *pLength)
+{
+	if (match->iInFile)
+		return getHistoryFileLineFromEnd(match->id, pLength);
+
+	return getSessionCommandRef(match->id, pLength);
+}
+
+// searchHistory() function finds the newest command
+// containing "query" which is older than "pMatch" (or
+// the newest one overall if pMatch is {0, 0}), and that
+// isn't the same text as "skipText". The result is
+// stored in "pMatch". It returns 1 if a command was
+// found, otherwise pMatch is left as it is.
+int searchHistory(const char *query, HistoryMatch *pMatch, const char *skipText, size_t iSkipLength)
+{
+	HistoryMatch match = *pMatch;
+	size_t iLength;
+
+	if ((match.id == 0) && !match.iInFile)
+	{
+		match.id = (cmdHistory.iCount > 0) ? getHistoryEntry(cmdHistory.iCount - 1)->iSequenceNo + 1 : 1;
+	}
+
+	while (1)
+	{
+		int id = 0;
+
+		if (!match.iInFile)
+		{
+			int iOldest = (cmdHistory.iCount > 0) ? getHistoryEntry(0)->iSequenceNo : 1;
+
+			id = searchTrigramIndex(&sessionTrigrams, query, match.id, iOldest, getSessionCommandRef);
+
+			if (id == 0)
+			{
+				// Continue with the history file, from
+				// after its last line
+				buildFileTrigrams();
+				match.iInFile = 1;
+				match.id = 0;
+				continue;
+			}
+		}
+		else
+		{
+			// The index uses line numbers from the start
+			id = searchTrigramIndex(&fileTrigrams, query, histFile.iNumLines + 1 - match.id, 1, getHistoryFileLineRef);
+
+			if (id == 0)
+				return 0;
+
+			id = histFile.iNumLines + 1 - id;
+		}
+
+		match.id = id;
+
+		const char *text = getMatchText(&match, &iLength);
+
+		// Don't show the same command twice in a row
+		if (skipText && (iLength == iSkipLength) && (memcmp(text, skipText, iLength) == 0))
+			continue;
+
+		*pMatch = match;
+		return 1;
+	}
+}
+
+// LineBuffer structure type holds a growable string,
+// e.g. the line being typed by the user in
+// readLineInteractive().
+typedef struct
+{
+	char *text;						// NUL terminated contents
+	size_t iLength;					// length of text
+	size_t iAllocated;				// allocated size of text
+} LineBuffer;
+
+// reserveLineBuffer() function makes sure "line" has
+// room for "iLength" bytes, plus a newline and a NUL.
+void reserveLineBuffer(LineBuffer *line, size_t iLength)
+{
+	if (iLength + 2 > line->iAllocated)
+	{
+		line->iAllocated = (line->iAllocated * 2 > iLength + 64) ? line->iAllocated * 2 : iLength + 64;
+		line->text = realloc(line->text, line->iAllocated);
+	}
+}
+
+// setLineBuffer() function replaces the contents of
+// "line" with the given text.
+void setLineBuffer(LineBuffer *line, const char *text, size_t iLength)
+{
+	reserveLineBuffer(line, iLength);
+	memmove(line->text, text, iLength);
+	line->text[iLength] = '\0';
+	line->iLength = iLength;
+}
+
+// insertIntoLineBuffer() function inserts "iLength"
+// bytes of "text" into "line" at offset "iPos".
+void insertIntoLineBuffer(LineBuffer *line, size_t iPos, const char *text, size_t iLength)
+{
+	reserveLineBuffer(line, line->iLength + iLength);
+	memmove(line->text + iPos + iLength, line->text + iPos, line->iLength - iPos + 1);
+	memcpy(line->text + iPos, text, iLength);
+	line->iLength += iLength;
+}
+
+// deleteFromLineBuffer() function removes the bytes
+// from offset "iFrom" up to "iTo" from "line".
+void deleteFromLineBuffer(LineBuffer *line, size_t iFrom, size_t iTo)
+{
+	memmove(line->text + iFrom, line->text + iTo, line->iLength - iTo + 1);
+	line->iLength -= iTo - iFrom;
+}
+
+// appendToLineBuffer() function adds one character
+// at the end of "line".
+void appendToLineBuffer(LineBuffer *line, char c)
+{
+	insertIntoLineBuffer(line, line->iLength, &c, 1);
+}
+
+// EditorKey enum type is used for the keys that the
+// terminal sends as escape sequences. Plain keys are
+// passed around as their byte value.
+enum EditorKey
+{
+	Key_Up = 256,			// up arrow, the previous command of the history
+	Key_Down,				// down arrow, the next command of the history
+	Key_Left,				// left arrow
+	Key_Right,				// right arrow
+	Key_Home,				// Home, the start of the line
+	Key_End,				// End, the end of the line
+	Key_Delete,				// Delete, the character under the cursor
+	Key_Word_Left,			// Alt-b or Ctrl-left arrow
+	Key_Word_Right,			// Alt-f or Ctrl-right arrow
+	Key_Kill_Word,			// Alt-d, the word after the cursor
+	Key_Kill_Word_Back,		// Alt-Backspace, the word before the cursor
+	Key_Unknown				// any other escape sequence, ignored
+};
+
+// LineEditor structure type holds the state of the line
+// editor of readLineInteractive(). It remembers where the
+// cursor of the terminal is and how far the shown text
+// goes, so that a key only writes what it changed. Output
+// is collected and written at once when there is no more
+// input to handle, so a key costs at most one write(), and
+// keys that arrive together (pasted text, or a slow link
+// that delivers several at once) share a single write().
+typedef struct
+{
+	LineBuffer line;				// the line being edited
+	size_t iCursor;					// byte offset of the cursor in the line
+	const char *prompt;				// the prompt, shown before the line
+	size_t iPromptWidth;			// columns taken by the prompt
+	size_t iColumns;				// width of the terminal
+	size_t iScreenCursor;			// column of the terminal cursor, counted from the start of the prompt
+	size_t iScreenEnd;				// column where the text shown on the terminal ends
+	LineBuffer out;					// output not written to the terminal yet
+	unsigned char input[256];		// bytes read from the terminal and not handled yet
+	size_t iInputPos;				// next byte to handle in input
+	size_t iInputLength;			// number of bytes in input
+	LineBuffer kill;				// text of the last kill, for Ctrl-Y
+	int iLastKey;					// key handled before the current one
+} LineEditor;
+
+// The line editor of the shell. Its buffers are
+// kept from one line to the next.
+LineEditor editor;
+
+// getTextWidth() function returns the number of terminal
+// columns "iLength" bytes of "text" take. UTF-8 continuation
+// bytes take no room, and neither do escape sequences like
+// colours in the prompt.
+size_t getTextWidth(const char *text, size_t iLength)
+{
+	size_t iWidth = 0;
+	size_t i;
+
+	for (i = 0; i < iLength; ++i)
+	{
+		unsigned char c = text[i];
+
+		if ((c == '\033') && (i + 1 < iLength) && (text[i + 1] == '['))
+		{
+			for (i += 2; (i < iLength) && ((text[i] < 64) || (text[i] > 126)); ++i)
+				;
+			continue;
+		}
+
+		if ((c & 0xC0) != 0x80)
+			iWidth++;
+	}
+
+	return iWidth;
+}
+
+// addEditorOutput() function queues "iLength" bytes of
+// "text" to be written to the terminal.
+void addEditorOutput(LineEditor *ed, const char *text, size_t iLength)
+{
+	insertIntoLineBuffer(&ed->out, ed->out.iLength, text, iLength);
+}
+
+// flushEditorOutput() function writes the queued
+// output to the terminal.
+void flushEditorOutput(LineEditor *ed)
+{
+	size_t iDone = 0;
+
+	while (iDone < ed->out.iLength)
+	{
+		ssize_t n = write(STDOUT_FILENO, ed->out.text + iDone, ed->out.iLength - iDone);
+
+		if ((n < 0) && (errno == EINTR))
+			continue;
+
+		if (n <= 0)
+			break;
+
+		iDone += n;
+	}
+
+	ed->out.iLength = 0;
+}
+
+// getEditorColumn() function returns the column at which
+// the byte "iPos" of the line is shown, counted from the
+// start of the prompt.
+size_t getEditorColumn(LineEditor *ed, size_t iPos)
+{
+	return ed->iPromptWidth + getTextWidth(ed->line.text, iPos);
+}
+
+// moveScreenCursor() function moves the terminal cursor to
+// "iColumn", counted from the start of the prompt, which
+// may be on a later row if the line is wider than the
+// terminal. It uses the shortest sequence it can, a
+// single backspace for the common step to the left.
+void moveScreenCursor(LineEditor *ed, size_t iColumn)
+{
+	size_t iFromRow = ed->iScreenCursor / ed->iColumns;
+	size_t iFromCol = ed->iScreenCursor % ed->iColumns;
+	size_t iToRow = iColumn / ed->iColumns;
+	size_t iToCol = iColumn % ed->iColumns;
+	char sequence[32];
+
+	if (iColumn == ed->iScreenCursor)
+		return;
+
+	if (iToRow < iFromRow)
+		addEditorOutput(ed, sequence, sprintf(sequence, "\033[%zuA", iFromRow - iToRow));
+	else if (iToRow > iFromRow)
+		addEditorOutput(ed, sequence, sprintf(sequence, "\033[%zuB", iToRow - iFromRow));
+
+	if (iToCol == iFromCol)
+		;
+	else if (iToCol == 0)
+		addEditorOutput(ed, "\r", 1);
+	else if (iToCol + 1 == iFromCol)
+		addEditorOutput(ed, "\b", 1);
+	else if (iToCol < iFromCol)
+		addEditorOutput(ed, sequence, sprintf(sequence, "\033[%zuD", iFromCol - iToCol));
+	else
+		addEditorOutput(ed, sequence, sprintf(sequence, "\033[%zuC", iToCol - iFromCol));
+
+	ed->iScreenCursor = iColumn;
+}
+
+// wrapScreenCursor() function is called after text has been
+// written up to the right edge of the terminal. The cursor
+// then waits at the last column until the next character,
+// so it is moved to the start of the next row explicitly.
+void wrapScreenCursor(LineEditor *ed)
+{
+	if ((ed->iScreenCursor > 0) && (ed->iScreenCursor % ed->iColumns == 0))
+		addEditorOutput(ed, "\r\n", 2);
+}
+
+// redrawFrom() function brings the terminal up to date
+// after the line has changed from byte "iFrom" on: only
+// the rest of the line is written again, whatever the old
+// text left behind is cleared, and the cursor is put where
+// it belongs. Typing at the end of the line thus writes
+// just the character typed.
+void redrawFrom(LineEditor *ed, size_t iFrom)
+{
+	size_t iEnd = getEditorColumn(ed, ed->line.iLength);
+
+	moveScreenCursor(ed, getEditorColumn(ed, iFrom));
+
+	if (iFrom < ed->line.iLength)
+	{
+		addEditorOutput(ed, ed->line.text + iFrom, ed->line.iLength - iFrom);
+		ed->iScreenCursor = iEnd;
+		wrapScreenCursor(ed);
+	}
+
+	if (iEnd < ed->iScreenEnd)
+		addEditorOutput(ed, "\033[J", 3);
+
+	ed->iScreenEnd = iEnd;
+	moveScreenCursor(ed, getEditorColumn(ed, ed->iCursor));
+}
+
+// showEditorPrompt() function writes the prompt at
+// the start of the current row of the terminal.
+void showEditorPrompt(LineEditor *ed)
+{
+	addEditorOutput(ed, ed->prompt, strlen(ed->prompt));
+	ed->iScreenCursor = ed->iPromptWidth;
+	ed->iScreenEnd = ed->iPromptWidth;
+	wrapScreenCursor(ed);
+}
+
+// redrawEditor() function draws the prompt and the
+// whole line again, from the current row down.
+void redrawEditor(LineEditor *ed)
+{
+	addEditorOutput(ed, "\r\033[J", 4);
+	showEditorPrompt(ed);
+	redrawFrom(ed, 0);
+}
+
+// insertEditorText() function inserts text at the cursor.
+void insertEditorText(LineEditor *ed, const char *text, size_t iLength)
+{
+	size_t iFrom = ed->iCursor;
+
+	insertIntoLineBuffer(&ed->line, ed->iCursor, text, iLength);
+	ed->iCursor += iLength;
+	redrawFrom(ed, iFrom);
+}
+
+// deleteEditorText() function deletes the bytes from
+// "iFrom" up to "iTo" and leaves the cursor at "iFrom".
+// The deleted text is saved for Ctrl-Y if "iKill" is
+// set. Kills right after each other are joined into
+// one text, like in other shells.
+void deleteEditorText(LineEditor *ed, size_t iFrom, size_t iTo, int iKill)
+{
+	if (iFrom >= iTo)
+		return;
+
+	if (iKill)
+	{
+		int iJoin = (ed->iLastKey == Key_Kill_Word) || (ed->iLastKey == Key_Kill_Word_Back) ||
+					(ed->iLastKey == 11) || (ed->iLastKey == 21) || (ed->iLastKey == 23);
+
+		if (!iJoin)
+			setLineBuffer(&ed->kill, "", 0);
+
+		// A kill backwards goes in front of the
+		// text killed before, one forwards after it
+		insertIntoLineBuffer(&ed->kill, (iFrom < ed->iCursor) ? 0 : ed->kill.iLength,
+							 ed->line.text + iFrom, iTo - iFrom);
+	}
+
+	deleteFromLineBuffer(&ed->line, iFrom, iTo);
+	ed->iCursor = iFrom;
+	redrawFrom(ed, iFrom);
+}
+
+// replaceEditorLine() function replaces the whole line,
+// e.g. with a command of the history, and puts the cursor
+// at its end. The start the old and the new line have in
+// common stays on the terminal as it is.
+void replaceEditorLine(LineEditor *ed, const char *text, size_t iLength)
+{
+	size_t iSame = 0;
+
+	while ((iSame < iLength) && (iSame < ed->line.iLength) && (text[iSame] == ed->line.text[iSame]))
+		iSame++;
+
+	// Don't start in the middle of a UTF-8 character
+	while ((iSame > 0) && ((ed->line.text[iSame] & 0xC0) == 0x80))
+		iSame--;
+
+	setLineBuffer(&ed->line, text, iLength);
+	ed->iCursor = iLength;
+	redrawFrom(ed, iSame);
+}
+
+// getPreviousChar() and getNextChar() functions return the
+// offset of the character before and after byte "iPos" of
+// the line, stepping over whole UTF-8 characters.
+size_t getPreviousChar(LineEditor *ed, size_t iPos)
+{
+	if (iPos > 0)
+		iPos--;
+
+	while ((iPos > 0) && ((ed->line.text[iPos] & 0xC0) == 0x80))
+		iPos--;
+
+	return iPos;
+}
+
+size_t getNextChar(LineEditor *ed, size_t iPos)
+{
+	if (iPos < ed->line.iLength)
+		iPos++;
+
+	while ((iPos < ed->line.iLength) && ((ed->line.text[iPos] & 0xC0) == 0x80))
+		iPos++;
+
+	return iPos;
+}
+
+// getPreviousWord() and getNextWord() functions return the
+// offset of the start of the word before "iPos" and of the
+// end of the word after it. Words are separated by blanks.
+size_t getPreviousWord(LineEditor *ed, size_t iPos)
+{
+	while ((iPos > 0) && (ed->line.text[iPos - 1] == ' '))
+		iPos--;
+
+	while ((iPos > 0) && (ed->line.text[iPos - 1] != ' '))
+		iPos--;
+
+	return iPos;
+}
+
+size_t getNextWord(LineEditor *ed, size_t iPos)
+{
+	while ((iPos < ed->line.iLength) && (ed->line.text[iPos] == ' '))
+		iPos++;
+
+	while ((iPos < ed->line.iLength) && (ed->line.text[iPos] != ' '))
+		iPos++;
+
+	return iPos;
+}
+
+// readEditorByte() function returns the next byte typed
+// by the user, or -1 at the end of the input. All the
+// bytes available are read at once, and the output queued
+// so far is written just before waiting for more.
+int readEditorByte(LineEditor *ed)
+{
+	while (ed->iInputPos == ed->iInputLength)
+	{
+		ssize_t n;
+
+		flushEditorOutput(ed);
+		n = read(STDIN_FILENO, ed->input, sizeof(ed->input));
+
+		if ((n < 0) && (errno == EINTR))
+			continue;
+
+		if (n <= 0)
+			return -1;
+
+		ed->iInputPos = 0;
+		ed->iInputLength = n;
+	}
+
+	return ed->input[ed->iInputPos++];
+}
+
+// readEditorKey() function returns the next key typed by
+// the user: a byte, or one of the EditorKey values for
+// the escape sequences of arrows and the like. It returns
+// -1 at the end of the input.
+int readEditorKey(LineEditor *ed)
+{
+	char params[16];
+	int iNumParams = 0;
+	int c = readEditorByte(ed);
+
+	if (c != 27)
+		return c;
+
+	c = readEditorByte(ed);
+
+	switch (c)
+	{
+	case 'b':	return Key_Word_Left;
+	case 'f':	return Key_Word_Right;
+	case 'd':	return Key_Kill_Word;
+	case 127:	return Key_Kill_Word_Back;
+	case '[':
+	case 'O':
+		break;
+	default:
+		return (c < 0) ? -1 : Key_Unknown;
+	}
+
+	// A control sequence: parameters, then a final byte
+	while (((c = readEditorByte(ed)) >= 0) && ((c < 64) || (c > 126)))
+		if (iNumParams < (int) sizeof(params) - 1)
+			params[iNumParams++] = c;
+
+	params[iNumParams] = '\0';
+
+	switch (c)
+	{
+	case 'A':	return Key_Up;
+	case 'B':	return Key_Down;
+	case 'C':	return (strchr(params, ';') != NULL) ? Key_Word_Right : Key_Right;
+	case 'D':	return (strchr(params, ';') != NULL) ? Key_Word_Left : Key_Left;
+	case 'H':	return Key_Home;
+	case 'F':	return Key_End;
+	case '~':
+		switch (atoi(params))
+		{
+		case 1:
+		case 7:		return Key_Home;
+		case 4:
+		case 8:		return Key_End;
+		case 3:		return Key_Delete;
+		}
+		break;
+	}
+
+	return (c < 0) ? -1 : Key_Unknown;
+}
+
+// stepHistory() function moves "match" to the previous
+// (older, "iOlder" set) or next command of the history.
+// The commands of this session come after the lines of
+// the history file, and an id of 0 stands for the line
+// being typed, after all of them. It returns 0 if there
+// is no command in that direction.
+int stepHistory(HistoryMatch *match, int iOlder)
+{
+	int iOldest = (cmdHistory.iCount > 0) ? getHistoryEntry(0)->iSequenceNo : 0;
+	int iNewest = (cmdHistory.iCount > 0) ? getHistoryEntry(cmdHistory.iCount - 1)->iSequenceNo : 0;
+	size_t iLength;
+
+	if (iOlder)
+	{
+		if ((match->id == 0) && (iNewest > 0))
+			match->id = iNewest;
+		else if (!match->iInFile && (match->id > iOldest))
+			match->id--;
+		else if (getHistoryFileLineFromEnd(match->iInFile ? match->id + 1 : 1, &iLength))
+		{
+			match->id = match->iInFile ? match->id + 1 : 1;
+			match->iInFile = 1;
+		}
+		else
+			return 0;
+	}
+	else
+	{
+		if (match->iInFile && (match->id > 1))
+			match->id--;
+		else if (match->iInFile)
+		{
+			match->iInFile = 0;
+			match->id = iOldest;
+		}
+		else if ((match->id > 0) && (match->id < iNewest))
+			match->id++;
+		else if (match->id > 0)
+			match->id = 0;
+		else
+			return 0;
+	}
+
+	return 1;
+}
+
+// showSearchLine() function redraws the current row
+// of the terminal with the state of a Ctrl-R search.
+// The match is cut to fit into the row.
+void showSearchLine(LineEditor *ed, const char *query, HistoryMatch *match, int iFailed)
+{
+	size_t iLength = 0;
+	const char *text = match->id ? getMatchText(match, &iLength) : "";
+	char *out = malloc(strlen(query) + iLength + 64);
+	int iShown = sprintf(out, "\r\033[K(%sreverse-i-search)`%s': ", iFailed ? "failed " : "", query) - 4;
+
+	if (iLength + iShown >= ed->iColumns)
+		iLength = (ed->iColumns > iShown + 1) ? ed->iColumns - iShown - 1 : 0;
+
+	addEditorOutput(ed, out, strlen(out));
+	addEditorOutput(ed, text, iLength);
+	free(out);
+}
+
+// CompletionList structure type is used to collect
+// the candidates for completing a word.
+typedef struct
+{
+	char **items;					// the candidates, directories end with a /
+	int iCount;						// number of candidates
+	int iAllocated;					// allocated size of items
+} CompletionList;
+
+// Most candidates listed at once when Tab is pressed twice
+#define COMPLETION_LIST_MAX 200
+
+// DirectoryListing structure type is used to cache the
+// entries of one directory for file name completion.
+typedef struct DirectoryListing
+{
+	char *path;						// the directory, as used with opendir()
+	char **names;					// its entries, sorted, directories with a / at the end
+	int iNumNames;					// number of entries
+	struct DirectoryListing *next;	// pointer to the next cached directory
+} DirectoryListing;
+
+// Directories read for completion at the current prompt.
+// They are read again at the next prompt, after a command
+// may have changed them.
+DirectoryListing *directoryListings = NULL;
+
+// addCompletion() function adds a copy of the first
+// "iLength" bytes of "text" to "list".
+void addCompletion(CompletionList *list, const char *text, size_t iLength)
+{
+	if (list->iCount == list->iAllocated)
+	{
+		list->iAllocated = list->iAllocated ? list->iAllocated * 2 : 32;
+		list->items = realloc(list->items, list->iAllocated * sizeof(char *));
+	}
+
+	list->items[list->iCount++] = strndup(text, iLength);
+}
+
+// freeCompletions() function frees the candidates
+// of "list", keeping it for reuse.
+void freeCompletions(CompletionList *list)
+{
+	int i;
+
+	for (i = 0; i < list->iCount; ++i)
+		free(list->items[i]);
+
+	list->iCount = 0;
+}
+
+// clearDirectoryListings() function forgets the
+// directories read for completion so far.
+void clearDirectoryListings()
+{
+	while (directoryListings != NULL)
+	{
+		DirectoryListing *next = directoryListings->next;
+		int i;
+
+		for (i = 0; i < directoryListings->iNumNames; ++i)
+			free(directoryListings->names[i]);
+
+		free(directoryListings->names);
+		free(directoryListings->path);
+		free(directoryListings);
+		directoryListings = next;
+	}
+}
+
+// getDirectoryListing() function returns the entries of
+// the directory "path", reading it only the first time
+// it is asked for at the current prompt.
+DirectoryListing* getDirectoryListing(const char *path)
+{
+	DirectoryListing *listing;
+	struct dirent *entry;
+	int iAllocated = 0;
+	DIR *d;
+
+	for (listing = directoryListings; listing; listing = listing->next)
+		if (strcmp(listing->path, path) == 0)
+			return listing;
+
+	listing = calloc(1, sizeof(DirectoryListing));
+	listing->path = strdup(path);
+	listing->next = directoryListings;
+	directoryListings = listing;
+
+	// A directory that can't be read is
+	// remembered as an empty one
+	d = opendir(path);
+
+	if (d == NULL)
+		return listing;
+
+	while ((entry = readdir(d)) != NULL)
+	{
+		struct stat st;
+		int iIsDir = (entry->d_type == DT_DIR);
+		char *name;
+
+		if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+			continue;
+
+		// A link or an unknown type needs a look at the
+		// entry itself to tell if it is a directory
+		if ((entry->d_type == DT_LNK) || (entry->d_type == DT_UNKNOWN))
+			iIsDir = (fstatat(dirfd(d), entry->d_name, &st, 0) == 0) && S_ISDIR(st.st_mode);
+
+		if (listing->iNumNames == iAllocated)
+		{
+			iAllocated = iAllocated ? iAllocated * 2 : 64;
+			listing->names = realloc(listing->names, iAllocated * sizeof(char *));
+		}
+
+		name = malloc(strlen(entry->d_name) + 2);
+		strcpy(name, entry->d_name);
+
+		if (iIsDir)
+			strcat(name, "/");
+
+		listing->names[listing->iNumNames++] = name;
+	}
+
+	closedir(d);
+	qsort(listing->names, listing->iNumNames, sizeof(char *), compareStrings);
+
+	return listing;
+}
+
+// findFirstWithPrefix() function returns the position of
+// the first of the sorted strings "names[0..iCount-1]" that
+// is not less than "prefix", i.e. the first one starting
+// with it if there is any.
+int findFirstWithPrefix(char **names, int iCount, const char *prefix)
+{
+	int lo = 0;
+	int hi = iCount;
+
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+
+		if (strcmp(names[mid], prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// addCommandCompletions() function adds the builtins and
+// the commands in PATH whose name starts with "prefix".
+void addCommandCompletions(CompletionList *list, const char *prefix)
+{
+	size_t iLength = strlen(prefix);
+	int i;
+
+	for (i = 0; i < (int) (sizeof(builtins) / sizeof(builtins[0])); ++i)
+		if (strncmp(builtins[i].name, prefix, iLength) == 0)
+			addCompletion(list, builtins[i].name, strlen(builtins[i].name));
+
+	waitForCommandIndex();
+	pthread_mutex_lock(&commandIndex.lock);
+
+	for (i = findFirstWithPrefix(commandIndex.names, commandIndex.iNumNames, prefix);
+		 (i < commandIndex.iNumNames) && (strncmp(commandIndex.names[i], prefix, iLength) == 0); ++i)
+		addCompletion(list, commandIndex.names[i], strlen(commandIndex.names[i]));
+
+	pthread_mutex_unlock(&commandIndex.lock);
+}
+
+// addFileCompletions() function adds the entries of the
+// directory part of "word" whose name starts with the rest
+// of it. Hidden entries are only added when that rest
+// starts with a dot. A leading ~/ is the home directory.
+void addFileCompletions(CompletionList *list, const char *word)
+{
+	const char *slash = strrchr(word, '/');
+	const char *base = slash ? slash + 1 : word;
+	const char *home = getVariable("HOME");
+	size_t iLength = strlen(base);
+	DirectoryListing *listing;
+	char *dir;
+	int i;
+
+	if (slash == NULL)
+	{
+		dir = strdup(".");
+	}
+	else if ((word[0] == '~') && (word[1] == '/') && (home != NULL))
+	{
+		dir = malloc(strlen(home) + (slash - word) + 2);
+		sprintf(dir, "%s%.*s", home, (int) (slash - word), word + 1);
+	}
+	else
+	{
+		dir = strndup(word, (slash == word) ? 1 : (size_t) (slash - word));
+	}
+
+	listing = getDirectoryListing(dir);
+	free(dir);
+
+	for (i = findFirstWithPrefix(listing->names, listing->iNumNames, base);
+		 (i < listing->iNumNames) && (strncmp(listing->names[i], base, iLength) == 0); ++i)
+	{
+		if ((listing->names[i][0] != '.') || (base[0] == '.'))
+			addCompletion(list, listing->names[i], strlen(listing->names[i]));
+	}
+}
+
+// getCompletionWord() function finds the word that ends at
+// the cursor and stores its text, without quotes and
+// escapes, in "word". "pQuote" is set to the quote the word
+// is still inside of, or 0. It returns 1 if the word is
+// where a command name goes: first on the line, after a |,
+// a fan-out or a "time", and not after a redirection.
+int getCompletionWord(LineEditor *ed, LineBuffer *word, char *pQuote)
+{
+	int iCommand = 1;			// the next word is a command name
+	int iRedirect = 0;			// the next word is the file of a redirection
+	int iWordIsCommand = 1;
+	int iInWord = 0;
+	int iInFanOut = 0;
+	char quote = 0;
+	size_t i;
+
+	setLineBuffer(word, "", 0);
+
+	for (i = 0; i < ed->iCursor; ++i)
+	{
+		char c = ed->line.text[i];
+		int iOperator = (c == '|') || (c == '&') || (c == '<') || (c == '>') || ((c == ',') && iInFanOut);
+
+		if (quote != 0)
+		{
+			if (c == quote)
+				quote = 0;
+			else
+				appendToLineBuffer(word, c);
+			continue;
+		}
+
+		if (iInWord && ((c == ' ') || (c == '\t') || iOperator))
+		{
+			// The word before has ended
+			iInWord = 0;
+
+			if (iRedirect)
+				iRedirect = 0;
+			else if (!iWordIsCommand || (strcmp(word->text, "time") != 0))
+				iCommand = 0;
+		}
+
+		if ((c == ' ') || (c == '\t'))
+			continue;
+
+		if (iOperator)
+		{
+			if ((c == '<') || (c == '>'))
+			{
+				iRedirect = 1;
+			}
+			else
+			{
+				iCommand = 1;
+				iRedirect = 0;
+				iInFanOut |= (c == '|') && (i > 0) && (ed->line.text[i - 1] == '|');
+			}
+			continue;
+		}
+
+		if (!iInWord)
+		{
+			iInWord = 1;
+			iWordIsCommand = iCommand && !iRedirect;
+			setLineBuffer(word, "", 0);
+		}
+
+		if ((c == '\\') && (i + 1 < ed->iCursor))
+			appendToLineBuffer(word, ed->line.text[++i]);
+		else if ((c == '\'') || (c == '"'))
+			quote = c;
+		else
+			appendToLineBuffer(word, c);
+	}
+
+	if (!iInWord && (quote == 0))
+	{
+		setLineBuffer(word, "", 0);
+		iWordIsCommand = iCommand && !iRedirect;
+	}
+
+	*pQuote = quote;
+
+	return iWordIsCommand;
+}
+
+// insertCompletion() function inserts "iLength" bytes of
+// "text" at the cursor, with a backslash in front of the
+// characters the lexer would otherwise treat specially,
+// unless the word is inside quotes.
+void insertCompletion(LineEditor *ed, const char *text, size_t iLength, char quote)
+{
+	LineBuffer escaped = { NULL, 0, 0 };
+	size_t i;
+
+	setLineBuffer(&escaped, "", 0);
+
+	for (i = 0; i < iLength; ++i)
+	{
+		if ((quote == 0) && strchr(" \t\\'\"|&<>,$*?", text[i]))
+			appendToLineBuffer(&escaped, '\\');
+		appendToLineBuffer(&escaped, text[i]);
+	}
+
+	insertEditorText(ed, escaped.text, escaped.iLength);
+	free(escaped.text);
+}
+
+// listCompletions() function shows the candidates below
+// the line, in columns like "ls", and then the prompt and
+// the line again.
+void listCompletions(LineEditor *ed, CompletionList *list)
+{
+	int iCount = (list->iCount < COMPLETION_LIST_MAX) ? list->iCount : COMPLETION_LIST_MAX;
+	size_t iWidth = 1;
+	int iColumns, iRows;
+	int i, iRow;
+
+	for (i = 0; i < iCount; ++i)
+	{
+		size_t w = getTextWidth(list->items[i], strlen(list->items[i]));
+
+		if (w > iWidth)
+			iWidth = w;
+	}
+
+	iColumns = ed->iColumns / (iWidth + 2);
+
+	if (iColumns < 1)
+		iColumns = 1;
+
+	iRows = (iCount + iColumns - 1) / iColumns;
+
+	moveScreenCursor(ed, ed->iScreenEnd);
+	addEditorOutput(ed, "\r\n", 2);
+
+	for (iRow = 0; iRow < iRows; ++iRow)
+	{
+		for (i = iRow; i < iCount; i += iRows)
+		{
+			size_t w = getTextWidth(list->items[i], strlen(list->items[i]));
+
+			addEditorOutput(ed, list->items[i], strlen(list->items[i]));
+
+			if (i + iRows < iCount)
+				while (w++ < iWidth + 2)
+					addEditorOutput(ed, " ", 1);
+		}
+
+		addEditorOutput(ed, "\r\n", 2);
+	}
+
+	if (list->iCount > iCount)
+	{
+		char more[64];
+
+		addEditorOutput(ed, more, sprintf(more, "... and %d more\r\n", list->iCount - iCount));
+	}
+
+	showEditorPrompt(ed);
+	redrawFrom(ed, 0);
+}
+
+// completeWord() function is called when Tab is pressed. A
+// command name is completed from the builtins and the
+// command index, anything else as a file name. A single
+// candidate is inserted whole, followed by a space, or by
+// nothing for a directory. Several candidates insert what
+// they have in common, and Tab pressed again lists them.
+void completeWord(LineEditor *ed)
+{
+	static CompletionList list = { NULL, 0, 0 };
+	static LineBuffer word = { NULL, 0, 0 };
+	const char *prefix;
+	size_t iCommon;
+	char quote;
+	int i;
+
+	if (getCompletionWord(ed, &word, &quote) && (strchr(word.text, '/') == NULL))
+	{
+		prefix = word.text;
+		addCommandCompletions(&list, prefix);
+	}
+	else
+	{
+		prefix = strrchr(word.text, '/') ? strrchr(word.text, '/') + 1 : word.text;
+		addFileCompletions(&list, word.text);
+	}
+
+	// A builtin may also be a program in PATH
+	qsort(list.items, list.iCount, sizeof(char *), compareStrings);
+
+	for (i = 1; i < list.iCount; )
+	{
+		if (strcmp(list.items[i - 1], list.items[i]) == 0)
+		{
+			free(list.items[i]);
+			memmove(&list.items[i], &list.items[i + 1], (list.iCount - i - 1) * sizeof(char *));
+			list.iCount--;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	if (list.iCount == 0)
+	{
+		addEditorOutput(ed, "\a", 1);
+		return;
+	}
+
+	// The start all the candidates have in common,
+	// not ending in the middle of a UTF-8 character
+	iCommon = strlen(list.items[0]);
+
+	for (i = 1; i < list.iCount; ++i)
+	{
+		size_t j = 0;
+
+		while ((j < iCommon) && (list.items[i][j] == list.items[0][j]))
+			j++;
+
+		iCommon = j;
+	}
+
+	while ((iCommon > strlen(prefix)) && ((list.items[0][iCommon] & 0xC0) == 0x80))
+		iCommon--;
+
+	if (list.iCount == 1)
+	{
+		const char *item = list.items[0];
+		size_t iLength = strlen(item);
+
+		insertCompletion(ed, item + strlen(prefix), iLength - strlen(prefix), quote);
+
+		if (item[iLength - 1] != '/')
+		{
+			char end[2] = { quote, ' ' };
+
+			insertEditorText(ed, (quote != 0) ? end : end + 1, (quote != 0) ? 2 : 1);
+		}
+	}
+	else if (iCommon > strlen(prefix))
+	{
+		insertCompletion(ed, list.items[0] + strlen(prefix), iCommon - strlen(prefix), quote);
+	}
+	else if (ed->iLastKey == '\t')
+	{
+		listCompletions(ed, &list);
+	}
+	else
+	{
+		addEditorOutput(ed, "\a", 1);
+	}
+
+	freeCompletions(&list);
+}
+
+// readLineInteractive() function reads one line from the
+// terminal with the terminal in raw mode, with the editing
+// keys of other shells:
+//		Left, Right, Ctrl-B, Ctrl-F		move by a character
+//		Alt-B, Alt-F, Ctrl-Left/Right	move by a word
+//		Home, End, Ctrl-A, Ctrl-E		go to the start or the end
+//		Backspace, Delete, Ctrl-D		delete a character
+//		Ctrl-K, Ctrl-U, Ctrl-W, Alt-D	kill to the end, to the start, a word
+//		Ctrl-Y							yank the killed text back
+//		Up, Down, Ctrl-P, Ctrl-N		go through the history
+//		Tab								complete a command or file name
+//		Ctrl-L							clear the screen
+//		Ctrl-C							cancel the line
+// Ctrl-D on an empty line ends the input. Ctrl-R starts an
+// incremental search backwards through the history: every
+// character typed narrows the search, Ctrl-R again goes to
+// the next older match, Enter runs the match, Ctrl-G cancels,
+// and any other key keeps the match on the line for editing.
+// It returns the line with a newline at the end, or NULL at
+// the end of the input. The line stays valid until the next
+// call, the buffers are reused from line to line.
+char* readLineInteractive(const char *prompt)
+{
+	struct termios saved, raw;
+	struct winsize size;
+	LineEditor *ed = &editor;
+	static LineBuffer query = { NULL, 0, 0 };
+	static LineBuffer typed = { NULL, 0, 0 };
+	HistoryMatch match = { 0, 0 };
+	HistoryMatch position = { 0, 0 };
+	int iSearching = 0;
+	int iFailed = 0;
+	int iDone = 0;
+	int iEOF = 0;
+
+	setLineBuffer(&ed->line, "", 0);
+	setLineBuffer(&ed->out, "", 0);
+	setLineBuffer(&query, "", 0);
+	ed->iCursor = 0;
+	ed->prompt = prompt;
+	ed->iPromptWidth = getTextWidth(prompt, strlen(prompt));
+	ed->iColumns = 80;
+	ed->iInputPos = 0;
+	ed->iInputLength = 0;
+	ed->iLastKey = 0;
+
+	if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) && (size.ws_col > 0))
+		ed->iColumns = size.ws_col;
+
+	// Commands may have changed the directories
+	// since the last prompt
+	refreshCommandIndex();
+	clearDirectoryListings();
+
+	fflush(stdout);
+	tcgetattr(STDIN_FILENO, &saved);
+	raw = saved;
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+	raw.c_iflag &= ~(IXON | ICRNL);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+	showEditorPrompt(ed);
+
+	while (!iDone)
+	{
+		int c = readEditorKey(ed);
+
+		if (c < 0)
+		{
+			iEOF = (ed->line.iLength == 0);
+			break;
+		}
+
+		if (iSearching)
+		{
+			size_t iLength;
+
+			if ((c == 18) || (c == 8) || ((c >= 32) && (c < 256)))
+			{
+				const char *skipText = NULL;
+				size_t iSkipLength = 0;
+				HistoryMatch found = match;
+
+				if (c == 18)
+				{
+					// Ctrl-R: next older match, skipping
+					// repeats of the current one
+					if (match.id)
+						skipText = getMatchText(&match, &iSkipLength);
+				}
+				else if ((c == 127) || (c == 8))
+				{
+					// Backspace: shorter query, start
+					// again from the newest command
+					if (query.iLength > 0)
+						query.text[--query.iLength] = '\0';
+					match.iInFile = 0;
+					match.id = 0;
+					found = match;
+				}
+				else
+				{
+					// One more character: the current match
+					// is checked again before older ones
+					appendToLineBuffer(&query, c);
+
+					if (found.iInFile)
+						found.id--;
+					else if (found.id)
+						found.id++;
+				}
+
+				if (query.iLength > 0)
+				{
+					iFailed = !searchHistory(query.text, &found, skipText, iSkipLength);
+
+					if (!iFailed)
+						match = found;
+				}
+
+				showSearchLine(ed, query.text, &match, iFailed);
+				continue;
+			}
+
+			// Leave the search mode, keeping the match
+			// unless it is Ctrl-G or Ctrl-C
+			iSearching = 0;
+
+			if ((c != 7) && (c != 3) && match.id)
+			{
+				const char *text = getMatchText(&match, &iLength);
+				setLineBuffer(&ed->line, text, iLength);
+				ed->iCursor = iLength;
+			}
+
+			redrawEditor(ed);
+
+			if ((c == 7) || (c == 3))
+				continue;
+
+			// Any other key then does what it
+			// normally does, below.
+		}
+
+		switch (c)
+		{
+		case '\r':
+		case '\n':
+			iDone = 1;
+			break;
+		case 3:
+			// Ctrl-C: throw the line away
+			moveScreenCursor(ed, ed->iScreenEnd);
+			addEditorOutput(ed, "^C", 2);
+			setLineBuffer(&ed->line, "", 0);
+			iDone = 1;
+			break;
+		case 4:
+			// Ctrl-D: end of input on an empty line,
+			// otherwise delete the character under the cursor
+			if (ed->line.iLength == 0)
+			{
+				iEOF = 1;
+				iDone = 1;
+			}
+			else
+			{
+				deleteEditorText(ed, ed->iCursor, getNextChar(ed, ed->iCursor), 0);
+			}
+			break;
+		case Key_Delete:
+			deleteEditorText(ed, ed->iCursor, getNextChar(ed, ed->iCursor), 0);
+			break;
+		case 127:
+		case 8:
+			// Backspace
+			deleteEditorText(ed, getPreviousChar(ed, ed->iCursor), ed->iCursor, 0);
+			break;
+		case 1:
+		case Key_Home:
+			ed->iCursor = 0;
+			moveScreenCursor(ed, getEditorColumn(ed, ed->iCursor));
+			break;
+		case 5:
+		case Key_End:
+			ed->iCursor = ed->line.iLength;
+			moveScreenCursor(ed, getEditorColumn(ed, ed->iCursor));
+			break;
+		case 2:
+		case Key_Left:
+			ed->iCursor = getPreviousChar(ed, ed->iCursor);
+			moveScreenCursor(ed, getEditorColumn(ed, ed->iCursor));
+			break;
+		case 6:
+		case Key_Right:
+			ed->iCursor = getNextChar(ed, ed->iCursor);
+			moveScreenCursor(ed, getEditorColumn(ed, ed->iCursor));
+			break;
+		case Key_Word_Left:
+			ed->iCursor = getPreviousWord(ed, ed->iCursor);
+			moveScreenCursor(ed, getEditorColumn(ed, ed->iCursor));
+			break;
+		case Key_Word_Right:
+			ed->iCursor = getNextWord(ed, ed->iCursor);
+			moveScreenCursor(ed, getEditorColumn(ed, ed->iCursor));
+			break;
+		case 11:
+			// Ctrl-K: kill to the end of the line
+			deleteEditorText(ed, ed->iCursor, ed->line.iLength, 1);
+			break;
+		case 21:
+			// Ctrl-U: kill to the start of the line
+			deleteEditorText(ed, 0, ed->iCursor, 1);
+			break;
+		case 23:
+		case Key_Kill_Word_Back:
+			// Ctrl-W: kill the word before the cursor
+			deleteEditorText(ed, getPreviousWord(ed, ed->iCursor), ed->iCursor, 1);
+			break;
+		case Key_Kill_Word:
+			deleteEditorText(ed, ed->iCursor, getNextWord(ed, ed->iCursor), 1);
+			break;
+		case 25:
+			// Ctrl-Y: yank the killed text
+			insertEditorText(ed, ed->kill.text, ed->kill.iLength);
+			break;
+		case 16:
+		case 14:
+		case Key_Up:
+		case Key_Down:
+		{
+			// Ctrl-P, Ctrl-N: the line being typed is kept
+			// while going through the history. Commands the
+			// same as the one shown are skipped.
+			HistoryMatch next = position;
+			const char *text = NULL;
+			size_t iLength = 0;
+			int iFound = 0;
+
+			while (!iFound && stepHistory(&next, (c == 16) || (c == Key_Up)))
+			{
+				if (next.id == 0)
+				{
+					text = typed.text;
+					iLength = typed.iLength;
+				}
+				else
+				{
+					text = getMatchText(&next, &iLength);
+				}
+
+				iFound = (text != NULL) && ((iLength != ed->line.iLength) || memcmp(text, ed->line.text, iLength));
+			}
+
+			if (!iFound)
+				break;
+
+			if (position.id == 0)
+				setLineBuffer(&typed, ed->line.text, ed->line.iLength);
+
+			position = next;
+			replaceEditorLine(ed, text, iLength);
+			break;
+		}
+		case '\t':
+			completeWord(ed);
+			break;
+		case 12:
+			// Ctrl-L: clear the screen
+			addEditorOutput(ed, "\033[H\033[2J", 7);
+			ed->iScreenCursor = 0;
+			ed->iScreenEnd = 0;
+			redrawEditor(ed);
+			break;
+		case 18:
+			// Ctrl-R: start a search on the first row
+			iSearching = 1;
+			iFailed = 0;
+			match.iInFile = 0;
+			match.id = 0;
+			setLineBuffer(&query, "", 0);
+			moveScreenCursor(ed, 0);
+			addEditorOutput(ed, "\033[J", 3);
+			showSearchLine(ed, "", &match, 0);
+			break;
+		default:
+			if ((c >= 32) && (c < 256))
+			{
+				// A UTF-8 character is inserted as a whole
+				char text[4];
+				int iLength = 1;
+				int iNeeded = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+
+				text[0] = c;
+
+				while (iLength < iNeeded)
+				{
+					int iNext = readEditorByte(ed);
+
+					if ((iNext < 0) || ((iNext & 0xC0) != 0x80))
+						break;
+					text[iLength++] = iNext;
+				}
+
+				insertEditorText(ed, text, iLength);
+			}
+			break;
+		}
+
+		ed->iLastKey = c;
+	}
+
+	moveScreenCursor(ed, ed->iScreenEnd);
+	addEditorOutput(ed, "\r\n", 2);
+	flushEditorOutput(ed);
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+
+	if (iEOF)
+		return NULL;
+
+	ed->line.text[ed->line.iLength++] = '\n';
+	ed->line.text[ed->line.iLength] = '\0';
+
+	return ed->line.text;
+}
+
+// getRecentCommandFromHistory() function returns a copy,
+// in the command arena, of the "iBack"-th newest command
+// of the history (1 for the newest one), or an empty
+// string if there is no such command. The commands of
+// earlier sessions are looked for from the end of the
+// history file, without reading all of it.
+char* getRecentCommandFromHistory(int iBack)
+{
+	int iNewest = (cmdHistory.iCount > 0) ? getHistoryEntry(cmdHistory.iCount - 1)->iSequenceNo : 0;
+	int iSessionNo = iNewest + 1 - iBack;
+
+	if (iSessionNo < 1)
+	{
+		size_t iLength;
+		const char *text = getHistoryFileLineFromEnd(1 - iSessionNo, &iLength);
+
+		if (text == NULL)
+			return "";
+
+		// Keep the newline, like a line typed by the user
+		return arenaStrndup(&commandArena, text, iLength + 1);
+	}
+
+	HistoryEntry *entry = findHistoryEntry(iSessionNo);
+
+	if (entry == NULL)
+		return "";	// dropped from the history of this session
+
+	return arenaStrndup(&commandArena, getHistoryText(entry), entry->iLength);
+}
+
+// getCommandFromHistory() function will look up the
+// command with a given sequence number in the history
+// and return a copy of it in the command arena, or an
+// empty string if there is no such command. Numbers up
+// to the number of lines of the history file are
+// commands of earlier sessions, the rest are commands
+// of this session. A negative number -n is the n-th
+// newest command.
+char* getCommandFromHistory(int iSequenceNo)
+{
+	if (iSequenceNo < 0)
+		return getRecentCommandFromHistory(-iSequenceNo);
+
+	int iNumFileLines = getHistoryFileCount();
+
+	if ((iSequenceNo >= 1) && (iSequenceNo <= iNumFileLines))
+	{
+		size_t iLength;
+		const char *text = getHistoryFileLineRef(iSequenceNo, &iLength);
+
+		// Keep the newline, like a line typed by the user
+		return arenaStrndup(&commandArena, text, iLength + 1);
+	}
+
+	HistoryEntry *entry = findHistoryEntry(iSequenceNo - iNumFileLines);
+
+	if (entry == NULL)
+		return "";	// couldn't find that sequence number in history
+
+	return arenaStrndup(&commandArena, getHistoryText(entry), entry->iLength);
+}
+
+// insertIntoCommandHistory() is used to append a
+// new command to the command history of this session
+// and to the history file. If the history is full,
+// the oldest command is dropped from the session.
+void insertIntoCommandHistory(int iSequenceNo, char *command)
+{
+	size_t iLength = strlen(command);
+	HistoryEntry *entry;
+
+	appendToHistoryFile(command);
+
+	if (cmdHistory.iCount == cmdHistory.iCapacity)
+	{
+		// Drop the oldest command, its text becomes
+		// garbage in the arena.
+		entry = getHistoryEntry(0);
+		cmdHistory.iArenaLive -= entry->iLength + 1;
+		cmdHistory.iFirst = (cmdHistory.iFirst + 1) % cmdHistory.iCapacity;
+		cmdHistory.iCount--;
+	}
+
+	reserveHistoryArena(iLength + 1);
+
+	entry = getHistoryEntry(cmdHistory.iCount);
+	entry->iSequenceNo = iSequenceNo;
+	entry->iOffset = cmdHistory.iArenaUsed;
+	entry->iLength = iLength;
+	memcpy(getHistoryText(entry), command, iLength + 1);
+
+	cmdHistory.iArenaUsed += iLength + 1;
+	cmdHistory.iArenaLive += iLength + 1;
+	cmdHistory.iCount++;
+
+	// Make the command searchable with Ctrl-R. Once the
+	// history is full, the commands it drops have to go
+	// from the index too, or the index grows forever.
+	addToTrigramIndex(&sessionTrigrams, iSequenceNo, command, iLength);
+
+	if ((cmdHistory.iCount == cmdHistory.iCapacity) && (sessionTrigrams.iNumIds >= sessionTrigrams.iPruneAt))
+		pruneTrigramIndex(&sessionTrigrams, getHistoryEntry(0)->iSequenceNo);
+}
+
+void executeCommand(int);	// forward declaration
+
+// executeCommandHistory() function is used to execute
+// "cmdhist" command entered by user. This "cmdhist" command
+// tries to mimic the functionality of "history" command
+// available in some Unix shells.
+int executeCommandHistory(char **args)
+{
+	int i;
+
+	// If there was a numeric argument after "cmdhist"
+	// command, user wants last n commands only from the
+	// history. They are simply the last n commands of
+	// the session and, if that isn't enough, the last
+	// lines of the history file, found from its end.
+	// They are numbered back from the newest one, -1,
+	// so the rest of the file needn't be counted.
+	if ((args[1] != NULL) && (atoi(args[1]) >= 0))
+	{
+		int n = atoi(args[1]);
+		int iNewest = (cmdHistory.iCount > 0) ? getHistoryEntry(cmdHistory.iCount - 1)->iSequenceNo : 0;
+		size_t iLength;
+
+		for (i = n - iNewest; i >= 1; --i)
+		{
+			const char *command = getHistoryFileLineFromEnd(i, &iLength);
+
+			if (command != NULL)
+				printf("%d\t%.*s\n", -(iNewest + i), (int) iLength, command);
+		}
+
+		for (i = 0; i < cmdHistory.iCount; ++i)
+		{
+			HistoryEntry *entry = getHistoryEntry(i);
+
+			if (iNewest + 1 - entry->iSequenceNo <= n)
+				printf("%d\t%s", entry->iSequenceNo - iNewest - 1, getHistoryText(entry));
+		}
+	}
+	else
+	{
+		int iNumFileLines = getHistoryFileCount();
+
+		for (i = 0; i < iNumFileLines; ++i)
+		{
+			size_t iLength;
+			const char *command = getHistoryFileLineRef(i + 1, &iLength);
+			printf("%d\t%.*s\n", i + 1, (int) iLength, command);
+		}
+
+		for (i = 0; i < cmdHistory.iCount; ++i)
+		{
+			HistoryEntry *entry = getHistoryEntry(i);
+			printf("%d\t%s", iNumFileLines + entry->iSequenceNo, getHistoryText(entry));
+		}
+	}
+
+	char *sSeqNo = getUserInput("Enter command number (or Enter to quit): ");
+
+	if (sSeqNo == NULL)
+		return 0;
+
+	int iSeqNo = atoi(sSeqNo);
+
+	// Ignore Enter key, otherwise execute the command
+	// and take its exit status
+	if (iSeqNo != 0)
+	{
+		executeCommand(iSeqNo);
+		return iLastStatus;
+	}
+
+	return 0;
+}
+
+// ParseCacheEntry structure type is one line of user
+// input remembered by the parse cache together with its
+// parsed form. The entry and everything it points to
+// live in a single block of memory.
+typedef struct ParseCacheEntry
+{
+	unsigned int iHash;					// hashString() of input
+	char *input;						// the raw input line
+	CommandLine *cmdLine;				// its parsed form, never modified once cached
+	int iInUse;							// number of executions of it in progress
+	struct ParseCacheEntry *nextInBucket;	// next entry in the same hash bucket
+	struct ParseCacheEntry *newer;		// neighbours in the LRU list
+	struct ParseCacheEntry *older;
+} ParseCacheEntry;
+
+#define PARSE_CACHE_BUCKETS 512
+
+// Number of lines kept when CSHELL_PARSE_CACHE_SIZE isn't set
+#define DEFAULT_PARSE_CACHE_SIZE 256
+
+// ParseCache structure type holds the parse cache: a hash
+// table from input line to parsed command line, with the
+// entries also kept in a list from the most recently used
+// to the least recently used one, which is evicted first.
+typedef struct
+{
+	ParseCacheEntry *buckets[PARSE_CACHE_BUCKETS];
+	ParseCacheEntry *newest;			// most recently used entry
+	ParseCacheEntry *oldest;			// least recently used entry
+	int iCount;							// number of entries
+	int iCapacity;						// maximum number of entries, 0 until initialized
+	long iHits;							// lookups that found the line
+	long iMisses;						// lookups that didn't
+} ParseCache;
+
+// The parse cache of this shell session
+ParseCache parseCache;
+
+// unlinkParseCacheEntry() function removes an entry
+// from the LRU list of the parse cache.
+void unlinkParseCacheEntry(ParseCacheEntry *entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		parseCache.newest = entry->older;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		parseCache.oldest = entry->newer;
+}
+
+// makeNewestParseCacheEntry() function puts an entry
+// at the most recently used end of the LRU list.
+void makeNewestParseCacheEntry(ParseCacheEntry *entry)
+{
+	entry->older = parseCache.newest;
+	entry->newer = NULL;
+
+	if (parseCache.newest)
+		parseCache.newest->newer = entry;
+	else
+		parseCache.oldest = entry;
+
+	parseCache.newest = entry;
+}
+
+// removeParseCacheEntry() function takes an entry out
+// of the parse cache and frees it.
+void removeParseCacheEntry(ParseCacheEntry *entry)
+{
+	ParseCacheEntry **pp = &parseCache.buckets[entry->iHash % PARSE_CACHE_BUCKETS];
+
+	while (*pp != entry)
+		pp = &(*pp)->nextInBucket;
+
+	*pp = entry->nextInBucket;
+	unlinkParseCacheEntry(entry);
+	parseCache.iCount--;
+	free(entry);
+}
+
+// clearParseCache() function removes all the entries
+// from the parse cache that are not being executed.
+void clearParseCache()
+{
+	ParseCacheEntry *entry = parseCache.oldest;
+
+	while (entry)
+	{
+		ParseCacheEntry *newer = entry->newer;
+
+		if (entry->iInUse == 0)
+			removeParseCacheEntry(entry);
+
+		entry = newer;
+	}
+}
+
+// lookupParseCache() function returns the cache entry
+// for the given input line, or NULL if it isn't cached.
+// A found entry becomes the most recently used one.
+ParseCacheEntry* lookupParseCache(const char *input)
+{
+	unsigned int iHash = hashString(input);
+	ParseCacheEntry *entry;
+
+	if (parseCache.iCapacity == 0)
+	{
+		const char *size = getVariable("CSHELL_PARSE_CACHE_SIZE");
+
+		parseCache.iCapacity = size ? atoi(size) : DEFAULT_PARSE_CACHE_SIZE;
+
+		if (parseCache.iCapacity <= 0)
+			parseCache.iCapacity = DEFAULT_PARSE_CACHE_SIZE;
+	}
+
+	for (entry = parseCache.buckets[iHash % PARSE_CACHE_BUCKETS]; entry; entry = entry->nextInBucket)
+	{
+		if ((entry->iHash == iHash) && (strcmp(entry->input, input) == 0))
+		{
+			parseCache.iHits++;
+			unlinkParseCacheEntry(entry);
+			makeNewestParseCacheEntry(entry);
+			return entry;
+		}
+	}
+
+	parseCache.iMisses++;
+	return NULL;
+}
+
+// copyArgsIntoBlock() function copies a NULL terminated
+// argument array and its strings to "*pCursor", moving
+// the cursor past them, and returns the copied array.
+char** copyArgsIntoBlock(char **args, int iNumArgs, char **pCursor)
+{
+	char **copy = (char **) *pCursor;
+	int i;
+
+	*pCursor += (iNumArgs + 1) * sizeof(char *);
+
+	for (i = 0; i < iNumArgs; ++i)
+	{
+		size_t iLength = strlen(args[i]) + 1;
+
+		memcpy(*pCursor, args[i], iLength);
+		copy[i] = *pCursor;
+		*pCursor += iLength;
+	}
+
+	copy[iNumArgs] = NULL;
+	return copy;
+}
+
+// insertIntoParseCache() function stores a copy of the
+// parsed command line "cmdLine" for the given input in
+// the parse cache, evicting the least recently used line
+// if the cache is full. The copy is made in one block of
+// memory sized exactly for it. It returns the new entry.
+ParseCacheEntry* insertIntoParseCache(const char *input, CommandLine *cmdLine)
+{
+	const size_t ALIGN = sizeof(void *);
+	size_t iSize = sizeof(ParseCacheEntry) + sizeof(CommandLine) +
+				   cmdLine->iNumCommands * sizeof(SimpleCommand) + strlen(input) + 1;
+	int i, j;
+
+	// Work out the size of the whole copy first
+	for (i = 0; i < cmdLine->iNumCommands; ++i)
+	{
+		SimpleCommand *command = &cmdLine->commands[i];
+		Redirection *redirection;
+
+		iSize += (command->iNumArgs + command->iNumAssignments + 2) * sizeof(char *) + 2 * ALIGN;
+		for (j = 0; j < command->iNumArgs; ++j)
+			iSize += strlen(command->args[j]) + 1;
+		for (j = 0; j < command->iNumAssignments; ++j)
+			iSize += strlen(command->assignments[j]) + 1;
+
+		for (redirection = command->redirections; redirection; redirection = redirection->next)
+			iSize += sizeof(Redirection) + strlen(redirection->target) + 1 + ALIGN;
+	}
+
+	while ((parseCache.iCount >= parseCache.iCapacity) && (parseCache.oldest != NULL))
+	{
+		ParseCacheEntry *victim = parseCache.oldest;
+
+		// Skip over lines that are being executed
+		while (victim && victim->iInUse)
+			victim = victim->newer;
+
+		if (victim == NULL)
+			break;
+
+		removeParseCacheEntry(victim);
+	}
+
+	ParseCacheEntry *entry = malloc(iSize);
+	char *cursor = (char *) (entry + 1);
+
+	entry->cmdLine = (CommandLine *) cursor;
+	cursor += sizeof(CommandLine);
+	*entry->cmdLine = *cmdLine;
+
+	entry->cmdLine->commands = (SimpleCommand *) cursor;
+	cursor += cmdLine->iNumCommands * sizeof(SimpleCommand);
+
+	for (i = 0; i < cmdLine->iNumCommands; ++i)
+	{
+		SimpleCommand *from = &cmdLine->commands[i];
+		SimpleCommand *to = &entry->cmdLine->commands[i];
+		Redirection **lastRedirection = &to->redirections;
+		Redirection *redirection;
+
+		cursor = (char *) (((size_t) cursor + ALIGN - 1) & ~(ALIGN - 1));
+		to->iNumArgs = from->iNumArgs;
+		to->args = copyArgsIntoBlock(from->args, from->iNumArgs, &cursor);
+		cursor = (char *) (((size_t) cursor + ALIGN - 1) & ~(ALIGN - 1));
+		to->iNumAssignments = from->iNumAssignments;
+		to->assignments = copyArgsIntoBlock(from->assignments, from->iNumAssignments, &cursor);
+
+		for (redirection = from->redirections; redirection; redirection = redirection->next)
+		{
+			cursor = (char *) (((size_t) cursor + ALIGN - 1) & ~(ALIGN - 1));
+			*lastRedirection = (Redirection *) cursor;
+			cursor += sizeof(Redirection);
+			**lastRedirection = *redirection;
+			(*lastRedirection)->target = cursor;
+			strcpy(cursor, redirection->target);
+			cursor += strlen(redirection->target) + 1;
+			lastRedirection = &(*lastRedirection)->next;
+		}
+
+		*lastRedirection = NULL;
+	}
+
+	entry->input = cursor;
+	strcpy(entry->input, input);
+
+	entry->iHash = hashString(input);
+	entry->iInUse = 0;
+	entry->nextInBucket = parseCache.buckets[entry->iHash % PARSE_CACHE_BUCKETS];
+	parseCache.buckets[entry->iHash % PARSE_CACHE_BUCKETS] = entry;
+	makeNewestParseCacheEntry(entry);
+	parseCache.iCount++;
+
+	return entry;
+}
+
+// executeCmdCache() function is used to execute the
+// "cmdcache" command entered by user:
+//		cmdcache		show the parse cache statistics
+//		cmdcache -r		forget all the cached lines
+int executeCmdCache(char **args)
+{
+	if ((args[1] != NULL) && (strcmp(args[1], "-r") == 0))
+	{
+		clearParseCache();
+		parseCache.iHits = 0;
+		parseCache.iMisses = 0;
+		return 0;
+	}
+
+	printf("%d of %d lines cached, %ld hits, %ld misses\n",
+		   parseCache.iCount, parseCache.iCapacity, parseCache.iHits, parseCache.iMisses);
+	return 0;
+}
+
+// GlobDirectory structure type is used to cache the entries
+// of one directory while the patterns of a command line are
+// expanded, so that e.g. "cp *.c *.h dir" reads it only once.
+// The entries are read with getdents64() straight into one
+// buffer, which the names keep pointing into, and their type
+// comes with them, so that no entry has to be looked at with
+// stat() just to match its name.
+typedef struct GlobDirectory
+{
+	char *path;						// the directory, "" for the current one
+	char *buffer;					// the records read by getdents64()
+	char **names;					// name of each entry, inside buffer
+	unsigned char *types;			// type of each entry, e.g. DT_DIR, or DT_UNKNOWN
+	int iNumNames;					// number of entries, without . and ..
+	struct GlobDirectory *next;		// next directory in the same bucket
+} GlobDirectory;
+
+#define GLOB_DIRECTORY_BUCKETS 64
+
+// Bytes asked for by each getdents64() call
+#define GLOB_READ_SIZE (256 * 1024)
+
+// Directories read while expanding the current command line,
+// see expandCommandLine(). A command may change them, so they
+// are not kept for the next one.
+GlobDirectory *globDirectories[GLOB_DIRECTORY_BUCKETS];
+
+// getGlobDirectory() function returns the entries of the
+// directory "path", reading it the first time it is asked
+// for while the current command line is expanded.
+GlobDirectory* getGlobDirectory(const char *path)
+{
+	unsigned int iBucket = hashString(path) % GLOB_DIRECTORY_BUCKETS;
+	GlobDirectory *dir;
+	size_t iAllocated = 0;
+	size_t iUsed = 0;
+	size_t iPos;
+	int iAllocatedNames = 0;
+	int fd;
+
+	for (dir = globDirectories[iBucket]; dir; dir = dir->next)
+		if (strcmp(dir->path, path) == 0)
+			return dir;
+
+	dir = calloc(1, sizeof(GlobDirectory));
+	dir->path = strdup(path);
+	dir->next = globDirectories[iBucket];
+	globDirectories[iBucket] = dir;
+
+	// A directory that can't be read has no entries
+	fd = open((path[0] != '\0') ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return dir;
+
+	while (1)
+	{
+		ssize_t n;
+
+		if (iAllocated - iUsed < GLOB_READ_SIZE)
+		{
+			iAllocated = iAllocated ? 2 * iAllocated : GLOB_READ_SIZE;
+			dir->buffer = realloc(dir->buffer, iAllocated);
+		}
+
+		n = getdents64(fd, dir->buffer + iUsed, iAllocated - iUsed);
+
+		if ((n < 0) && (errno == EINTR))
+			continue;
+
+		if (n <= 0)
+			break;
+
+		iUsed += n;
+	}
+
+	close(fd);
+
+	// The buffer doesn't move any more, the
+	// names can point into it from now on
+	for (iPos = 0; iPos < iUsed; )
+	{
+		struct dirent64 *entry = (struct dirent64 *) (dir->buffer + iPos);
+		const char *name = entry->d_name;
+
+		iPos += entry->d_reclen;
+
+		if ((name[0] == '.') && ((name[1] == '\0') || ((name[1] == '.') && (name[2] == '\0'))))
+			continue;
+
+		if (dir->iNumNames == iAllocatedNames)
+		{
+			iAllocatedNames = iAllocatedNames ? 2 * iAllocatedNames : 256;
+			dir->names = realloc(dir->names, iAllocatedNames * sizeof(char *));
+			dir->types = realloc(dir->types, iAllocatedNames);
+		}
+
+		dir->names[dir->iNumNames] = entry->d_name;
+		dir->types[dir->iNumNames++] = entry->d_type;
+	}
+
+	return dir;
+}
+
+// clearGlobDirectories() function forgets the
+// directories read for the current command line.
+void clearGlobDirectories()
+{
+	int i;
+
+	for (i = 0; i < GLOB_DIRECTORY_BUCKETS; ++i)
+	{
+		while (globDirectories[i] != NULL)
+		{
+			GlobDirectory *next = globDirectories[i]->next;
+
+			free(globDirectories[i]->path);
+			free(globDirectories[i]->buffer);
+			free(globDirectories[i]->names);
+			free(globDirectories[i]->types);
+			free(globDirectories[i]);
+			globDirectories[i] = next;
+		}
+	}
+}
+
+// Values of GlobPattern.ops above those of the bytes
+#define GLOB_ANY 256				// ?, any character
+#define GLOB_STAR 257				// *, any number of characters
+#define GLOB_SET 258				// [...], GLOB_SET + i is the i-th set of the pattern
+
+// GlobPattern structure type is one component of a pattern,
+// i.e. the part between two /, compiled by compileGlobPattern()
+// for matchGlob(). Each operation matches one character, a
+// given byte, any byte or one of a set, except GLOB_STAR,
+// which matches any number of them.
+typedef struct
+{
+	short *ops;						// the operations, a byte value or one of the GLOB_ values
+	int iNumOps;					// number of operations
+	unsigned char (*sets)[32];		// the sets of [...], as bitmaps of the 256 byte values
+	char *text;						// the component as a plain name, without markers
+	size_t iTextLength;				// length of text
+	char *suffix;					// the plain bytes at the end, checked first
+	size_t iSuffixLength;			// number of them
+	int iMagic;						// 1 if it has a *, ? or [...], otherwise text is just a name
+	int iMatchDot;					// 1 if it starts with a ., only then a name starting with . matches
+	int iGlobStar;					// 1 if it is ** alone, which matches any number of directories
+} GlobPattern;
+
+// compileGlobPattern() function compiles the first "iLength"
+// bytes of "p" into "pattern". Only the *, ? and [ marked by
+// the lexer with GLOB_ACTIVE are pattern characters. Inside
+// [...] a ! or ^ first takes the complement of the set, a ]
+// first is part of the set, and a-z is a range. A [ without
+// its ] is an ordinary character. Everything is allocated
+// from the command arena.
+void compileGlobPattern(const char *p, size_t iLength, GlobPattern *pattern)
+{
+	int iNumSets = 0;
+	size_t i;
+
+	pattern->ops = arenaAlloc(&commandArena, (iLength + 1) * sizeof(short));
+	pattern->sets = arenaAlloc(&commandArena, (iLength / 2 + 1) * 32);
+	pattern->text = arenaAlloc(&commandArena, iLength + 1);
+	pattern->iNumOps = 0;
+	pattern->iTextLength = 0;
+	pattern->iMagic = 0;
+	pattern->iGlobStar = (iLength == 4) && (memcmp(p, "\003*\003*", 4) == 0);
+
+	for (i = 0; i < iLength; )
+	{
+		if ((p[i] != GLOB_ACTIVE) || (i + 1 == iLength))
+		{
+			pattern->text[pattern->iTextLength++] = p[i];
+			pattern->ops[pattern->iNumOps++] = (unsigned char) p[i++];
+			continue;
+		}
+
+		pattern->text[pattern->iTextLength++] = p[i + 1];
+
+		if (p[i + 1] == '*')
+		{
+			// ** is the same as * inside a name
+			if ((pattern->iNumOps == 0) || (pattern->ops[pattern->iNumOps - 1] != GLOB_STAR))
+				pattern->ops[pattern->iNumOps++] = GLOB_STAR;
+			pattern->iMagic = 1;
+			i += 2;
+		}
+		else if (p[i + 1] == '?')
+		{
+			pattern->ops[pattern->iNumOps++] = GLOB_ANY;
+			pattern->iMagic = 1;
+			i += 2;
+		}
+		else
+		{
+			unsigned char *set = pattern->sets[iNumSets];
+			size_t j = i + 2;
+			int iNegate = (j < iLength) && ((p[j] == '!') || (p[j] == '^'));
+			int iFirst = 1;
+			int c;
+
+			memset(set, 0, 32);
+			j += iNegate;
+
+			while ((j < iLength) && ((p[j] != ']') || iFirst))
+			{
+				unsigned char from, to;
+
+				// A * or ? in the set has a marker before it
+				if (p[j] == GLOB_ACTIVE)
+				{
+					j++;
+					continue;
+				}
+
+				from = to = p[j++];
+
+				if ((j + 1 < iLength) && (p[j] == '-') && (p[j + 1] != ']'))
+				{
+					to = p[j + 1];
+					j += 2;
+				}
+
+				for (c = from; c <= to; ++c)
+					set[c / 8] |= 1 << (c % 8);
+
+				iFirst = 0;
+			}
+
+			if (j == iLength)
+			{
+				// No ], the [ is just a [
+				pattern->ops[pattern->iNumOps++] = '[';
+				i += 2;
+				continue;
+			}
+
+			if (iNegate)
+				for (c = 0; c < 32; ++c)
+					set[c] = ~set[c];
+
+			// A / is never part of a name
+			set['/' / 8] &= ~(1 << ('/' % 8));
+
+			pattern->ops[pattern->iNumOps++] = GLOB_SET + iNumSets++;
+			pattern->iMagic = 1;
+
+			memcpy(pattern->text + pattern->iTextLength, p + i + 2, j - i - 1);
+			pattern->iTextLength += j - i - 1;
+			i = j + 1;
+		}
+	}
+
+	pattern->text[pattern->iTextLength] = '\0';
+	pattern->iMatchDot = (pattern->iNumOps > 0) && (pattern->ops[0] == '.');
+
+	// The plain bytes at the end rule out most names at once,
+	// as the ".log" of "*.log" does
+	pattern->iSuffixLength = 0;
+
+	while ((pattern->iSuffixLength < (size_t) pattern->iNumOps) &&
+		   (pattern->ops[pattern->iNumOps - 1 - pattern->iSuffixLength] < GLOB_ANY))
+		pattern->iSuffixLength++;
+
+	pattern->suffix = arenaAlloc(&commandArena, pattern->iSuffixLength + 1);
+
+	for (i = 0; i < pattern->iSuffixLength; ++i)
+		pattern->suffix[i] = (char) pattern->ops[pattern->iNumOps - pattern->iSuffixLength + i];
+}
+
+// matchGlob() function returns 1 if the file name "name"
+// matches "pattern". A * goes back to match one more
+// character when the rest doesn't match, only the last *
+// ever has to, so a name is gone over about once.
+int matchGlob(GlobPattern *pattern, const char *name)
+{
+	const short *op = pattern->ops;
+	const short *end = pattern->ops + pattern->iNumOps;
+	const short *starOp = NULL;
+	const char *starName = NULL;
+	size_t iLength = strlen(name);
+
+	if ((name[0] == '.') && !pattern->iMatchDot)
+		return 0;
+
+	if ((iLength < pattern->iSuffixLength) ||
+		(memcmp(name + iLength - pattern->iSuffixLength, pattern->suffix, pattern->iSuffixLength) != 0))
+		return 0;
+
+	while (*name != '\0')
+	{
+		unsigned char c = *name;
+
+		if ((op < end) && (*op == GLOB_STAR))
+		{
+			starOp = ++op;
+			starName = name;
+			continue;
+		}
+
+		if ((op < end) && ((*op == c) || (*op == GLOB_ANY) ||
+						   ((*op >= GLOB_SET) && (pattern->sets[*op - GLOB_SET][c / 8] & (1 << (c % 8))))))
+		{
+			op++;
+			name++;
+			continue;
+		}
+
+		if (starOp == NULL)
+			return 0;
+
+		op = starOp;
+		name = ++starName;
+	}
+
+	while ((op < end) && (*op == GLOB_STAR))
+		op++;
+
+	return op == end;
+}
+
+// Globber structure type holds the state of
+// the expansion of one pattern by expandGlob().
+typedef struct
+{
+	GlobPattern *patterns;			// the components of the pattern
+	int iNumPatterns;				// number of components
+	LineBuffer path;				// the path matched so far
+	LineBuffer matches;				// the paths found, each one followed by a NUL
+	int iNumMatches;				// number of paths found
+} Globber;
+
+// addGlobMatch() function adds the path matched
+// so far to the paths found.
+void addGlobMatch(Globber *g)
+{
+	insertIntoLineBuffer(&g->matches, g->matches.iLength, g->path.text, g->path.iLength + 1);
+	g->iNumMatches++;
+}
+
+// isGlobDirectory() function returns 1 if the entry "i" of
+// "dir", whose path is the one matched so far, is a directory.
+// Only when getdents64() didn't tell, or for a link that is
+// followed, is the entry itself looked at.
+int isGlobDirectory(Globber *g, GlobDirectory *dir, int i, int iFollowLinks)
+{
+	struct stat st;
+
+	if (dir->types[i] == DT_DIR)
+		return 1;
+
+	if (dir->types[i] == DT_UNKNOWN)
+		return (lstat(g->path.text, &st) == 0) && S_ISDIR(st.st_mode);
+
+	if ((dir->types[i] == DT_LNK) && iFollowLinks)
+		return (stat(g->path.text, &st) == 0) && S_ISDIR(st.st_mode);
+
+	return 0;
+}
+
+// globFrom() function finds the paths matching the
+// components of the pattern from "i" on, in the directory
+// matched so far. A plain name is just added to the path,
+// and only checked to exist if it is the last component.
+// A ** matches any number of directories, without going
+// into the ones that start with a . or are links.
+void globFrom(Globber *g, int i)
+{
+	GlobPattern *pattern = &g->patterns[i];
+	size_t iPathLength = g->path.iLength;
+	int iLast = (i + 1 == g->iNumPatterns);
+	GlobDirectory *dir;
+	int j;
+
+	if (!pattern->iMagic)
+	{
+		struct stat st;
+
+		insertIntoLineBuffer(&g->path, iPathLength, pattern->text, pattern->iTextLength);
+
+		if (!iLast)
+		{
+			appendToLineBuffer(&g->path, '/');
+			globFrom(g, i + 1);
+		}
+		else if (lstat(g->path.text, &st) == 0)
+		{
+			addGlobMatch(g);
+		}
+
+		deleteFromLineBuffer(&g->path, iPathLength, g->path.iLength);
+		return;
+	}
+
+	// ** matching no directory at all
+	if (pattern->iGlobStar && !iLast)
+		globFrom(g, i + 1);
+
+	dir = getGlobDirectory(g->path.text);
+
+	for (j = 0; j < dir->iNumNames; ++j)
+	{
+		const char *name = dir->names[j];
+
+		if (pattern->iGlobStar ? (name[0] == '.') : !matchGlob(pattern, name))
+			continue;
+
+		insertIntoLineBuffer(&g->path, iPathLength, name, strlen(name));
+
+		// A ** at the end matches everything below
+		if (iLast)
+			addGlobMatch(g);
+
+		if ((!iLast || pattern->iGlobStar) && isGlobDirectory(g, dir, j, !pattern->iGlobStar))
+		{
+			appendToLineBuffer(&g->path, '/');
+			globFrom(g, pattern->iGlobStar ? i : i + 1);
+		}
+
+		deleteFromLineBuffer(&g->path, iPathLength, g->path.iLength);
+	}
+}
+
+// expandGlob() function adds the paths matching the pattern
+// in the first "iLength" bytes of "text" to "fields", sorted
+// by strcmp(). They are copied into the command arena in a
+// single block. It returns the number of paths added, 0 if
+// there is none or if the text is not a pattern after all,
+// e.g. a lone [. Then the caller uses the text itself.
+int expandGlob(const char *text, size_t iLength, ParseScratch *fields)
+{
+	static Globber g;
+	static ParseScratch sorted;
+	int iNumPatterns = 1;
+	int iMagic = 0;
+	char *block;
+	size_t i, iStart;
+	int j;
+
+	for (i = 0; i < iLength; ++i)
+		iNumPatterns += (text[i] == '/');
+
+	g.patterns = arenaAlloc(&commandArena, iNumPatterns * sizeof(GlobPattern));
+	g.iNumPatterns = 0;
+
+	for (i = 0, iStart = 0; i <= iLength; ++i)
+	{
+		if ((i == iLength) || (text[i] == '/'))
+		{
+			compileGlobPattern(text + iStart, i - iStart, &g.patterns[g.iNumPatterns]);
+			iMagic |= g.patterns[g.iNumPatterns++].iMagic;
+			iStart = i + 1;
+		}
+	}
+
+	if (!iMagic)
+		return 0;
+
+	setLineBuffer(&g.path, "", 0);
+	setLineBuffer(&g.matches, "", 0);
+	g.iNumMatches = 0;
+
+	globFrom(&g, 0);
+
+	if (g.iNumMatches == 0)
+		return 0;
+
+	block = arenaAlloc(&commandArena, g.matches.iLength);
+	memcpy(block, g.matches.text, g.matches.iLength);
+
+	sorted.iCount = 0;
+
+	for (i = 0; i < g.matches.iLength; i += strlen(block + i) + 1)
+		addToScratch(&sorted, block + i);
+
+	qsort(sorted.items, sorted.iCount, sizeof(char *), compareStrings);
+
+	for (j = 0; j < sorted.iCount; ++j)
+		addToScratch(fields, sorted.items[j]);
+
+	return sorted.iCount;
+}
+
+// removeGlobMarkers() function removes the GLOB_ACTIVE
+// markers from "text", for a word that is not expanded
+// as a pattern.
+void removeGlobMarkers(char *text)
+{
+	char *out = text;
+
+	for (; *text != '\0'; ++text)
+		if (*text != GLOB_ACTIVE)
+			*out++ = *text;
+
+	*out = '\0';
+}
+
+// Process ID of the shell, the value of $$. A child shell
+// running a line in the background keeps the one of the
+// shell it was started from, like in other shells.
+pid_t shellPid;
+
+// Name the shell was started with, the value of $0
+const char *shellName = "cshell";
+
+// Expander structure type holds the state of the
+// expansion of one word, see expandWord().
+typedef struct
+{
+	LineBuffer field;				// text of the word being built
+	int iStarted;					// 1 once the word exists, even if it is empty, as for ""
+	ParseScratch *fields;			// where the finished words go, NULL to make a single word
+	int iGlob;						// 1 if the word has an unquoted *, ? or [
+	int iError;						// 1 after a bad ${...}
+} Expander;
+
+// finishExpandedField() function copies the word built
+// so far into the command arena and starts the next one.
+// A word with an unquoted *, ? or [ is replaced with the
+// paths it matches, if there are any.
+void finishExpandedField(Expander *ex)
+{
+	char *word;
+
+	if (!ex->iGlob || (expandGlob(ex->field.text, ex->field.iLength, ex->fields) == 0))
+	{
+		word = arenaStrndup(&commandArena, ex->field.text, ex->field.iLength);
+
+		if (ex->iGlob)
+			removeGlobMarkers(word);
+
+		addToScratch(ex->fields, word);
+	}
+
+	setLineBuffer(&ex->field, "", 0);
+	ex->iStarted = 0;
+	ex->iGlob = 0;
+}
+
+// addExpandedText() function adds text to the word being
+// built. If "iSplit" is 1 the text is the value of an
+// unquoted $, which is split into several words at spaces,
+// tabs and newlines, the default value of IFS. The *, ?
+// and [ in such a value are pattern characters too.
+void addExpandedText(Expander *ex, const char *text, size_t iLength, int iSplit)
+{
+	size_t i;
+
+	if (!iSplit || (ex->fields == NULL))
+	{
+		insertIntoLineBuffer(&ex->field, ex->field.iLength, text, iLength);
+		ex->iStarted = 1;
+		ex->iGlob |= (memchr(text, GLOB_ACTIVE, iLength) != NULL);
+		return;
+	}
+
+	for (i = 0; i < iLength; ++i)
+	{
+		if ((text[i] == ' ') || (text[i] == '\t') || (text[i] == '\n'))
+		{
+			if (ex->iStarted)
+				finishExpandedField(ex);
+		}
+		else
+		{
+			if ((text[i] == '*') || (text[i] == '?') || (text[i] == '['))
+			{
+				appendToLineBuffer(&ex->field, GLOB_ACTIVE);
+				ex->iGlob = 1;
+			}
+
+			appendToLineBuffer(&ex->field, text[i]);
+			ex->iStarted = 1;
+		}
+	}
+}
+
+// getParameter() function returns the value of the
+// parameter whose name is the first "iLength" characters
+// of "name": a variable, or one of $?, $$ and $0. It
+// returns NULL if it isn't set. "number" is where a
+// number is written to.
+const char* getParameter(const char *name, size_t iLength, char *number)
+{
+	if ((iLength == 1) && (name[0] == '?'))
+	{
+		sprintf(number, "%d", iLastStatus);
+		return number;
+	}
+
+	if ((iLength == 1) && (name[0] == '$'))
+	{
+		sprintf(number, "%d", (int) shellPid);
+		return number;
+	}
+
+	// There are no positional parameters
+	if ((name[0] >= '0') && (name[0] <= '9'))
+		return ((iLength == 1) && (name[0] == '0')) ? shellName : NULL;
+
+	return getVariable(arenaStrndup(&commandArena, name, iLength));
+}
+
+void expandText(Expander *ex, const char *p, const char *end, int iSplit);	// forward declaration
+
+// expandParameter() function adds the value of the $ whose
+// marker has been found right before "p" to the word being
+// built. It is a special parameter like $?, or a name or
+// ${name:-word} in braces, see readDollar(). The word is
+// used when the variable is unset or empty, and just unset
+// for ${name-word}. It returns where the text goes on.
+const char* expandParameter(Expander *ex, const char *p, const char *end, int iSplit)
+{
+	char number[16];
+	const char *value;
+	const char *close;
+	const char *name;
+	size_t iNameLength;
+	int iDepth = 0;
+
+	if (*p != '{')
+	{
+		value = getParameter(p, 1, number);
+		addExpandedText(ex, value ? value : "", value ? strlen(value) : 0, iSplit);
+		return p + 1;
+	}
+
+	for (close = p; close < end; ++close)
+	{
+		iDepth += (*close == '{') - (*close == '}');
+
+		if (iDepth == 0)
+			break;
+	}
+
+	name = p + 1;
+
+	if ((*name == '?') || (*name == '$') || ((*name >= '0') && (*name <= '9')))
+		iNameLength = 1;
+	else
+		for (iNameLength = 0; isValidName(name, iNameLength + 1) && (name + iNameLength < close); ++iNameLength)
+			;
+
+	if ((close == end) || (iNameLength == 0) ||
+		((name[iNameLength] != '}') && (name[iNameLength] != '-') &&
+		 ((name[iNameLength] != ':') || (name[iNameLength + 1] != '-'))))
+	{
+		fprintf(stderr, "$%.*s: bad substitution\n", (int) (close - p + (close < end)), p);
+		ex->iError = 1;
+		return end;
+	}
+
+	value = getParameter(name, iNameLength, number);
+
+	if (name[iNameLength] != '}')
+	{
+		int iColon = (name[iNameLength] == ':');
+
+		if ((value == NULL) || (iColon && (value[0] == '\0')))
+		{
+			expandText(ex, name + iNameLength + 1 + iColon, close, iSplit);
+			return close + 1;
+		}
+	}
+
+	addExpandedText(ex, value ? value : "", value ? strlen(value) : 0, iSplit);
+	return close + 1;
+}
+
+// expandText() function adds the text from "p" to "end"
+// to the word being built, with the values of the $ in
+// it. "iSplit" tells if the text itself is split into
+// words, as the default value in ${name:-word} is.
+void expandText(Expander *ex, const char *p, const char *end, int iSplit)
+{
+	while ((p < end) && !ex->iError)
+	{
+		const char *q = p;
+
+		while ((q < end) && (*q != EXPAND_UNQUOTED) && (*q != EXPAND_QUOTED))
+			q++;
+
+		if (q > p)
+			addExpandedText(ex, p, q - p, iSplit);
+
+		p = (q < end) ? expandParameter(ex, q + 1, end, *q == EXPAND_UNQUOTED) : q;
+	}
+}
+
+// expandWord() function expands the $ and the patterns in
+// the text of a word, as marked by the lexer. With "fields"
+// set, the resulting words are added to it, there may be
+// none at all or several of them, as for $empty, $list or
+// *.c. It returns NULL then. Otherwise, e.g. for the file
+// name of a redirection, it returns the whole text as a
+// single word, patterns and all. A word without any $ or
+// pattern is used as it is.
+char* expandWord(Expander *ex, char *word, ParseScratch *fields)
+{
+	char *text;
+
+	if (word[strcspn(word, "\001\002\003")] == '\0')
+	{
+		if (fields != NULL)
+			addToScratch(fields, word);
+		return word;
+	}
+
+	ex->fields = fields;
+	ex->iStarted = 0;
+	ex->iGlob = 0;
+	setLineBuffer(&ex->field, "", 0);
+
+	expandText(ex, word, word + strlen(word), 0);
+
+	if (fields == NULL)
+	{
+		text = arenaStrndup(&commandArena, ex->field.text, ex->field.iLength);
+		removeGlobMarkers(text);
+		return text;
+	}
+
+	if (ex->iStarted)
+		finishExpandedField(ex);
+
+	return NULL;
+}
+
+// expandCommandLine() function returns a copy of "cmdLine"
+// with the values of the variables in place of the $ in its
+// words, made in the command arena. The parsed form of the
+// line is not changed, so that the parse cache can keep it
+// and the line is expanded again each time it runs. The
+// arguments of a command are split into words at the
+// unquoted $, and the patterns among them are replaced with
+// the paths they match. The other words stay single words.
+// The directories read for the patterns are only kept until
+// the line is expanded. It returns NULL after printing a
+// message if a $ can't be expanded.
+CommandLine* expandCommandLine(CommandLine *cmdLine)
+{
+	static Expander ex;
+	static ParseScratch fields;
+	CommandLine *line = arenaAlloc(&commandArena, sizeof(CommandLine));
+	int i, j;
+
+	*line = *cmdLine;
+	line->iExpand = 0;
+	line->commands = arenaAlloc(&commandArena, cmdLine->iNumCommands * sizeof(SimpleCommand));
+	ex.iError = 0;
+
+	for (i = 0; (i < cmdLine->iNumCommands) && !ex.iError; ++i)
+	{
+		SimpleCommand *from = &cmdLine->commands[i];
+		SimpleCommand *to = &line->commands[i];
+		Redirection **lastRedirection = &to->redirections;
+		Redirection *redirection;
+
+		fields.iCount = 0;
+
+		for (j = 0; j < from->iNumArgs; ++j)
+			expandWord(&ex, from->args[j], &fields);
+
+		// A stage of a pipe chain can't just vanish
+		if ((fields.iCount == 0) && (from->iNumArgs > 0) && (cmdLine->iNumCommands > 1))
+			addToScratch(&fields, "");
+
+		to->iNumArgs = fields.iCount;
+		to->args = arenaAlloc(&commandArena, (fields.iCount + 1) * sizeof(char *));
+		if (fields.iCount > 0)
+			memcpy(to->args, fields.items, fields.iCount * sizeof(char *));
+		to->args[fields.iCount] = NULL;
+
+		to->iNumAssignments = from->iNumAssignments;
+		to->assignments = arenaAlloc(&commandArena, (from->iNumAssignments + 1) * sizeof(char *));
+
+		for (j = 0; j < from->iNumAssignments; ++j)
+			to->assignments[j] = expandWord(&ex, from->assignments[j], NULL);
+
+		to->assignments[from->iNumAssignments] = NULL;
+
+		for (redirection = from->redirections; redirection; redirection = redirection->next)
+		{
+			*lastRedirection = arenaAlloc(&commandArena, sizeof(Redirection));
+			**lastRedirection = *redirection;
+			(*lastRedirection)->target = expandWord(&ex, redirection->target, NULL);
+			lastRedirection = &(*lastRedirection)->next;
+		}
+
+		*lastRedirection = NULL;
+	}
+
+	clearGlobDirectories();
+
+	return ex.iError ? NULL : line;
+}
+
+// countTeeRedirections() function returns the number of
+// |> and |>> redirections in "cmdLine". If "pTee" is not
+// NULL it is set to the last one found.
+int countTeeRedirections(CommandLine *cmdLine, Redirection **pTee)
+{
+	Redirection *redirection;
+	int iCount = 0;
+	int i;
+
+	for (i = 0; i < cmdLine->iNumCommands; ++i)
+	{
+		for (redirection = cmdLine->commands[i].redirections; redirection; redirection = redirection->next)
+		{
+			if ((redirection->type == Redirect_Tee) || (redirection->type == Redirect_Tee_Append))
+			{
+				if (pTee != NULL)
+					*pTee = redirection;
+				iCount++;
+			}
+		}
+	}
+
+	return iCount;
+}
+
+// executeCommandLine() function executes a parsed user
+// command based on its type. Its $ are expanded first. A
+// line of variable assignments alone sets them in the shell,
+// and a builtin command on its own is run by the shell
+// itself, before anything else. Everything else becomes a
+// job: its processes are all started first, then the shell
+// waits for the job, or leaves it running in the background
+// if the line ends with &.
+void executeCommandLine(CommandLine *cmdLine)
+{
+	char **arguments;
+	Redirection *tee = NULL;
+
+	if (cmdLine->iExpand)
+	{
+		cmdLine = expandCommandLine(cmdLine);
+
+		if (cmdLine == NULL)
+		{
+			iLastStatus = 1;
+			return;
+		}
+	}
+
+	arguments = cmdLine->commands[0].args;
+
+	// Assignments, or a command that expanded to nothing.
+	// Its redirections are still made, like in other shells.
+	if (cmdLine->commands[0].iNumArgs == 0)
+	{
+		SimpleCommand command = cmdLine->commands[0];
+		char *args[] = { (char *) shellName, NULL };
+		int i;
+
+		for (i = 0; i < command.iNumAssignments; ++i)
+			assignVariable(command.assignments[i], 0);
+
+		command.args = args;
+		command.iNumAssignments = 0;
+		iLastStatus = command.redirections ? runBuiltin(findBuiltin("true"), &command) : 0;
+		return;
+	}
+
+	// The shell copies the output of |> and |>> itself,
+	// which it only does for one single command.
+	if (countTeeRedirections(cmdLine, &tee) > (cmdLine->type == Output_Tee || cmdLine->type == Output_Tee_Append))
+	{
+		fprintf(stderr, "|> and |>> can only be used once, on a single command.\n");
+		iLastStatus = 2;
+		return;
+	}
+
+	if ((cmdLine->type == Simple) && !cmdLine->iBackground)
+	{
+		// A |> or |>> redirection needs the shell to copy
+		// the output, so such a builtin runs in a child.
+		const Builtin *builtin = findBuiltin(arguments[0]);
+
+		if ((builtin != NULL) && (cmdLine->iTimed || (iTimeAll && (builtin->function != executeTime))))
+		{
+			iLastStatus = runTimedBuiltin(builtin, &cmdLine->commands[0]);
+			return;
+		}
+
+		if (builtin != NULL)
+		{
+			iLastStatus = runBuiltin(builtin, &cmdLine->commands[0]);
+			return;
+		}
+	}
+
+	Job *job = createJob(cmdLine);
+
+	if (cmdLine->iBackground &&
+		((cmdLine->type == Output_Tee) || (cmdLine->type == Output_Tee_Append) || (cmdLine->type == Fan_Out)))
+	{
+		// The shell itself copies the data of these, so in
+		// the background a child shell has to do it.
+		LaunchSpec spec;
+
+		initLaunchSpec(&spec, NULL, arguments);
+		spec.subshell = cmdLine;
+		launchInJob(job, &spec);
+		completeJob(job, cmdLine);
+		return;
+	}
+
+	switch (cmdLine->type)
+	{
+	case Simple:
+		// There is no pipe in the command, only
+		// redirections if any. Execute it normally.
+		executeNormal(&cmdLine->commands[0], job);
+		break;
+	case Output_Tee:
+		// There is |> operator in command. Execute it
+		// accordingly (iAppend flag should be passed as 0).
+		executeTeeRedirect(&cmdLine->commands[0], tee->target, 0, job);
+		break;
+	case Output_Tee_Append:
+		// There is |>> operator in command. Execute it
+		// accordingly (iAppend flag should be passed as 1).
+		executeTeeRedirect(&cmdLine->commands[0], tee->target, 1, job);
+		break;
+	case Piped_Chain:
+		// There is one or more | operators in command.
+		// Execute it accordingly.
+		executePipedChain(cmdLine, job);
+		break;
+	case Fan_Out:
+		// There is || or ||| fan-out operator in command.
+		// Execute it accordingly.
+		executeFanOut(cmdLine, job);
+		break;
+	default:
+		// Unexpected, do error handling etc.
+		break;
 	}
 
-	// Write the contents of "buff" variable into
-	// the write end of a new pipe p4. The read
-	// end of pipe p4 will be used later as input
-	// for the fourth command.
-	int p4[2];
-	pipe(p4);
-	write(p4[1], buff, iNumRead);
+	// Wait for the job, or let it run in the background
+	completeJob(job, cmdLine);
+}
+
+// traceCommandLine() function records the execution of
+// "cmdLine" from "startTime" until now, with its structure
+// and its exit status. The processes it started are in the
+// "launch" and "process" events of the same line.
+void traceCommandLine(CommandLine *cmdLine, double startTime)
+{
+	static const char *types[] =
+	{
+		"simple", "tee", "tee append", "pipe chain", "fan-out"
+	};
+	char *text = formatJobCommand(cmdLine);
+	TraceArgs args;
+
+	initTraceArgs(&args);
+	addTraceString(&args, "line", text);
+	addTraceString(&args, "type", types[cmdLine->type]);
+	addTraceNumber(&args, "commands", cmdLine->iNumCommands);
+	addTraceNumber(&args, "background", cmdLine->iBackground);
+	addTraceNumber(&args, "status", iLastStatus);
+	traceEvent("command", startTime, getMonotonicTime(), getpid(), &args);
+
+	free(text);
+}
+
+// PromptCache structure type holds the parts of the prompt
+// that take I/O to find out: the git branch of the current
+// directory and the load average. A background thread finds
+// them, and the prompt shows the values found last, so that
+// showing it never waits for a slow file system. A value
+// older than PROMPT_SEGMENT_TTL is found again for the next
+// prompt.
+typedef struct
+{
+	pthread_mutex_t lock;			// protects everything below but thread and iThreadStarted
+	pthread_t thread;				// the thread finding the values
+	int iThreadStarted;				// 1 if "thread" still has to be joined
+	int iRunning;					// 1 while the thread runs
+	char *gitDirectory;				// directory the branch was found for, or NULL
+	char gitBranch[256];			// its git branch, or "" if it isn't in a repository
+	double gitTime;					// when the branch was found, see getMonotonicTime()
+	char loadAverage[16];			// load average of the last minute
+	double loadTime;				// when it was read, 0 if never
+} PromptCache;
+
+// PromptRequest structure type tells the thread of the
+// PromptCache which values to find.
+typedef struct
+{
+	char *gitDirectory;				// directory to find the git branch of, or NULL
+	int iLoadAverage;				// 1 to read the load average
+} PromptRequest;
+
+// Seconds a value of the PromptCache is shown without being found again
+#define PROMPT_SEGMENT_TTL 2.0
 
-	// Run the fourth command as a child process.
-	pid = fork();
+// Prompt used when PS1 isn't set: the current directory followed by $
+#define DEFAULT_PS1 "\\w$ "
 
-	if (pid == 0)
-	{
-		// Use read end of p4 pipe as input to run the fourth command
-		close(p4[1]);				// we don't need the write end of p4 pipe
-		dup2(p4[0], STDIN_FILENO);	// don't read from standard input, read from read end of p4 pipe instead
-		execvp(fourthCommand[0], fourthCommand);
-	}
+// Values shown in the prompt that take I/O to find out
+PromptCache promptCache = { PTHREAD_MUTEX_INITIALIZER };
+
+// readGitHead() function reads the HEAD file "path" of a
+// git repository into "branch": the name of the branch,
+// or the start of the commit id when no branch is checked
+// out. It returns 0 on success and -1 on error.
+int readGitHead(const char *path, char *branch, size_t iSize)
+{
+	char head[256];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, head, sizeof(head) - 1);
+	close(fd);
+
+	if (n <= 0)
+		return -1;
+
+	head[n] = '\0';
+	head[strcspn(head, "\n")] = '\0';
+
+	if (strncmp(head, "ref: refs/heads/", 16) == 0)
+		snprintf(branch, iSize, "%s", head + 16);
+	else if (strncmp(head, "ref: ", 5) == 0)
+		snprintf(branch, iSize, "%s", head + 5);
 	else
-	{
-		close(p4[0]);
-		close(p4[1]);
-		wait(&status);
-	}
+		snprintf(branch, iSize, "%.7s", head);
 
-	printExecutionStatus(pid, status);
+	return 0;
 }
 
-// executeTriplePipe() function is used to execute a command
-// with ||| triple-pipe operator in it. This command looks like:
-// 			ls -l || wc -w, grep abc, wc -l
-// i.e. the output of first command before ||| operator should
-// be passed as input to the next three comma-separated commands.
-// In the above example, output of ls -l should be passed as
-// input to wc -w, grep abc and wc -l commands.
-void executeTriplePipe(char **args)
-{
-	const int BUFF_SIZE = 32;
-	int iCurrentCommand = 1;
-	int i = 0, j = 0, k = 0, l = 0, iPos = 0;
-	int iNullFound = 0;
-	int iLen = 0;
-
-	// The given "args" parameter actually contains arguments
-	// for 4 commands. The first command is the one before the
-	// ||| operator whose output is to be passed to the second,
-	// third and fourth commands which are the 3 comma-separated
-	// commands. The below while loop will split "args" into
-	// 4 separate commands.
-	char **firstCommand   = malloc(BUFF_SIZE * sizeof(char *));
-	char **secondCommand  = malloc(BUFF_SIZE * sizeof(char *));
-	char **thirdCommand   = malloc(BUFF_SIZE * sizeof(char *));
-	char **fourthCommand   = malloc(BUFF_SIZE * sizeof(char *));
+// findGitBranch() function finds the git repository that
+// "directory" belongs to, going up towards / until a .git
+// is found, and stores its branch in "branch", or "" if
+// there is no repository. A .git file, as in a worktree or
+// a submodule, names the directory the HEAD is in.
+void findGitBranch(const char *directory, char *branch, size_t iSize)
+{
+	size_t iLength = strlen(directory);
+	char *path = malloc(iLength + 4096 + 16);
 
-	while (!iNullFound)
-	{
-		switch (iCurrentCommand)
-		{
-		case 1:
-			if (strcmp(args[iPos], "|||") == 0)
-				iCurrentCommand++;	// now first command ends, second starts
-			else
-				firstCommand[i++] = args[iPos];
-			break;
-		case 2:
-			iLen = strlen(args[iPos]);
+	branch[0] = '\0';
+	memcpy(path, directory, iLength + 1);
 
-			if (strcmp(args[iPos],",") == 0)
-			{
-				iCurrentCommand++;	// now second command ends, third starts
-			}
-			else if (args[iPos][iLen-1] == ',')
-			{
-				args[iPos][iLen-1] = '\0';
-				secondCommand[j++] = args[iPos];
-				iCurrentCommand++;	// now second command ends, third starts
-			}
-			else
-			{
-				secondCommand[j++] = args[iPos];
-			}
+	while (iLength > 0)
+	{
+		struct stat st;
 
-			break;
-		case 3:
-			iLen = strlen(args[iPos]);
+		strcpy(path + iLength, "/.git");
 
-			if (strcmp(args[iPos],",") == 0)
-			{
-				iCurrentCommand++;	// now third command ends, fourth starts
-			}
-			else if (args[iPos][iLen-1] == ',')
+		if (stat(path, &st) == 0)
+		{
+			if (S_ISDIR(st.st_mode))
 			{
-				args[iPos][iLen-1] = '\0';
-				thirdCommand[k++] = args[iPos];
-				iCurrentCommand++;	// now third command ends, fourth starts
+				strcat(path, "/HEAD");
+				readGitHead(path, branch, iSize);
 			}
-			else
+			else if (S_ISREG(st.st_mode))
 			{
-				thirdCommand[k++] = args[iPos];
+				char link[4096];
+				int fd = open(path, O_RDONLY | O_CLOEXEC);
+				ssize_t n = (fd >= 0) ? read(fd, link, sizeof(link) - 1) : -1;
+
+				if (fd >= 0)
+					close(fd);
+
+				if ((n > 8) && (strncmp(link, "gitdir: ", 8) == 0))
+				{
+					link[n] = '\0';
+					link[strcspn(link, "\n")] = '\0';
+
+					// A relative path is relative to the .git file
+					if (link[8] == '/')
+						sprintf(path, "%s/HEAD", link + 8);
+					else
+						sprintf(path + iLength, "/%s/HEAD", link + 8);
+
+					readGitHead(path, branch, iSize);
+				}
 			}
 
-			break;
-		case 4:
-			fourthCommand[l++] = args[iPos];
-			break;
-		default:
-			// We shouldn't reach here!
 			break;
 		}
 
-		// Check if we have just printed the last
-		// i.e. the NULL argument. If so, we should
-		// exit this loop by setting the flag.
-		if (args[iPos] == NULL)
-			iNullFound = 1;
+		// Go up one directory
+		path[iLength] = '\0';
 
-		// Go to the next argument.
-		iPos++;
+		while ((iLength > 0) && (path[iLength - 1] != '/'))
+			iLength--;
+
+		if (iLength > 0)
+			iLength--;
 	}
 
-	// Now we have split args into 4 separate command arguments,
-	// simply pass them to a helper function to run.
-	executeTriplePipeHelper(firstCommand, secondCommand, thirdCommand, fourthCommand);
+	free(path);
 }
 
-// getCommandFromHistory() function will search
-// the linked list of command history and return
-// the command with a given sequence number.
-char* getCommandFromHistory(int iSequenceNo)
+// findPromptValuesThread() function is the background
+// thread that finds the values asked for by a PromptRequest
+// and stores them in the PromptCache.
+void* findPromptValuesThread(void *arg)
 {
-	char *command = malloc(sizeof(char) * 256);
-	CommandHistNode *p = cmdHistList;
+	PromptRequest *request = arg;
+	char branch[256];
+	char load[16];
+	double average;
 
-	while (p && (p->iSequenceNo != iSequenceNo))
-		p = p->next;
+	if (request->gitDirectory != NULL)
+		findGitBranch(request->gitDirectory, branch, sizeof(branch));
 
-	if (p == NULL)
-		strcpy(command, "");	// couldn't find that sequence number in list
-	else
-		strcpy(command, p->command);
+	if (request->iLoadAverage)
+	{
+		if (getloadavg(&average, 1) == 1)
+			snprintf(load, sizeof(load), "%.2f", average);
+		else
+			strcpy(load, "?");
+	}
+
+	pthread_mutex_lock(&promptCache.lock);
+
+	if (request->gitDirectory != NULL)
+	{
+		free(promptCache.gitDirectory);
+		promptCache.gitDirectory = request->gitDirectory;
+		strcpy(promptCache.gitBranch, branch);
+		promptCache.gitTime = getMonotonicTime();
+	}
+
+	if (request->iLoadAverage)
+	{
+		strcpy(promptCache.loadAverage, load);
+		promptCache.loadTime = getMonotonicTime();
+	}
 
-	return command;
+	promptCache.iRunning = 0;
+	pthread_mutex_unlock(&promptCache.lock);
+
+	free(request);
+
+	return NULL;
 }
 
-// insertIntoCommandHistory() is used to insert
-// a new CommandHistNode into the cmdHistList.
-void insertIntoCommandHistory(int iSequenceNo, char *command)
+// startPromptThread() function starts the thread of
+// the PromptCache for "request", unless it is still
+// busy with an earlier one. It doesn't wait for it.
+void startPromptThread(PromptRequest *request)
 {
-	CommandHistNode* node = (CommandHistNode*) malloc(sizeof(CommandHistNode));
-	node->iSequenceNo = iSequenceNo;
-	strcpy(node->command, command);
-	node->next = NULL;
+	sigset_t all, saved;
+	int iRunning;
+
+	pthread_mutex_lock(&promptCache.lock);
+	iRunning = promptCache.iRunning;
+	promptCache.iRunning = 1;
+	pthread_mutex_unlock(&promptCache.lock);
 
-	if (!cmdHistList)
+	if (iRunning)
 	{
-		// List is currently empty, so simply
-		// point the list to the new node
-		cmdHistList = node;
+		free(request->gitDirectory);
+		free(request);
+		return;
 	}
-	else
+
+	if (promptCache.iThreadStarted)
 	{
-		CommandHistNode *p = cmdHistList;
+		pthread_join(promptCache.thread, NULL);
+		promptCache.iThreadStarted = 0;
+	}
 
-		while (p->next)
-			p = p->next;
+	// Signals are left to the shell, see refreshCommandIndex()
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
 
-		// Now p points to the last node in the list.
-		// Append the new node after it.
-		p->next = node;
+	if (pthread_create(&promptCache.thread, NULL, findPromptValuesThread, request) == 0)
+	{
+		promptCache.iThreadStarted = 1;
+	}
+	else
+	{
+		promptCache.iRunning = 0;
+		free(request->gitDirectory);
+		free(request);
 	}
-}
 
-void executeCommand(int);	// forward declaration
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
 
-// executeCommandHistory() function is used to execute
-// "cmdhist" command entered by user. This "cmdhist" command
-// tries to mimic the functionality of "history" command
-// available in some Unix shells.
-void executeCommandHistory(char **args, int iSequenceNo)
+// addPromptText() function appends text to the prompt
+// being rendered.
+void addPromptText(LineBuffer *prompt, const char *text)
 {
-	CommandHistNode *p = cmdHistList;
+	insertIntoLineBuffer(prompt, prompt->iLength, text, strlen(text));
+}
 
-	// If there was no numeric argument after
-	// "cmdhist" command
-	if (args[1] == NULL)
+// renderPrompt() function returns the prompt to show, made
+// from the PS1 environment variable like in other shells:
+//		\w	the current directory		\W	its last component
+//		\u	the user name				\h	the host name up to the first dot
+//		\H	the whole host name
+//		\$	# for root, $ otherwise		\t	the time as HH:MM:SS
+//		\j	the number of jobs			\?	the exit status of the last command
+//		\g	the git branch				\l	the load average
+//		\n	a newline					\e	an escape, e.g. for colours
+//		\\	a backslash					\[ \]	ignored
+// Nothing here makes a system call in the common case: the
+// directory is cached, see getCurrentDirectory(), the user
+// and host names are looked up once, and \g and \l show the
+// values found by the thread of the PromptCache. The prompt
+// stays valid until the next call.
+const char* renderPrompt()
+{
+	static LineBuffer prompt = { NULL, 0, 0 };
+	static char *user = NULL;
+	static char host[256] = "";
+	const char *template = getVariable("PS1");
+	const char *directory = getCurrentDirectory();
+	PromptRequest *request = NULL;
+	double now = 0;
+	char buffer[64];
+	const char *p;
+
+	if (template == NULL)
+		template = DEFAULT_PS1;
+
+	setLineBuffer(&prompt, "", 0);
+
+	for (p = template; *p != '\0'; ++p)
 	{
-		while (p)
+		if ((*p != '\\') || (p[1] == '\0'))
 		{
-			printf("%d\t%s", p->iSequenceNo, p->command);
-			p = p->next;
+			insertIntoLineBuffer(&prompt, prompt.iLength, p, 1);
+			continue;
 		}
-	}
-	else
-	{
-		// There was numeric argument after
-		// "cmdhist" command. User wants last
-		// n commands only from the history.
-		int n = atoi(args[1]);
-
-		int iStartNo = iSequenceNo - n + 1;
 
-		while (p)
+		switch (*++p)
+		{
+		case 'w':
+			addPromptText(&prompt, directory);
+			break;
+		case 'W':
+			addPromptText(&prompt, (strrchr(directory, '/') && directory[1]) ? strrchr(directory, '/') + 1 : directory);
+			break;
+		case 'u':
+			if (user == NULL)
+			{
+				struct passwd *pw = getpwuid(getuid());
+				user = strdup(getVariable("USER") ? getVariable("USER") : (pw ? pw->pw_name : "?"));
+			}
+			addPromptText(&prompt, user);
+			break;
+		case 'h':
+		case 'H':
+			if (host[0] == '\0')
+				gethostname(host, sizeof(host) - 1);
+			if (*p == 'h')
+				insertIntoLineBuffer(&prompt, prompt.iLength, host, strcspn(host, "."));
+			else
+				addPromptText(&prompt, host);
+			break;
+		case '$':
+			addPromptText(&prompt, (geteuid() == 0) ? "#" : "$");
+			break;
+		case 't':
 		{
-			if (p->iSequenceNo >= iStartNo)
-				printf("%d\t%s", p->iSequenceNo, p->command);
+			time_t t = time(NULL);
+			struct tm tm;
 
-			p = p->next;
+			localtime_r(&t, &tm);
+			strftime(buffer, sizeof(buffer), "%H:%M:%S", &tm);
+			addPromptText(&prompt, buffer);
+			break;
 		}
+		case 'j':
+			sprintf(buffer, "%d", jobTable.iCount);
+			addPromptText(&prompt, buffer);
+			break;
+		case '?':
+			sprintf(buffer, "%d", iLastStatus);
+			addPromptText(&prompt, buffer);
+			break;
+		case 'g':
+		case 'l':
+			if (now == 0)
+				now = getMonotonicTime();
+
+			if (request == NULL)
+				request = calloc(1, sizeof(PromptRequest));
+
+			pthread_mutex_lock(&promptCache.lock);
+
+			if (*p == 'g')
+			{
+				// A branch found for another directory is
+				// not shown, it may well be wrong here
+				int iSameDirectory = (promptCache.gitDirectory != NULL) &&
+									 (strcmp(promptCache.gitDirectory, directory) == 0);
+
+				if (iSameDirectory)
+					addPromptText(&prompt, promptCache.gitBranch);
+
+				if ((!iSameDirectory || (now - promptCache.gitTime >= PROMPT_SEGMENT_TTL)) &&
+					(request->gitDirectory == NULL))
+					request->gitDirectory = strdup(directory);
+			}
+			else
+			{
+				addPromptText(&prompt, promptCache.loadAverage);
+
+				if (now - promptCache.loadTime >= PROMPT_SEGMENT_TTL)
+					request->iLoadAverage = 1;
+			}
 
+			pthread_mutex_unlock(&promptCache.lock);
+			break;
+		case 'n':
+			addPromptText(&prompt, "\n");
+			break;
+		case 'e':
+			addPromptText(&prompt, "\033");
+			break;
+		case '\\':
+			addPromptText(&prompt, "\\");
+			break;
+		case '[':
+		case ']':
+			break;
+		default:
+			insertIntoLineBuffer(&prompt, prompt.iLength, p - 1, 2);
+			break;
+		}
 	}
 
-	printf("Enter command number (or Enter to quit): ");
-	char *sSeqNo = getUserInput();
-	int iSeqNo = atoi(sSeqNo);
+	if ((request != NULL) && ((request->gitDirectory != NULL) || request->iLoadAverage))
+		startPromptThread(request);
+	else
+		free(request);
 
-	// Ignore Enter key, otherwise execute the command
-	if (iSeqNo > 0)
-		executeCommand(iSeqNo);
+	return prompt.text;
 }
 
 // executeCommand() function will show the shell prompt
@@ -995,41 +10295,110 @@ void executeCommandHistory(char **args, int iSequenceNo)
 // parameter iUseHistorySeqNo is passed as 0 if the command
 // has to be manually entered by user on the shell prompt,
 // otherwise it will contain the sequence number if it has
-// to be run by using the command history.
+// to be run by using the command history (negative for
+// the n-th newest command).
 void executeCommand(int iUseHistorySeqNo)
 {
-	int status;
 	char *input = NULL;
-	char **arguments = NULL;
 
 	// iSequenceNo will track the sequence numbers of
 	// the commands being executed and record the same
 	// in the command history alongwith the command.
 	static int iSequenceNo = 0;
 
-	// Print the current working directory
-	// followed by shell prompt
-	char directory[256];
-	getcwd(directory, sizeof(directory));
-	printf("%s$ ", directory);
+	// The shell prompt is made from PS1, by default the
+	// current working directory followed by $
+	const char *prompt = renderPrompt();
+
+	// Everything this command needs, from the input line
+	// on, is allocated from the command arena and given
+	// back at once when the command is done.
+	ArenaMark mark = arenaMark(&commandArena);
+	size_t iOuterPeak = commandArena.iPeak;
+
+	commandArena.iPeak = arenaBytesUsed(&commandArena);
 
 	if (iUseHistorySeqNo == 0)
 	{
+		// Tell the user about the background
+		// jobs that have finished meanwhile
+		reportJobChanges();
+
 		// Get the command entered by user
 		// on the shell prompt
-		input = getUserInput();
+		input = getUserInput(prompt);
+
+		// The input has ended (e.g. Ctrl-D)
+		if (input == NULL)
+		{
+			printf("\n");
+			exit(0);
+		}
 	}
-	else if (iUseHistorySeqNo > 0)
+	else
 	{
 		// Get the command from the command
-		// history linked list
+		// history
+		printf("%s", prompt);
 		input = getCommandFromHistory(iUseHistorySeqNo);
 	}
 
 	// If the command entered is an empty string,
 	// do nothing and return.
 	if ((strcmp(input, "") == 0) || (strcmp(input, "\n") == 0))
+	{
+		arenaRelease(&commandArena, mark);
+		commandArena.iPeak = iOuterPeak;
 		return;
+	}
+
+	// If this line has been run before, reuse its parsed
+	// form from the parse cache. Otherwise parse the whole
+	// string input into the commands to run, and put a
+	// copy of the result into the cache.
+	double startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+	ParseCacheEntry *cached = lookupParseCache(input);
+	CommandLine *cmdLine;
+
+	if (cached != NULL)
+	{
+		cmdLine = cached->cmdLine;
+	}
+	else
+	{
+		cmdLine = parseCommandLine(&commandArena, input);
+
+		// The lines of a here-document follow the
+		// command, ask for them until it has ended.
+		while ((cmdLine != NULL) && cmdLine->iIncomplete && (iUseHistorySeqNo == 0))
+		{
+			char *line = getUserInput("> ");
+			size_t iLength = strlen(input);
+			char *text;
+
+			if (line == NULL)
+				break;
+
+			if ((iLength > 0) && (input[iLength - 1] == '\n'))
+				iLength--;
+
+			text = arenaAlloc(&commandArena, iLength + strlen(line) + 2);
+			memcpy(text, input, iLength);
+			text[iLength] = '\n';
+			strcpy(text + iLength + 1, line);
+
+			input = text;
+			cmdLine = parseCommandLine(&commandArena, input);
+		}
+
+		if ((cmdLine != NULL) && cmdLine->iIncomplete)
+			fprintf(stderr, "warning: here-document ended by the end of the input\n");
+
+		// The $ of a line are expanded each time it runs,
+		// so its parsed form can always be reused
+		if ((cmdLine != NULL) && (cmdLine->iNumCommands > 0) && !cmdLine->iIncomplete)
+			cached = insertIntoParseCache(input, cmdLine);
+	}
 
 	// Increment command sequence number
 	iSequenceNo++;
@@ -1038,67 +10407,266 @@ void executeCommand(int iUseHistorySeqNo)
 	// command history.
 	insertIntoCommandHistory(iSequenceNo, input);
 
-	// Split the whole string input into multiple arguments
-	CommandInfo ci;
-	arguments = getArguments(input, &ci);
+	if (fdTrace >= 0)
+	{
+		TraceArgs args;
+
+		initTraceArgs(&args);
+		addTraceString(&args, "input", input);
+		addTraceNumber(&args, "cached", cached != NULL);
+		traceEvent("parse", startTime, getMonotonicTime(), getpid(), &args);
+	}
 
-	switch (ci.type)
+	if ((cmdLine != NULL) && (cmdLine->iNumCommands > 0))
 	{
-	case Simple:
-		// There is no redirection or pipe in the command.
-		// Execute it normally.
-		executeNormal(arguments);
-		break;
-	case Output_Redirect:
-		// There is > redirection operator in command.
-		// Execute it accordingly (iAppend flag should
-		// be passed as 0).
-		executeOutputRedirect(arguments, ci.filename, 0);
-		break;
-	case Output_Append:
-		// There is >> redirection operator in command.
-		// Execute it accordingly (iAppend flag should
-		// be passed as 1).
-		executeOutputRedirect(arguments, ci.filename, 1);
-		break;
-	case Input_Redirect:
-		// There is < redirection operator in command.
-		// Execute it accordingly.
-		executeInputRedirect(arguments, ci.filename);
-		break;
-	case Piped_Chain:
-		// There is one or more | operators in command.
-		// Execute it accordingly.
-		executePipedChain(arguments);
-		break;
-	case Double_Pipe:
-		// There is || double-pipe operator in command.
-		// Execute it accordingly.
-		executeDoublePipe(arguments);
-		break;
-	case Triple_Pipe:
-		// There is ||| triple-pipe operator in command.
-		// Execute it accordingly.
-		executeTriplePipe(arguments);
-		break;
-	case Command_History:
-		// It is a "cmdhist" command which tries to mimic the
-		// "history" command available in some Unix shells.
-		executeCommandHistory(arguments, iSequenceNo);
-		break;
-	default:
-		// Unexpected, do error handling etc.
-		break;
+		// The entry must stay while it runs, even if
+		// a nested command (from cmdhist) fills the cache.
+		if (cached)
+			cached->iInUse++;
+
+		startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+		executeCommandLine(cmdLine);
+
+		if (fdTrace >= 0)
+			traceCommandLine(cmdLine, startTime);
+
+		if (cached)
+			cached->iInUse--;
+	}
+
+	if (iArenaDebug)
+		reportArenaUsage(input, commandArena.iPeak - mark.iBaseBytes - mark.iUsed);
+
+	// A command run from cmdhist is part of the
+	// peak of the cmdhist command itself.
+	if (iOuterPeak > commandArena.iPeak)
+		commandArena.iPeak = iOuterPeak;
+
+	arenaRelease(&commandArena, mark);
+}
+
+// Script structure type is used to contain a whole
+// script after it has been parsed.
+typedef struct
+{
+	CommandLine **lines;			// the non-empty lines, in order
+	int iNumLines;					// number of lines in "lines"
+	int iNumErrors;					// number of lines with a syntax error
+} Script;
+
+// parseScript() function parses all the lines of the
+// script "text" at once into "script", allocated from
+// "arena". A newline ends a command unless it is escaped
+// or quoted. Lines with a syntax error are reported
+// with their line number and left out.
+void parseScript(Arena *arena, const char *name, const char *text, Script *script)
+{
+	static ParseScratch lines;
+	Parser parser;
+
+	lines.iCount = 0;
+	script->iNumErrors = 0;
+
+	parser.arena = arena;
+	parser.source = name;
+	parser.start = text;
+	parser.lexer.input = text;
+	parser.lexer.out = arenaAlloc(arena, LEXER_BUFFER_SIZE(strlen(text)));
+	parser.lexer.iNewlines = 1;
+	parser.lexer.iNumHereDocs = 0;
+	parser.lexer.iHereIncomplete = 0;
+	parser.lexer.iExpand = 0;
+
+	do
+	{
+		parser.lexer.iInFanOut = 0;
+		nextToken(&parser.lexer, &parser.token);
+
+		CommandLine *line = parseLine(&parser);
+
+		if (line == NULL)
+		{
+			// Go on with the next line
+			script->iNumErrors++;
+
+			while ((parser.token.type != Token_Newline) && (parser.token.type != Token_End))
+				nextToken(&parser.lexer, &parser.token);
+		}
+		else if (line->iNumCommands > 0)
+		{
+			if (line->iIncomplete)
+				fprintf(stderr, "%s: warning: here-document ended by the end of the script\n", name);
+
+			addToScratch(&lines, line);
+		}
+	} while (parser.token.type != Token_End);
+
+	script->iNumLines = lines.iCount;
+	script->lines = arenaAlloc(arena, lines.iCount * sizeof(CommandLine *));
+	memcpy(script->lines, lines.items, lines.iCount * sizeof(CommandLine *));
+}
+
+// readWholeFile() function reads everything from the
+// descriptor "fd" into one NUL terminated buffer, with a
+// single read() when the size of the file is known.
+char* readWholeFile(int fd)
+{
+	struct stat st;
+	size_t iAllocated = 64 * 1024;
+	size_t iLength = 0;
+	char *text;
+
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode))
+		iAllocated = st.st_size + 1;
+
+	text = malloc(iAllocated);
+
+	while (1)
+	{
+		ssize_t n;
+
+		if (iLength + 1 == iAllocated)
+		{
+			iAllocated *= 2;
+			text = realloc(text, iAllocated);
+		}
+
+		n = read(fd, text + iLength, iAllocated - iLength - 1);
+
+		if ((n < 0) && (errno == EINTR))
+			continue;
+
+		if (n < 0)
+		{
+			free(text);
+			return NULL;
+		}
+
+		if (n == 0)
+			break;
+
+		iLength += n;
+	}
+
+	text[iLength] = '\0';
+	return text;
+}
+
+// runScript() function executes the script "text" without
+// a prompt, e.g. for "cshell -c 'ls | wc -l'", "cshell
+// script.sh" or commands piped into the shell. The whole
+// script is parsed first, then its commands are executed
+// one after the other. Every command gets the command
+// arena to itself, like a command typed by the user. It
+// returns the exit status of the shell.
+int runScript(const char *name, const char *text)
+{
+	Arena scriptArena = { NULL, NULL, 0, 0 };
+	double startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+	Script script;
+	int i;
+
+	parseScript(&scriptArena, name, text, &script);
+
+	if (fdTrace >= 0)
+	{
+		TraceArgs args;
+
+		initTraceArgs(&args);
+		addTraceString(&args, "script", name);
+		addTraceNumber(&args, "lines", script.iNumLines);
+		addTraceNumber(&args, "errors", script.iNumErrors);
+		traceEvent("parse", startTime, getMonotonicTime(), getpid(), &args);
+	}
+
+	for (i = 0; i < script.iNumLines; ++i)
+	{
+		ArenaMark mark = arenaMark(&commandArena);
+
+		startTime = (fdTrace >= 0) ? getMonotonicTime() : 0;
+		executeCommandLine(script.lines[i]);
+
+		if (fdTrace >= 0)
+			traceCommandLine(script.lines[i], startTime);
+
+		arenaRelease(&commandArena, mark);
 	}
 
-	// Deallocate any memory that's allocated
-	// for arguments
-	free(arguments);
-	arguments = NULL;
+	// Any output of the shell itself goes out before it
+	// exits, after the output of its last command.
+	fflush(stdout);
+
+	return (script.iNumErrors > 0) ? 2 : iLastStatus;
 }
 
-int main()
+#ifndef SHELL_NO_MAIN
+int main(int argc, char *argv[])
 {
+	// The environment becomes the variables of the shell
+	initVariables();
+	shellPid = getpid();
+	shellName = argv[0];
+
+	// Pick the way child processes are created
+	initLauncher();
+
+	// Report the memory used by every command
+	// if CSHELL_ARENA_DEBUG is set
+	iArenaDebug = (getenv("CSHELL_ARENA_DEBUG") != NULL);
+
+	// Report the resources used by every command
+	// if CSHELL_TIME is set, like "time -a on"
+	shellStartTime = getMonotonicTime();
+	iTimeAll = (getenv("CSHELL_TIME") != NULL);
+
+	// Write a trace of every command to the file
+	// named by CSHELL_TRACE, if it is set
+	initTrace();
+
+	// Set up an empty command history for this
+	// session. Scripts don't record their commands.
+	initCommandHistory();
+
+	// Job control is only for an interactive shell,
+	// but a script can still run jobs in the background
+	initJobs((argc == 1) && isatty(STDIN_FILENO));
+
+	// "cshell -c commands" runs the given commands
+	if ((argc > 1) && (strcmp(argv[1], "-c") == 0))
+	{
+		if (argc < 3)
+		{
+			fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+			return 2;
+		}
+
+		return runScript(argv[0], argv[2]);
+	}
+
+	// "cshell file" runs the script in the file, and
+	// input that isn't a terminal is a script as well
+	if ((argc > 1) || !isatty(STDIN_FILENO))
+	{
+		int fd = (argc > 1) ? open(argv[1], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+		const char *name = (argc > 1) ? argv[1] : argv[0];
+		char *text = (fd >= 0) ? readWholeFile(fd) : NULL;
+
+		if (text == NULL)
+		{
+			fprintf(stderr, "%s: %s: %s\n", argv[0], name, strerror(errno));
+			return 127;
+		}
+
+		if (fd != STDIN_FILENO)
+			close(fd);
+
+		return runScript(name, text);
+	}
+
+	// The history file is shared with the other
+	// interactive sessions
+	initHistoryFile();
+
 	// Use infinite loop to show the shell prompt
 	// and allow user to run commands repeatedly.
 	while (1)
@@ -1106,4 +10674,4 @@ int main()
 
 	return 0;
 }
-
+#endif